@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "align.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+/**
+ * Prepare a reference structure for fitting
+ *
+ * Stores the fitted atoms of the reference relative to their weighted
+ * center, premultiplied by their weights, so that each frame needs only one
+ * pass over its own coordinates.
+ *
+ * @param[in] n The number of atoms to fit.
+ * @param[in] idx The indices of the atoms to fit (such as from
+ *                maskToIndices), or NULL for atoms 0 to n-1.
+ * @param[in] mass The weight of every atom (such as the mass array of an atom
+ *                 table), or NULL to weight atoms equally.
+ * @param[in] xs The x coordinates of every atom of the reference.
+ * @param[in] ys The y coordinates of every atom of the reference.
+ * @param[in] zs The z coordinates of every atom of the reference.
+ * @return The reference, with n set to -1 if there are no atoms to fit or
+ *         their total weight is not positive.
+ */
+struct fitref newFitReference(int n, const int * idx, const double * mass,
+    const float * xs, const float * ys, const float * zs) {
+  struct fitref r = { .n = -1, .idx = NULL, .w = NULL, .wx = NULL,
+                      .wy = NULL, .wz = NULL, .wsum = 0, .g = 0,
+                      .center = { 0, 0, 0 } };
+  if(n <= 0)
+    return r;
+  double c[3] = { 0, 0, 0 };
+  double wsum = 0;
+  for(int k=0; k<n; k++) {
+    int i = idx ? idx[k] : k;
+    double w = mass ? mass[i] : 1;
+    c[0] += w*xs[i];
+    c[1] += w*ys[i];
+    c[2] += w*zs[i];
+    wsum += w;
+  }
+  if(!(wsum > 0))
+    return r;
+
+  r.n = n;
+  r.wsum = wsum;
+  for(int d=0; d<3; d++)
+    r.center[d] = c[d]/wsum;
+  r.idx = malloc(n * sizeof(int));
+  r.w = malloc(n * sizeof(double));
+  r.wx = malloc(n * sizeof(double));
+  r.wy = malloc(n * sizeof(double));
+  r.wz = malloc(n * sizeof(double));
+  for(int k=0; k<n; k++) {
+    int i = idx ? idx[k] : k;
+    double w = mass ? mass[i] : 1;
+    double x = xs[i]-r.center[0];
+    double y = ys[i]-r.center[1];
+    double z = zs[i]-r.center[2];
+    r.idx[k] = i;
+    r.w[k] = w;
+    r.wx[k] = w*x;
+    r.wy[k] = w*y;
+    r.wz[k] = w*z;
+    r.g += w*(x*x + y*y + z*z);
+  }
+  return r;
+}
+
+/**
+ * Frees the memory allocated for a fitting reference
+ *
+ * @param[in] r The reference to be freed.
+ */
+void freeFitReference(struct fitref r) {
+  free(r.idx);
+  free(r.w);
+  free(r.wx);
+  free(r.wy);
+  free(r.wz);
+}
+
+/**
+ * Check that a fitting reference can be applied to frames of a given size
+ *
+ * @param[in] r The reference.
+ * @param[in] natom The number of atoms in each frame.
+ * @return 1 if the reference is valid and every fitted atom is among the
+ *         natom atoms of a frame, and 0 otherwise.
+ */
+int fitsFrame(const struct fitref * r, int natom) {
+  if(r->n == -1)
+    return 0;
+  for(int k=0; k<r->n; k++)
+    if(r->idx[k] < 0 || r->idx[k] >= natom)
+      return 0;
+  return 1;
+}
+
+/**
+ * Compute the inner product matrix of a frame with a reference
+ *
+ * Gathers everything the fit needs from the fitted atoms of the frame in a
+ * single pass, two atoms at a time with SSE2 where available: the products
+ * with the reference, the weighted center, and the weighted sum of squares.
+ * Since the reference is stored centered, the products need no correction
+ * for the center of the frame. Sums are accumulated in double precision.
+ *
+ * @param[in] r The reference.
+ * @param[in] xs The x coordinates of every atom of the frame.
+ * @param[in] ys The y coordinates of every atom of the frame.
+ * @param[in] zs The z coordinates of every atom of the frame.
+ * @param[out] a The 3x3 inner product matrix, in row-major order; row i and
+ *               column j sum the reference's i and the frame's j
+ *               coordinates.
+ * @param[out] center The weighted center of the fitted atoms of the frame.
+ * @return The weighted sum of squares of the frame's fitted atoms about their
+ *         center.
+ */
+double innerProduct(const struct fitref * r, const float * xs,
+    const float * ys, const float * zs, double * a, double * center) {
+  double s[13] = { 0 }; // The 9 products, the 3 weighted sums, and squares
+  int k = 0;
+#ifdef __SSE2__
+  __m128d acc[13];
+  for(int q=0; q<13; q++)
+    acc[q] = _mm_setzero_pd();
+  for(; k+2<=r->n; k+=2) {
+    int i0 = r->idx[k];
+    int i1 = r->idx[k+1];
+    __m128d m[3] = { _mm_set_pd(xs[i1],xs[i0]), _mm_set_pd(ys[i1],ys[i0]),
+                     _mm_set_pd(zs[i1],zs[i0]) };
+    __m128d ref[3] = { _mm_loadu_pd(&r->wx[k]), _mm_loadu_pd(&r->wy[k]),
+                       _mm_loadu_pd(&r->wz[k]) };
+    __m128d w = _mm_loadu_pd(&r->w[k]);
+    for(int i=0; i<3; i++)
+      for(int j=0; j<3; j++)
+        acc[3*i+j] = _mm_add_pd(acc[3*i+j], _mm_mul_pd(ref[i],m[j]));
+    for(int j=0; j<3; j++) {
+      __m128d wm = _mm_mul_pd(w,m[j]);
+      acc[9+j] = _mm_add_pd(acc[9+j], wm);
+      acc[12] = _mm_add_pd(acc[12], _mm_mul_pd(wm,m[j]));
+    }
+  }
+  for(int q=0; q<13; q++) {
+    double pair[2];
+    _mm_storeu_pd(pair, acc[q]);
+    s[q] = pair[0] + pair[1];
+  }
+#endif
+  for(; k<r->n; k++) {
+    int i = r->idx[k];
+    double m[3] = { xs[i], ys[i], zs[i] };
+    double ref[3] = { r->wx[k], r->wy[k], r->wz[k] };
+    for(int p=0; p<3; p++)
+      for(int q=0; q<3; q++)
+        s[3*p+q] += ref[p]*m[q];
+    for(int q=0; q<3; q++) {
+      s[9+q] += r->w[k]*m[q];
+      s[12] += r->w[k]*m[q]*m[q];
+    }
+  }
+
+  for(int q=0; q<9; q++)
+    a[q] = s[q];
+  double c2 = 0;
+  for(int q=0; q<3; q++) {
+    center[q] = s[9+q]/r->wsum;
+    c2 += center[q]*center[q];
+  }
+  return s[12] - r->wsum*c2;
+}
+
+/**
+ * Find the optimal rotation from an inner product matrix
+ *
+ * Uses the quaternion characteristic polynomial (QCP) method of Theobald
+ * (Acta Cryst. A 61, 478, 2005) and Liu et al. (J. Comput. Chem. 31, 1561,
+ * 2010): the largest eigenvalue of the key 4x4 matrix is found by Newton
+ * iteration on its characteristic polynomial, starting from e0, which bounds
+ * it from above; its eigenvector is the quaternion of the rotation.
+ *
+ * @param[in] a The inner product matrix, as from innerProduct.
+ * @param[in] e0 Half the sum of the weighted sums of squares of the reference
+ *               and the frame, both about their centers.
+ * @param[in] wsum The total weight.
+ * @param[out] rot The rotation matrix, in row-major order, that moves the
+ *                 centered frame onto the centered reference, or NULL.
+ * @return The weighted RMSD after superposition.
+ */
+double qcpRotation(const double * a, double e0, double wsum, double * rot) {
+  const double Sxx = a[0], Sxy = a[1], Sxz = a[2];
+  const double Syx = a[3], Syy = a[4], Syz = a[5];
+  const double Szx = a[6], Szy = a[7], Szz = a[8];
+
+  // Coefficients of the characteristic polynomial x^4 + c2 x^2 + c1 x + c0
+  double Sxx2 = Sxx*Sxx, Syy2 = Syy*Syy, Szz2 = Szz*Szz;
+  double Sxy2 = Sxy*Sxy, Syz2 = Syz*Syz, Sxz2 = Sxz*Sxz;
+  double Syx2 = Syx*Syx, Szy2 = Szy*Szy, Szx2 = Szx*Szx;
+  double SyzSzymSyySzz2 = 2*(Syz*Szy - Syy*Szz);
+  double Sxx2Syy2Szz2Syz2Szy2 = Syy2 + Szz2 - Sxx2 + Syz2 + Szy2;
+  double c2 = -2*(Sxx2 + Syy2 + Szz2 + Sxy2 + Syx2 + Sxz2 + Szx2 + Syz2 +
+                  Szy2);
+  double c1 = 8*(Sxx*Syz*Szy + Syy*Szx*Sxz + Szz*Sxy*Syx - Sxx*Syy*Szz -
+                 Syz*Szx*Sxy - Szy*Syx*Sxz);
+  double SxzpSzx = Sxz+Szx, SyzpSzy = Syz+Szy, SxypSyx = Sxy+Syx;
+  double SyzmSzy = Syz-Szy, SxzmSzx = Sxz-Szx, SxymSyx = Sxy-Syx;
+  double SxxpSyy = Sxx+Syy, SxxmSyy = Sxx-Syy;
+  double Sxy2Sxz2Syx2Szx2 = Sxy2 + Sxz2 - Syx2 - Szx2;
+  double c0 = Sxy2Sxz2Syx2Szx2*Sxy2Sxz2Syx2Szx2
+    + (Sxx2Syy2Szz2Syz2Szy2+SyzSzymSyySzz2)
+      *(Sxx2Syy2Szz2Syz2Szy2-SyzSzymSyySzz2)
+    + (-SxzpSzx*SyzmSzy + SxymSyx*(SxxmSyy-Szz))*
+      (-SxzmSzx*SyzpSzy + SxymSyx*(SxxmSyy+Szz))
+    + (-SxzpSzx*SyzpSzy - SxypSyx*(SxxpSyy-Szz))*
+      (-SxzmSzx*SyzmSzy - SxypSyx*(SxxpSyy+Szz))
+    + (SxypSyx*SyzpSzy + SxzpSzx*(SxxmSyy+Szz))*
+      (-SxymSyx*SyzmSzy + SxzpSzx*(SxxpSyy+Szz))
+    + (SxypSyx*SyzmSzy + SxzmSzx*(SxxmSyy-Szz))*
+      (-SxymSyx*SyzpSzy + SxzmSzx*(SxxpSyy-Szz));
+
+  // Newton iteration for the largest root
+  double lambda = e0;
+  for(int i=0; i<50; i++) {
+    double old = lambda;
+    double x2 = lambda*lambda;
+    double b = (x2 + c2)*lambda;
+    double aa = b + c1;
+    lambda -= (aa*lambda + c0)/(2*x2*lambda + b + aa);
+    if(fabs(lambda-old) < fabs(1e-11*lambda))
+      break;
+  }
+  double rmsd = sqrt(fabs(2*(e0-lambda)/wsum));
+  if(!rot)
+    return rmsd;
+
+  // The quaternion is a column of the adjugate of the shifted key matrix;
+  // try further columns where one is too small to be accurate
+  double a11 = SxxpSyy + Szz - lambda, a12 = SyzmSzy, a13 = -SxzmSzx;
+  double a14 = SxymSyx, a21 = SyzmSzy, a22 = SxxmSyy - Szz - lambda;
+  double a23 = SxypSyx, a24 = SxzpSzx, a31 = a13, a32 = a23;
+  double a33 = Syy - Sxx - Szz - lambda, a34 = SyzpSzy, a41 = a14, a42 = a24;
+  double a43 = a34, a44 = Szz - SxxpSyy - lambda;
+  double a3344_4334 = a33*a44 - a43*a34, a3244_4234 = a32*a44 - a42*a34;
+  double a3243_4233 = a32*a43 - a42*a33, a3143_4133 = a31*a43 - a41*a33;
+  double a3144_4134 = a31*a44 - a41*a34, a3142_4132 = a31*a42 - a41*a32;
+  double q1 = a22*a3344_4334 - a23*a3244_4234 + a24*a3243_4233;
+  double q2 = -a21*a3344_4334 + a23*a3144_4134 - a24*a3143_4133;
+  double q3 = a21*a3244_4234 - a22*a3144_4134 + a24*a3142_4132;
+  double q4 = -a21*a3243_4233 + a22*a3143_4133 - a23*a3142_4132;
+  double qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+  const double evecprec = 1e-6;
+  if(qsqr < evecprec) {
+    q1 = a12*a3344_4334 - a13*a3244_4234 + a14*a3243_4233;
+    q2 = -a11*a3344_4334 + a13*a3144_4134 - a14*a3143_4133;
+    q3 = a11*a3244_4234 - a12*a3144_4134 + a14*a3142_4132;
+    q4 = -a11*a3243_4233 + a12*a3143_4133 - a13*a3142_4132;
+    qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+  }
+  if(qsqr < evecprec) {
+    double a1324_1423 = a13*a24 - a14*a23, a1224_1422 = a12*a24 - a14*a22;
+    double a1223_1322 = a12*a23 - a13*a22, a1124_1421 = a11*a24 - a14*a21;
+    double a1123_1321 = a11*a23 - a13*a21, a1122_1221 = a11*a22 - a12*a21;
+    q1 = a42*a1324_1423 - a43*a1224_1422 + a44*a1223_1322;
+    q2 = -a41*a1324_1423 + a43*a1124_1421 - a44*a1123_1321;
+    q3 = a41*a1224_1422 - a42*a1124_1421 + a44*a1122_1221;
+    q4 = -a41*a1223_1322 + a42*a1123_1321 - a43*a1122_1221;
+    qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+    if(qsqr < evecprec) {
+      q1 = a32*a1324_1423 - a33*a1224_1422 + a34*a1223_1322;
+      q2 = -a31*a1324_1423 + a33*a1124_1421 - a34*a1123_1321;
+      q3 = a31*a1224_1422 - a32*a1124_1421 + a34*a1122_1221;
+      q4 = -a31*a1223_1322 + a32*a1123_1321 - a33*a1122_1221;
+      qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+    }
+  }
+  if(qsqr < evecprec) { // Degenerate: the structures are already aligned
+    for(int i=0; i<9; i++)
+      rot[i] = i%4 ? 0 : 1;
+    return rmsd;
+  }
+
+  double normq = sqrt(qsqr);
+  q1 /= normq;
+  q2 /= normq;
+  q3 /= normq;
+  q4 /= normq;
+  double a2 = q1*q1, x2 = q2*q2, y2 = q3*q3, z2 = q4*q4;
+  double xy = q2*q3, az = q1*q4, zx = q4*q2, ay = q1*q3, yz = q3*q4;
+  double ax = q1*q2;
+  rot[0] = a2 + x2 - y2 - z2;
+  rot[1] = 2*(xy + az);
+  rot[2] = 2*(zx - ay);
+  rot[3] = 2*(xy - az);
+  rot[4] = a2 - x2 + y2 - z2;
+  rot[5] = 2*(yz + ax);
+  rot[6] = 2*(zx + ay);
+  rot[7] = 2*(yz - ax);
+  rot[8] = a2 - x2 - y2 + z2;
+  return rmsd;
+}
+
+/**
+ * Rotate and translate coordinates in place
+ *
+ * Moves each atom by x' = R (x - from) + to, four atoms at a time with SSE2
+ * where available.
+ *
+ * @param[in] rot The rotation matrix R, in row-major order.
+ * @param[in] from The point moved to the origin before rotating.
+ * @param[in] to The point the origin is moved to after rotating.
+ * @param[in] natom The number of atoms.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+void rotateCoords(const double * rot, const double * from, const double * to,
+    int natom, float * xs, float * ys, float * zs) {
+  // Fold the translations into one offset: x' = R x + (to - R from)
+  float r[9];
+  float t[3];
+  for(int i=0; i<3; i++) {
+    t[i] = to[i] - (rot[3*i]*from[0] + rot[3*i+1]*from[1] +
+                    rot[3*i+2]*from[2]);
+    for(int j=0; j<3; j++)
+      r[3*i+j] = rot[3*i+j];
+  }
+  int k = 0;
+#ifdef __SSE2__
+  __m128 vr[9], vt[3];
+  for(int i=0; i<9; i++)
+    vr[i] = _mm_set1_ps(r[i]);
+  for(int i=0; i<3; i++)
+    vt[i] = _mm_set1_ps(t[i]);
+  for(; k+4<=natom; k+=4) {
+    __m128 x = _mm_loadu_ps(&xs[k]);
+    __m128 y = _mm_loadu_ps(&ys[k]);
+    __m128 z = _mm_loadu_ps(&zs[k]);
+    __m128 out[3];
+    for(int i=0; i<3; i++)
+      out[i] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vr[3*i],x),
+                                     _mm_mul_ps(vr[3*i+1],y)),
+                          _mm_add_ps(_mm_mul_ps(vr[3*i+2],z),vt[i]));
+    _mm_storeu_ps(&xs[k], out[0]);
+    _mm_storeu_ps(&ys[k], out[1]);
+    _mm_storeu_ps(&zs[k], out[2]);
+  }
+#endif
+  for(; k<natom; k++) {
+    float x = xs[k], y = ys[k], z = zs[k];
+    xs[k] = r[0]*x + r[1]*y + r[2]*z + t[0];
+    ys[k] = r[3]*x + r[4]*y + r[5]*z + t[1];
+    zs[k] = r[6]*x + r[7]*y + r[8]*z + t[2];
+  }
+}
+
+/**
+ * Superpose a frame on a reference
+ *
+ * Finds the rotation and translation that minimize the weighted RMSD between
+ * the fitted atoms of the frame and the reference, and optionally applies it
+ * to every atom of the frame.
+ *
+ * @param[in] r The reference.
+ * @param[in] natom The number of atoms in the frame.
+ * @param[in,out] xs The x coordinates of every atom of the frame.
+ * @param[in,out] ys The y coordinates of every atom of the frame.
+ * @param[in,out] zs The z coordinates of every atom of the frame.
+ * @param[in] apply Whether to move the frame onto the reference.
+ * @param[out] rot The rotation matrix, in row-major order, or NULL.
+ * @return The weighted RMSD of the fitted atoms after superposition.
+ */
+double superpose(const struct fitref * r, int natom, float * xs, float * ys,
+    float * zs, int apply, double * rot) {
+  double a[9], center[3], m[9];
+  double g = innerProduct(r, xs, ys, zs, a, center);
+  double rmsd = qcpRotation(a, (r->g + g)/2, r->wsum, m);
+  if(rot)
+    memcpy(rot, m, 9 * sizeof(double));
+  if(apply)
+    rotateCoords(m, center, r->center, natom, xs, ys, zs);
+  return rmsd;
+}
+
+/**
+ * Copy a file
+ *
+ * @param[in] from The path of the file to copy.
+ * @param[in] to The path of the copy.
+ * @return 0 on success, or -1 on failure.
+ */
+static int copyFile(const char * from, const char * to) {
+  FILE * in = fopen(from, "rb");
+  if(!in)
+    return -1;
+  FILE * out = fopen(to, "wb");
+  if(!out) {
+    fclose(in);
+    return -1;
+  }
+  size_t size = 1<<20;
+  char * buf = malloc(size);
+  size_t got;
+  int err = 0;
+  while((got = fread(buf, 1, size, in)) > 0)
+    if(fwrite(buf, 1, got, out) != got)
+      err = -1;
+  free(buf);
+  fclose(in);
+  if(fclose(out))
+    err = -1;
+  return err;
+}
+
+struct alignrun {
+  const struct fitref * r;
+  int natom; // atoms in each frame
+  char * outpath; // aligned DCD, or NULL
+  double * rmsd; // RMSD of every frame
+  bool failed; // whether a thread could not open the output
+};
+
+/**
+ * Open the output of an alignment for one thread
+ *
+ * The init callback of the pipeline stage of alignTrajectory.
+ *
+ * @param[in] data The alignrun struct.
+ * @return A writable handle on the output, or NULL if it cannot be opened.
+ */
+static void *alignInit(void * data) {
+  struct alignrun * a = data;
+  return openWritableDCD(a->outpath);
+}
+
+/**
+ * Superpose a frame on the reference, writing it out if there is an output
+ *
+ * The frame callback of the pipeline stage of alignTrajectory.
+ *
+ * @param[in,out] data The alignrun struct, receiving the RMSD of frame f.
+ * @param[in] state The thread's output handle, or NULL.
+ * @param[in] f The frame.
+ * @param[in] uc Unused.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+static void alignFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct alignrun * a = data;
+  struct dcd * out = state;
+  a->rmsd[f] = superpose(a->r, a->natom, xs, ys, zs, out!=NULL, NULL);
+  if(out) {
+    goToFrame(out, f);
+    writeCoords(out, xs, ys, zs);
+  }
+}
+
+/**
+ * Close the output of an alignment for one thread
+ *
+ * The merge callback of the pipeline stage of alignTrajectory.
+ *
+ * @param[in,out] data The alignrun struct, marked failed if the output could
+ *                     not be opened.
+ * @param[in] state The thread's output handle, or NULL.
+ */
+static void alignMerge(void * data, void * state) {
+  struct alignrun * a = data;
+  if(state)
+    closeDCD(state);
+  else
+    a->failed = true;
+}
+
+/**
+ * Superpose every frame of a DCD on a reference
+ *
+ * Frames are read in parallel by runPipeline. If an output path is given,
+ * the DCD is first copied there, and each thread writes its aligned frames
+ * over the copy through its own writable handle, so that frames can be
+ * written in any order. The unit cells are copied unchanged.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] r The reference.
+ * @param[in] outpath The path for the aligned DCD, or NULL to compute RMSDs
+ *                    only. It may be the same as path to align in place.
+ * @return The RMSD of each frame after superposition, or NULL if the DCD
+ *         cannot be read, the reference fits atoms the DCD does not have
+ *         (see fitsFrame), or the output cannot be written.
+ */
+double *alignTrajectory(char * path, const struct fitref * r, char * outpath) {
+  struct dcd * d = openDCD(path);
+  if(!d)
+    return NULL;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+  if(!fitsFrame(r, (int) natoms))
+    return NULL;
+  if(outpath && strcmp(path,outpath) && copyFile(path,outpath))
+    return NULL;
+
+  double * rmsd = malloc((nframes ? nframes : 1) * sizeof(double));
+  struct alignrun a = { .r = r, .natom = natoms, .outpath = outpath,
+                        .rmsd = rmsd, .failed = false };
+  struct stage s = { .data = &a, .mask = NULL,
+                     .init = outpath ? alignInit : NULL, .frame = alignFrame,
+                     .combine = NULL, .merge = outpath ? alignMerge : NULL };
+  if(runPipeline(path, 1, &s, NULL) == -1 || a.failed) {
+    free(rmsd);
+    return NULL;
+  }
+  return rmsd;
+}
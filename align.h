@@ -0,0 +1,28 @@
+#ifndef ALIGN
+#define ALIGN
+
+struct fitref {
+  int n; // number of atoms fitted
+  int * idx; // atom index of each fitted atom
+  double * w; // weight of each fitted atom
+  double * wx; // weighted reference coordinates, relative to the center
+  double * wy;
+  double * wz;
+  double wsum; // total weight
+  double g; // weighted sum of squares of the centered reference
+  double center[3]; // weighted center of the reference
+};
+
+struct fitref newFitReference(int n, const int * idx, const double * mass,
+    const float * xs, const float * ys, const float * zs);
+void freeFitReference(struct fitref r);
+int fitsFrame(const struct fitref * r, int natom);
+double innerProduct(const struct fitref * r, const float * xs,
+    const float * ys, const float * zs, double * a, double * center);
+double qcpRotation(const double * a, double e0, double wsum, double * rot);
+void rotateCoords(const double * rot, const double * from, const double * to,
+    int natom, float * xs, float * ys, float * zs);
+double superpose(const struct fitref * r, int natom, float * xs, float * ys,
+    float * zs, int apply, double * rot);
+double *alignTrajectory(char * path, const struct fitref * r, char * outpath);
+#endif
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+
+#include "atomindex.h"
+
+/**
+ * Pack the symbol IDs of a (segment, residue ID, name) triple into a key
+ *
+ * Each ID takes 21 bits, which is exact for symbol tables of up to 2^21
+ * symbols. Larger tables may give equal keys for different triples, so keys
+ * are only a filter and a match is confirmed against the atom table.
+ *
+ * @param[in] seg The symbol ID of the segment name.
+ * @param[in] resid The symbol ID of the residue ID.
+ * @param[in] name The symbol ID of the atom name.
+ * @return The key.
+ */
+static uint64_t packKey(int seg, int resid, int name) {
+  const uint64_t m = (1u<<21)-1;
+  return ((uint64_t) seg & m) << 42 | ((uint64_t) resid & m) << 21 |
+    ((uint64_t) name & m);
+}
+
+/**
+ * Find the slot of a triple
+ *
+ * @param[in] x The index.
+ * @param[in] seg The symbol ID of the segment name.
+ * @param[in] resid The symbol ID of the residue ID.
+ * @param[in] name The symbol ID of the atom name.
+ * @return The slot holding the triple, or the empty slot where it belongs.
+ */
+static int findSlot(const struct atomindex * x, int seg, int resid,
+    int name) {
+  const struct atomtable * t = x->t;
+  uint64_t key = packKey(seg, resid, name);
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+  int s = (int) (h >> 32) & (x->nslot-1);
+  while(x->slots[s]) {
+    int a = x->slots[s]-1;
+    if(x->keys[s]==key && t->seg[a]==seg && t->resid[a]==resid &&
+       t->name[a]==name)
+      break;
+    s = (s+1) & (x->nslot-1);
+  }
+  return s;
+}
+
+/**
+ * Fill the hash table of an index
+ *
+ * If several atoms share a triple, the first of them is kept and the rest are
+ * counted in ndup.
+ *
+ * @param[in,out] x The index.
+ */
+static void buildIndex(struct atomindex * x) {
+  const struct atomtable * t = x->t;
+  int natom = t->natom > 0 ? t->natom : 0;
+  x->nslot = 64;
+  while(x->nslot < 2*natom)
+    x->nslot *= 2;
+  x->keys = malloc(x->nslot * sizeof(uint64_t));
+  x->slots = calloc(x->nslot, sizeof(int));
+  x->ndup = 0;
+  for(int i=0; i<natom; i++) {
+    int s = findSlot(x, t->seg[i], t->resid[i], t->name[i]);
+    if(x->slots[s]) {
+      x->ndup++;
+      continue;
+    }
+    x->keys[s] = packKey(t->seg[i], t->resid[i], t->name[i]);
+    x->slots[s] = i+1;
+  }
+  x->built = 1;
+}
+
+/**
+ * Create an index of the atoms of an atom table by segment name, residue ID
+ * and atom name
+ *
+ * The index resolves a triple to its atom in constant time, instead of a scan
+ * over every atom. It refers to the atom table (such as the table of a psf or
+ * psfpdb struct), which must not be changed or freed while the index is in
+ * use. A lazy index is built by the first lookup, so that tools which may not
+ * need it pay nothing; since that lookup modifies the index, the first lookup
+ * must not race with others.
+ *
+ * @param[in] t The atom table.
+ * @param[in] lazy Whether to defer building the index to the first lookup.
+ * @return The index.
+ */
+struct atomindex newAtomIndex(const struct atomtable * t, int lazy) {
+  struct atomindex x = { .t = t, .built = 0, .nslot = 0, .keys = NULL,
+                         .slots = NULL, .ndup = 0 };
+  if(!lazy)
+    buildIndex(&x);
+  return x;
+}
+
+/**
+ * Find the atom with a segment name, residue ID and atom name
+ *
+ * @param[in,out] x The index, which is built now if it was created lazily.
+ * @param[in] seg The segment name.
+ * @param[in] resid The residue ID.
+ * @param[in] name The atom name.
+ * @return The index of the first atom with the triple, or -1 if there is
+ *         none.
+ */
+int findAtom(struct atomindex * x, const char * seg, const char * resid,
+    const char * name) {
+  if(!x->built)
+    buildIndex(x);
+  const struct symtab * syms = &x->t->syms;
+  int sid = findSymbol(syms, seg);
+  int rid = findSymbol(syms, resid);
+  int nid = findSymbol(syms, name);
+  if(sid < 0 || rid < 0 || nid < 0)
+    return -1;
+  return x->slots[findSlot(x, sid, rid, nid)]-1;
+}
+
+/**
+ * Find the atoms of many (segment name, residue ID, atom name) triples
+ *
+ * The lookups are spread over OpenMP threads.
+ *
+ * @param[in,out] x The index, which is built now if it was created lazily.
+ * @param[in] n The number of triples.
+ * @param[in] seg The segment name of each triple.
+ * @param[in] resid The residue ID of each triple.
+ * @param[in] name The atom name of each triple.
+ * @param[out] idx The atom of each triple, or -1 where there is none.
+ * @return The number of triples found.
+ */
+int findAtoms(struct atomindex * x, int n, const char * const * seg,
+    const char * const * resid, const char * const * name, int * idx) {
+  if(!x->built)
+    buildIndex(x); // Before the threads start, so that none of them builds it
+  int found = 0;
+  #pragma omp parallel for schedule(static) reduction(+:found)
+  for(int i=0; i<n; i++) {
+    idx[i] = findAtom(x, seg[i], resid[i], name[i]);
+    found += idx[i] >= 0;
+  }
+  return found;
+}
+
+/**
+ * Frees the memory allocated for an atom index
+ *
+ * The atom table it refers to is not freed.
+ *
+ * @param[in] x The index to be freed.
+ */
+void freeAtomIndex(struct atomindex x) {
+  free(x.keys);
+  free(x.slots);
+}
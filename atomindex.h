@@ -0,0 +1,23 @@
+#ifndef ATOMINDEX
+#define ATOMINDEX
+
+#include <stdint.h>
+
+#include "symtab.h"
+
+struct atomindex {
+  const struct atomtable * t; // must outlive the index
+  int built; // 0 until the first lookup when built lazily
+  int nslot; // length of the slot arrays, always a power of two
+  uint64_t * keys; // packed (segment, residue ID, name) key of each slot
+  int * slots; // atom index + 1 for each occupied slot, 0 if empty
+  int ndup; // atoms whose triple repeats that of an earlier atom
+};
+
+struct atomindex newAtomIndex(const struct atomtable * t, int lazy);
+int findAtom(struct atomindex * x, const char * seg, const char * resid,
+    const char * name);
+int findAtoms(struct atomindex * x, int n, const char * const * seg,
+    const char * const * resid, const char * const * name, int * idx);
+void freeAtomIndex(struct atomindex x);
+#endif
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "cif.h"
+#include "mapfile.h"
+
+#define BLOCK 65536 // Rows of the atom_site loop tokenized before decoding
+
+struct token {
+  const char * s; // Points into the mapped file; not null-terminated
+  int len;
+  bool quoted;
+};
+
+// Columns of the atom_site loop understood by the reader
+enum {
+  COL_GROUP, COL_ID, COL_TYPE, COL_LABEL_ATOM, COL_AUTH_ATOM, COL_ALT,
+  COL_LABEL_COMP, COL_AUTH_COMP, COL_LABEL_ASYM, COL_AUTH_ASYM, COL_LABEL_SEQ,
+  COL_AUTH_SEQ, COL_INS, COL_X, COL_Y, COL_Z, COL_OCC, COL_B, COL_CHARGE,
+  COL_MODEL, NCOL
+};
+
+static const char * const colNames[NCOL] = {
+  "group_pdb", "id", "type_symbol", "label_atom_id", "auth_atom_id",
+  "label_alt_id", "label_comp_id", "auth_comp_id", "label_asym_id",
+  "auth_asym_id", "label_seq_id", "auth_seq_id", "pdbx_pdb_ins_code",
+  "cartn_x", "cartn_y", "cartn_z", "occupancy", "b_iso_or_equiv",
+  "pdbx_formal_charge", "pdbx_pdb_model_num"
+};
+
+// The field flag that requires each column; 0 if it is always needed
+static const int colFields[NCOL] = {
+  0, CIF_SERIAL, CIF_ELEMENT, CIF_NAME, CIF_NAME, CIF_ALTLOC, CIF_RESNAME,
+  CIF_RESNAME, CIF_CHAIN, CIF_CHAIN, CIF_RESSEQ, CIF_RESSEQ, CIF_ICODE,
+  CIF_COORDS, CIF_COORDS, CIF_COORDS, CIF_OCCUPANCY, CIF_BFACTOR, CIF_CHARGE,
+  0
+};
+
+/**
+ * Test whether a character separates CIF tokens
+ *
+ * CIF text may only contain printable characters and whitespace, so any
+ * control character is taken as whitespace; this is a single comparison, which
+ * matters in the tokenizer's inner loop.
+ *
+ * @param[in] c The character.
+ * @return true for whitespace.
+ */
+static bool isBlank(char c) {
+  return (unsigned char) c <= ' ';
+}
+
+/**
+ * Read the next token of a CIF file
+ *
+ * Skips whitespace and comments, then returns the extent of the next token in
+ * place. Quoted strings end at a matching quote followed by whitespace, and
+ * text fields run from a semicolon at the start of a line to the next line
+ * beginning with a semicolon; in both cases the delimiters are excluded from
+ * the token.
+ *
+ * @param[in] data The start of the file, used to recognize line starts.
+ * @param[in,out] pos The current position, advanced past the token.
+ * @param[in] end The end of the file.
+ * @param[out] t The token.
+ * @return true if a token was read, or false at the end of the file.
+ */
+static bool nextToken(const char * data, const char ** pos, const char * end,
+    struct token * t) {
+  const char * c = *pos;
+  while(c<end) {
+    if(*c=='#') {
+      while(c<end && *c!='\n')
+        c++;
+    }
+    else if(isBlank(*c))
+      c++;
+    else
+      break;
+  }
+  if(c==end) {
+    *pos = c;
+    return false;
+  }
+
+  if(*c==';' && (c==data || c[-1]=='\n' || c[-1]=='\r')) {
+    // Text field, closed by a semicolon at the start of a line
+    const char * s = ++c;
+    while(c<end && !(*c==';' && (c[-1]=='\n' || c[-1]=='\r')))
+      c++;
+    *t = (struct token) { .s = s, .len = c-s, .quoted = true };
+    *pos = c<end ? c+1 : c;
+    return true;
+  }
+
+  if(*c=='\'' || *c=='"') {
+    // A quote only closes the string when followed by whitespace
+    char q = *c;
+    const char * s = ++c;
+    while(c<end && !(*c==q && (c+1==end || isBlank(c[1]))))
+      c++;
+    *t = (struct token) { .s = s, .len = c-s, .quoted = true };
+    *pos = c<end ? c+1 : c;
+    return true;
+  }
+
+  const char * s = c;
+  while(c<end && !isBlank(*c))
+    c++;
+  *t = (struct token) { .s = s, .len = c-s, .quoted = false };
+  *pos = c;
+  return true;
+}
+
+/**
+ * Compare the start of a token to a lowercase word, ignoring case
+ *
+ * @param[in] t The token.
+ * @param[in] word The lowercase word.
+ * @param[in] prefix true to match tokens that merely begin with the word.
+ * @return true if the token matches.
+ */
+static bool tokenIs(struct token t, const char * word, bool prefix) {
+  int n = strlen(word);
+  if(t.quoted || t.len<n || (!prefix && t.len!=n))
+    return false;
+  for(int i=0; i<n; i++)
+    if(tolower((unsigned char) t.s[i])!=word[i])
+      return false;
+  return true;
+}
+
+/**
+ * Test whether a token is a data name or reserved word rather than a value
+ *
+ * @param[in] t The token.
+ * @return true if the token ends a list of loop values.
+ */
+static bool isKeyword(struct token t) {
+  if(t.quoted || !t.len)
+    return false;
+  if(t.s[0]=='_')
+    return true;
+  if(t.len<5 || (t.s[4]!='_' && t.len!=7))
+    return false; // Quick rejection; only global_ lacks '_' at index 4
+  return tokenIs(t,"loop_",false) ||
+    tokenIs(t,"data_",true) || tokenIs(t,"save_",true) ||
+    tokenIs(t,"global_",false) || tokenIs(t,"stop_",false);
+}
+
+/**
+ * Test whether a value is one of the CIF null values '.' or '?'
+ *
+ * @param[in] t The token.
+ * @return true if the value is missing.
+ */
+static bool isNull(struct token t) {
+  return t.len==0 || (!t.quoted && t.len==1 && (t.s[0]=='.' || t.s[0]=='?'));
+}
+
+/**
+ * Parse a CIF number
+ *
+ * Handles the plain decimal notation used for coordinates and other atom_site
+ * values directly, and hands anything else (such as exponents) to strtod.
+ * A standard uncertainty in parentheses, as in "1.234(5)", is ignored.
+ *
+ * @param[in] t The token.
+ * @return The value, or 0 for null values.
+ */
+static double parseNumber(struct token t) {
+  if(isNull(t))
+    return 0;
+  int i = 0;
+  bool neg = false;
+  if(t.s[i]=='-' || t.s[i]=='+')
+    neg = t.s[i++]=='-';
+  long long mant = 0;
+  long long scale = 1;
+  bool point = false;
+  for(; i<t.len && t.s[i]!='('; i++) {
+    if(t.s[i]=='.' && !point) {
+      point = true;
+      continue;
+    }
+    if((unsigned) (t.s[i]-'0') >= 10 || mant > 100000000000000LL) {
+      char buffer[32] = ""; // Unusual notation; use the library parser
+      memcpy(buffer, t.s, t.len<31 ? t.len : 31);
+      return strtod(buffer, NULL);
+    }
+    mant = 10*mant + (t.s[i]-'0');
+    if(point)
+      scale *= 10;
+  }
+  double v = (double) mant / scale;
+  return neg ? -v : v;
+}
+
+/**
+ * Copy a token into a fixed-size, null-terminated field
+ *
+ * Null values leave the field empty, and long values are truncated.
+ *
+ * @param[out] dst The field, of max+1 chars.
+ * @param[in] t The token.
+ * @param[in] max The most characters to copy.
+ */
+static void copyToken(char * dst, struct token t, int max) {
+  int n = isNull(t) ? 0 : (t.len<max ? t.len : max);
+  memcpy(dst, t.s, n);
+  dst[n] = '\0';
+}
+
+/**
+ * Store a data item outside of a loop in the unit cell, if it describes it
+ *
+ * @param[in] tag The data name.
+ * @param[in] value Its value.
+ * @param[in,out] cell The unit cell.
+ */
+static void setCellItem(struct token tag, struct token value,
+    struct cryst * cell) {
+  if(tokenIs(tag,"_cell.length_a",false)) {
+    cell->a = parseNumber(value);
+    cell->valid = true;
+  }
+  else if(tokenIs(tag,"_cell.length_b",false))
+    cell->b = parseNumber(value);
+  else if(tokenIs(tag,"_cell.length_c",false))
+    cell->c = parseNumber(value);
+  else if(tokenIs(tag,"_cell.angle_alpha",false))
+    cell->alpha = parseNumber(value);
+  else if(tokenIs(tag,"_cell.angle_beta",false))
+    cell->beta = parseNumber(value);
+  else if(tokenIs(tag,"_cell.angle_gamma",false))
+    cell->gamma = parseNumber(value);
+  else if(tokenIs(tag,"_cell.z_pdb",false))
+    cell->z = isNull(value) ? -1 : (int) parseNumber(value);
+  else if(tokenIs(tag,"_symmetry.space_group_name_h-m",false) ||
+      tokenIs(tag,"_space_group.name_h-m_alt",false))
+    copyToken(cell->sGroup, value, 11);
+}
+
+/**
+ * State of the atom_site loop being read
+ */
+struct sitereader {
+  int fields; // The CIF_ fields requested
+  int slot[NCOL]; // Block column holding each atom_site column, or -1
+  int nslot;
+  struct token * cells; // Column-major block: cells[slot*BLOCK + row]
+  int nrow;
+  char model[16]; // Model number of the first row kept
+  int modellen; // -1 until the first row is kept
+  int cap;
+};
+
+/**
+ * Format a CIF formal charge in the PDB style
+ *
+ * @param[out] dst The three-character charge field.
+ * @param[in] t The token holding a signed integer charge.
+ */
+static void setCharge(char * dst, struct token t) {
+  memset(dst,'\0',3);
+  if(isNull(t))
+    return;
+  int q = (int) parseNumber(t);
+  if(q==0 || q<-9 || q>9)
+    return;
+  dst[0] = '0' + (q<0 ? -q : q);
+  dst[1] = q<0 ? '-' : '+';
+}
+
+/**
+ * Decode a block of atom_site rows into the pdb struct
+ *
+ * Rows that are not ATOM records, or that belong to a model other than the
+ * first, are dropped. The remaining rows are appended to the atom array, and
+ * each requested column is then decoded over the whole block in turn, so
+ * that each pass runs over a single contiguous column of tokens. Author
+ * (auth_) values are preferred to label_ values, which fill in where the
+ * author value is missing.
+ *
+ * @param[in,out] r The loop state, with a full or final block of rows.
+ * @param[in,out] p The struct into which the atoms are written.
+ */
+static void decodeBlock(struct sitereader * r, struct pdb * p) {
+  int * dest = malloc(r->nrow * sizeof(int)); // Atom index of each row or -1
+  for(int i=0; i<r->nrow; i++) {
+    dest[i] = -1;
+    if(r->slot[COL_GROUP]>=0 &&
+        !tokenIs(r->cells[r->slot[COL_GROUP]*BLOCK+i],"atom",false))
+      continue;
+    if(r->slot[COL_MODEL]>=0) {
+      struct token m = r->cells[r->slot[COL_MODEL]*BLOCK+i];
+      if(r->modellen<0) {
+        r->modellen = m.len<15 ? m.len : 15;
+        memcpy(r->model, m.s, r->modellen);
+      }
+      if(m.len!=r->modellen || memcmp(m.s, r->model, m.len))
+        continue;
+    }
+    if(p->natom==r->cap) {
+      r->cap = r->cap<INT_MAX/2 ? 2*r->cap : INT_MAX;
+      p->atoms = realloc(p->atoms, r->cap * sizeof(struct pdbatom));
+    }
+    struct pdbatom * a = &p->atoms[p->natom];
+    memset(a, 0, sizeof(struct pdbatom));
+    a->serial = -1;
+    dest[i] = p->natom++;
+  }
+
+  for(int c=0; c<NCOL; c++) {
+    if(r->slot[c]<0 || !(r->fields & colFields[c]))
+      continue;
+    // Label columns are only decoded where the author column is missing
+    int alt = c==COL_LABEL_ATOM ? COL_AUTH_ATOM :
+      c==COL_LABEL_COMP ? COL_AUTH_COMP :
+      c==COL_LABEL_ASYM ? COL_AUTH_ASYM :
+      c==COL_LABEL_SEQ ? COL_AUTH_SEQ : -1;
+    const struct token * col = &r->cells[r->slot[c]*BLOCK];
+    const struct token * auth = alt>=0 && r->slot[alt]>=0 ?
+      &r->cells[r->slot[alt]*BLOCK] : NULL;
+    for(int i=0; i<r->nrow; i++) {
+      if(dest[i]<0 || (auth && !isNull(auth[i])))
+        continue;
+      struct token t = col[i];
+      if(isNull(t) && (c==COL_AUTH_ATOM || c==COL_AUTH_COMP ||
+            c==COL_AUTH_ASYM || c==COL_AUTH_SEQ))
+        continue; // Leave the label value in place
+      struct pdbatom * a = &p->atoms[dest[i]];
+      switch(c) {
+        case COL_ID:
+          a->serial = isNull(t) ? -1 : (int) parseNumber(t);
+          copyToken(a->mserial, t, 6);
+          break;
+        case COL_TYPE:
+          copyToken(a->element, t, 2);
+          break;
+        case COL_LABEL_ATOM:
+        case COL_AUTH_ATOM:
+          copyToken(a->name, t, 4);
+          break;
+        case COL_ALT:
+          a->altLoc = isNull(t) ? '\0' : t.s[0];
+          break;
+        case COL_LABEL_COMP:
+        case COL_AUTH_COMP:
+          copyToken(a->resName, t, 3);
+          copyToken(a->mresName, t, 4);
+          break;
+        case COL_LABEL_ASYM:
+        case COL_AUTH_ASYM:
+          a->chainID = isNull(t) ? '\0' : t.s[0];
+          copyToken(a->mseg, t, 10);
+          break;
+        case COL_LABEL_SEQ:
+        case COL_AUTH_SEQ:
+          a->resSeq = (int) parseNumber(t);
+          a->mresSeq = a->resSeq;
+          break;
+        case COL_INS:
+          a->iCode = isNull(t) ? '\0' : t.s[0];
+          break;
+        case COL_X:
+          a->x = parseNumber(t);
+          break;
+        case COL_Y:
+          a->y = parseNumber(t);
+          break;
+        case COL_Z:
+          a->z = parseNumber(t);
+          break;
+        case COL_OCC:
+          a->occupancy = parseNumber(t);
+          break;
+        case COL_B:
+          a->tempFactor = parseNumber(t);
+          break;
+        case COL_CHARGE:
+          setCharge(a->charge, t);
+          break;
+      }
+    }
+  }
+  free(dest);
+  r->nrow = 0;
+}
+
+/**
+ * Read a loop, keeping its values if it is the atom_site loop
+ *
+ * Reads the data names following loop_, then the values. Values of other
+ * loops are skipped. For the atom_site loop, only the tokens of the columns
+ * needed for the requested fields are kept, in column-major blocks that are
+ * decoded each time they fill up. A final incomplete row is dropped.
+ *
+ * @param[in] data The start of the file.
+ * @param[in,out] pos The current position, just past the loop_ keyword.
+ * @param[in] end The end of the file.
+ * @param[out] t The first token after the loop.
+ * @param[in,out] p The struct into which the atoms are written.
+ * @param[in] fields The CIF_ fields requested.
+ * @return true if a token follows the loop, or false at the end of the file.
+ */
+static bool readLoop(const char * data, const char ** pos, const char * end,
+    struct token * t, struct pdb * p, int fields) {
+  struct sitereader r = { .fields = fields, .nslot = 0, .cells = NULL,
+                          .nrow = 0, .modellen = -1 };
+  for(int c=0; c<NCOL; c++)
+    r.slot[c] = -1;
+
+  int ntag = 0;
+  int tagcap = 32;
+  int * tagSlot = malloc(tagcap * sizeof(int)); // Block column of each tag
+  bool sites = false;
+  bool have;
+  while((have = nextToken(data, pos, end, t)) && !t->quoted && t->len &&
+      t->s[0]=='_') {
+    if(ntag==tagcap) {
+      tagcap *= 2;
+      tagSlot = realloc(tagSlot, tagcap * sizeof(int));
+    }
+    tagSlot[ntag] = -1;
+    if(tokenIs(*t,"_atom_site.",true)) {
+      sites = true;
+      struct token name = { .s = t->s+11, .len = t->len-11, .quoted = false };
+      for(int c=0; c<NCOL; c++) {
+        if(r.slot[c]<0 && tokenIs(name,colNames[c],false) &&
+            (!colFields[c] || (fields & colFields[c]))) {
+          r.slot[c] = r.nslot;
+          tagSlot[ntag] = r.nslot++;
+        }
+      }
+    }
+    ntag++;
+  }
+
+  if(!sites || !ntag || p->natom>=0) {
+    // Not the atom_site loop (or a second one); skip its values
+    while(have && !isKeyword(*t))
+      have = nextToken(data, pos, end, t);
+    free(tagSlot);
+    return have;
+  }
+
+  // Allocate the atom array from an estimate of 80 bytes per row
+  size_t size_est = (end-*pos)/80 + 1;
+  if(size_est > INT_MAX)
+    size_est = INT_MAX;
+  r.cap = size_est;
+  p->atoms = malloc(r.cap * sizeof(struct pdbatom));
+  p->natom = 0;
+  r.cells = malloc((size_t) (r.nslot ? r.nslot : 1) * BLOCK *
+      sizeof(struct token));
+
+  int k = 0; // Column of the next value
+  while(have && !isKeyword(*t)) {
+    if(tagSlot[k]>=0)
+      r.cells[tagSlot[k]*BLOCK + r.nrow] = *t;
+    if(++k==ntag) {
+      k = 0;
+      if(++r.nrow==BLOCK)
+        decodeBlock(&r, p);
+    }
+    have = nextToken(data, pos, end, t);
+  }
+  decodeBlock(&r, p);
+
+  free(r.cells);
+  free(tagSlot);
+  p->atoms = realloc(p->atoms, (p->natom ? p->natom : 1) *
+      sizeof(struct pdbatom)); // Trim
+  return have;
+}
+
+/**
+ * Read data from a PDBx/mmCIF file held in memory
+ *
+ * Parses the first data block of an mmCIF file into a pdb struct: the unit
+ * cell from the _cell and _symmetry (or _space_group) items, and the ATOM
+ * records of the first model in the _atom_site loop. HETATM records are
+ * skipped, as in readPDB. The contents are tokenized in place, and only the
+ * atom_site columns needed for the requested fields are kept and decoded;
+ * fields that are not requested are left empty.
+ *
+ * mmCIF has no fixed-width limits, so atom serial and residue numbers of any
+ * size are read exactly. The chain (auth_asym_id) takes the place of the
+ * nonstandard segment name, truncated, like other strings, to the size of its
+ * pdbatom field. The atom table is built as in readPDB.
+ *
+ * If data is NULL or has no atom_site loop, natom is set to -1.
+ *
+ * @param[in] data The contents of the mmCIF file, or NULL.
+ * @param[in] size The number of bytes in data.
+ * @param[in] fields A combination of CIF_ flags naming the fields to read, or
+ *                   CIF_ALL.
+ * @return A pdb struct containing all of the parsed information.
+ */
+struct pdb readCIFFromBuffer(const char * data, size_t size, int fields) {
+  struct pdb p = { .cell = { .valid = false,
+                             .a = 0,
+                             .b = 0,
+                             .c = 0,
+                             .alpha = 0,
+                             .beta = 0,
+                             .gamma = 0,
+                             .sGroup = "\0\0\0\0\0\0\0\0\0\0\0\0",
+                             .z = -1 },
+                   .natom = -1,
+                   .atoms = NULL,
+                   .table = { .natom = -1 } };
+
+  if(!data)
+    return p;
+
+  const char * pos = data;
+  const char * end = data + size;
+  struct token t;
+  bool block = false; // Whether the first data block has been entered
+  bool have = nextToken(data, &pos, end, &t);
+  while(have) {
+    if(tokenIs(t,"data_",true)) {
+      if(block)
+        break; // Only the first data block is read
+      block = true;
+      have = nextToken(data, &pos, end, &t);
+    }
+    else if(tokenIs(t,"loop_",false))
+      have = readLoop(data, &pos, end, &t, &p, fields);
+    else if(!t.quoted && t.len && t.s[0]=='_') {
+      struct token value;
+      if(!nextToken(data, &pos, end, &value))
+        break;
+      setCellItem(t, value, &p.cell);
+      have = nextToken(data, &pos, end, &t);
+    }
+    else
+      have = nextToken(data, &pos, end, &t);
+  }
+  if(p.natom>=0)
+    buildPDBTable(&p);
+  return p;
+}
+
+/**
+ * Read data from a PDBx/mmCIF file
+ *
+ * Maps the file into memory and parses it with readCIFFromBuffer.
+ *
+ * @param[in] path The filesystem path to the mmCIF file to be parsed.
+ * @param[in] fields A combination of CIF_ flags naming the fields to read, or
+ *                   CIF_ALL.
+ * @return A pdb struct containing all of the parsed information.
+ */
+struct pdb readCIF(const char * path, int fields) {
+  struct mappedfile m = mapFile(path); // data is NULL on error
+  struct pdb p = readCIFFromBuffer(m.data, m.size, fields);
+  unmapFile(m);
+  return p;
+}
@@ -0,0 +1,24 @@
+#ifndef CIF
+#define CIF
+
+#include "pdb.h"
+
+enum ciffield {
+  CIF_SERIAL = 1<<0,
+  CIF_NAME = 1<<1,
+  CIF_ALTLOC = 1<<2,
+  CIF_RESNAME = 1<<3,
+  CIF_CHAIN = 1<<4,
+  CIF_RESSEQ = 1<<5,
+  CIF_ICODE = 1<<6,
+  CIF_COORDS = 1<<7,
+  CIF_OCCUPANCY = 1<<8,
+  CIF_BFACTOR = 1<<9,
+  CIF_ELEMENT = 1<<10,
+  CIF_CHARGE = 1<<11,
+  CIF_ALL = (1<<12)-1
+};
+
+struct pdb readCIF(const char * path, int fields);
+struct pdb readCIFFromBuffer(const char * data, size_t size, int fields);
+#endif
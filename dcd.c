@@ -79,6 +79,16 @@ uint32_t getNFrames(struct dcd *d) {
   return d->nframes;
 }
 
+/**
+ * Gets the number of atoms in each frame of the DCD.
+ *
+ * @param[in] d The dcd handle.
+ * @return The number of atoms in the DCD.
+ */
+uint32_t getNAtoms(struct dcd *d) {
+  return d->natoms;
+}
+
 /**
  * Prepares the DCD handle to read the desired frame.
  *
@@ -162,6 +172,33 @@ void getCoords(struct dcd *d, float *xs, float *ys, float *zs) {
   fseek(d->hdl, (-1)*(12*((long int) (d->natoms)) + 80), SEEK_CUR);
 }
 
+/**
+ * Reads the coordinates of a range of atoms for the current frame.
+ *
+ * Gets the coordinate data of atoms first to first+count-1 from the current
+ * frame and stores it at the same positions in the provided arrays, leaving
+ * the rest of the arrays untouched.
+ *
+ * @param[in] d The DCD file handle
+ * @param[in] first The first atom to read.
+ * @param[in] count The number of atoms to read.
+ * @param[out] xs The array into which the x-coordinates should be stored.
+ * @param[out] ys The array into which the y-coordinates should be stored.
+ * @param[out] zs The array into which the z-coordinates should be stored.
+ */
+void getCoordRange(struct dcd *d, uint32_t first, uint32_t count, float *xs,
+    float *ys, float *zs) {
+  long int skip = 4*((long int) (d->natoms)) + 8; // From one axis to the next
+  long int start = ftell(d->hdl);
+  fseek(d->hdl, 60 + 4*((long int) first), SEEK_CUR);
+  assert(count==fread(&xs[first], 4, count, d->hdl));
+  fseek(d->hdl, skip - 4*((long int) count), SEEK_CUR);
+  assert(count==fread(&ys[first], 4, count, d->hdl));
+  fseek(d->hdl, skip - 4*((long int) count), SEEK_CUR);
+  assert(count==fread(&zs[first], 4, count, d->hdl));
+  fseek(d->hdl, start, SEEK_SET);
+}
+
 void writeCoords(struct dcd *d, float *xs, float *ys, float *zs) {
   fseek(d->hdl, 56, SEEK_CUR);
   fseek(d->hdl, 4, SEEK_CUR);
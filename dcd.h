@@ -10,11 +10,13 @@ struct dcd *openDCD(char *);
 struct dcd *openWritableDCD(char *);
 void closeDCD(struct dcd *);
 uint32_t getNFrames(struct dcd *);
+uint32_t getNAtoms(struct dcd *);
 void goToFrame(struct dcd *,uint32_t);
 void nextFrame(struct dcd *);
 uint32_t getFrame(struct dcd *);
 void getUnitCell(struct dcd *, double *);
 void getCoords(struct dcd *, float *, float *, float *);
+void getCoordRange(struct dcd *, uint32_t, uint32_t, float *, float *, float *);
 void writeCoords(struct dcd *, float *, float *, float *);
 
 #endif
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "density.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+/**
+ * Find the voxel along one axis of each of four atoms
+ *
+ * @param[in] x The coordinates along the axis.
+ * @param[in] origin The corner of the grid along the axis.
+ * @param[in] scale The number of voxels per unit length.
+ * @param[in] n The number of voxels along the axis.
+ * @param[in] wrap Whether the axis is periodic with the grid as its box.
+ * @param[out] v The voxel of each atom, or -1 if outside the grid.
+ */
+static void voxelAxis(const float * x, double origin, double scale, int n,
+    int wrap, int * v) {
+#ifdef __SSE2__
+  __m128 s = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x),
+      _mm_set1_ps(origin)), _mm_set1_ps(scale));
+  __m128i t = _mm_cvttps_epi32(s);
+  // Truncation rounds negative values up, so step those down to the floor
+  __m128i up = _mm_castps_si128(_mm_cmplt_ps(s, _mm_cvtepi32_ps(t)));
+  t = _mm_add_epi32(t, up);
+  __m128i vn = _mm_set1_epi32(n);
+  if(wrap) {
+    // Atoms outside the box by less than a box length wrap back into it
+    __m128i neg = _mm_cmplt_epi32(t, _mm_setzero_si128());
+    t = _mm_add_epi32(t, _mm_and_si128(neg, vn));
+    __m128i over = _mm_cmpgt_epi32(t, _mm_sub_epi32(vn, _mm_set1_epi32(1)));
+    t = _mm_sub_epi32(t, _mm_and_si128(over, vn));
+  }
+  _mm_storeu_si128((__m128i *) v, t);
+  for(int l=0; l<4; l++)
+    if(v[l] < 0 || v[l] >= n)
+      v[l] = wrap ? (int) (((long) v[l] % n + n) % n) : -1;
+#else
+  for(int l=0; l<4; l++) {
+    int t = (int) floor((x[l] - origin) * scale);
+    if(wrap)
+      t = (int) (((long) t % n + n) % n);
+    v[l] = t >= 0 && t < n ? t : -1;
+  }
+#endif
+}
+
+struct densrun {
+  const struct density * g; // grid being mapped
+  const struct fitref * r; // reference to fit every frame to, or NULL
+  int natom; // atoms in each frame
+  int nsel; // selected atoms
+  const int * idx; // index of each selected atom
+  size_t nvox; // voxels in the grid
+  uint32_t * counts; // counts of every thread added together
+};
+
+/**
+ * Create one thread's empty grid of counts
+ *
+ * The init callback of the pipeline stage of densityMap.
+ *
+ * @param[in] data The densrun struct.
+ * @return The count of every voxel, all zero.
+ */
+static void *densityInit(void * data) {
+  struct densrun * u = data;
+  return calloc(u->nvox, sizeof(uint32_t));
+}
+
+/**
+ * Count the selected atoms of a frame in one thread's grid
+ *
+ * The frame callback of the pipeline stage of densityMap. Without a
+ * reference, the frame is binned in its own box.
+ *
+ * @param[in] data The densrun struct.
+ * @param[in,out] state The thread's count of every voxel.
+ * @param[in] f Unused.
+ * @param[in] uc The unit cell of the frame.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+static void densityFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct densrun * u = data;
+  const struct density * g = u->g;
+  uint32_t * counts = state;
+  float sel[3][4];
+  int v[3][4];
+  double scale[3];
+  if(u->r)
+    superpose(u->r, u->natom, xs, ys, zs, 1, NULL);
+  for(int q=0; q<3; q++)
+    scale[q] = u->r || !(uc[q] > 0) ? 1/g->delta[q] : g->n[q]/uc[q];
+  for(int k=0; k<u->nsel; k+=4) {
+    int m = u->nsel-k < 4 ? u->nsel-k : 4;
+    for(int l=0; l<4; l++) {
+      int i = u->idx[k + (l<m ? l : 0)];
+      sel[0][l] = xs[i];
+      sel[1][l] = ys[i];
+      sel[2][l] = zs[i];
+    }
+    for(int q=0; q<3; q++)
+      voxelAxis(sel[q], g->origin[q], scale[q], g->n[q], !u->r, v[q]);
+    for(int l=0; l<m; l++)
+      if(v[0][l] >= 0 && v[1][l] >= 0 && v[2][l] >= 0)
+        counts[((size_t) v[0][l]*g->n[1] + v[1][l])*g->n[2] + v[2][l]]++;
+  }
+}
+
+/**
+ * Add the grid of one thread to that of another
+ *
+ * The combine callback of the pipeline stage of densityMap.
+ *
+ * @param[in] data The densrun struct.
+ * @param[in,out] into The count of every voxel added to.
+ * @param[in] from The count of every voxel added, which is released.
+ */
+static void densityCombine(void * data, void * into, void * from) {
+  struct densrun * u = data;
+  uint32_t * a = into, * b = from;
+  for(size_t k=0; k<u->nvox; k++)
+    a[k] += b[k];
+  free(b);
+}
+
+/**
+ * Hand the combined grid of every thread over to the run
+ *
+ * The merge callback of the pipeline stage of densityMap.
+ *
+ * @param[in,out] data The densrun struct, receiving the counts.
+ * @param[in] state The combined count of every voxel.
+ */
+static void densityMerge(void * data, void * state) {
+  struct densrun * u = data;
+  u->counts = state;
+}
+
+/**
+ * Map the number density of selected atoms over a DCD onto a grid
+ *
+ * The grid spans the box of the first frame, as from getUnitCell, divided
+ * along each axis into the fewest equal voxels of edge at most delta, so the
+ * voxels are boxes rather than cubes unless the three axes happen to give the
+ * same edge. Each frame is binned in its own box, so that atoms outside the
+ * box are wrapped into it. If a reference is given, every frame is first
+ * fitted to it and the grid is centered on the center of the reference
+ * instead, without wrapping, leaving out atoms that fall outside.
+ *
+ * Frames are read in parallel by runPipeline, each thread counting atoms in
+ * its own grid, so threads never contend; the grids are added pairwise in a
+ * tree at the end. Without a reference, only the selected atoms are read.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] mask The atom mask of the selection, as from evalSelection.
+ * @param[in] natom The number of atoms covered by the mask.
+ * @param[in] delta The largest voxel edge length along any axis.
+ * @param[in] r The reference to fit every frame to, as from newFitReference,
+ *              or NULL.
+ * @return The density, in atoms per cubic length unit of the voxels of the
+ *         first frame, with nframe set to -1 if the DCD cannot be read, has
+ *         fewer than natom atoms, no frames or no box, if the reference fits
+ *         atoms the DCD does not have (see fitsFrame), or if delta is not
+ *         positive.
+ */
+struct density densityMap(char * path, const uint64_t * mask, int natom,
+    double delta, const struct fitref * r) {
+  struct density g = { .n = { 0, 0, 0 }, .origin = { 0, 0, 0 },
+                       .delta = { 0, 0, 0 }, .nframe = -1, .rho = NULL };
+  struct dcd * d = openDCD(path);
+  if(!d)
+    return g;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  double uc[3] = { 0, 0, 0 };
+  if(nframes) {
+    goToFrame(d, 0);
+    getUnitCell(d, uc);
+  }
+  closeDCD(d);
+  if(natom < 0 || natoms < (uint32_t) natom || !nframes ||
+      !(uc[0] > 0 && uc[1] > 0 && uc[2] > 0) || !(delta > 0) ||
+      (r && !fitsFrame(r, (int) natoms)))
+    return g;
+
+  size_t nvox = 1;
+  for(int q=0; q<3; q++) {
+    g.n[q] = (int) ceil(uc[q]/delta);
+    g.delta[q] = uc[q]/g.n[q];
+    g.origin[q] = r ? r->center[q] - uc[q]/2 : 0;
+    nvox *= g.n[q];
+  }
+  int nsel = 0;
+  int * idx = malloc((natom ? natom : 1) * sizeof(int));
+  int nword = (natoms+63)/64;
+  uint64_t * need = calloc(nword ? nword : 1, sizeof(uint64_t));
+  for(int i=0; i<natom; i++)
+    if(mask[i/64] >> (i%64) & 1) {
+      idx[nsel++] = i;
+      need[i/64] |= (uint64_t) 1 << (i%64);
+    }
+
+  struct densrun u = { .g = &g, .r = r, .natom = natoms, .nsel = nsel,
+                       .idx = idx, .nvox = nvox, .counts = NULL };
+  struct stage s = { .data = &u, .mask = r ? NULL : need,
+                     .init = densityInit, .frame = densityFrame,
+                     .combine = densityCombine, .merge = densityMerge };
+  bool failed = runPipeline(path, 1, &s, NULL) == -1;
+  free(idx);
+  free(need);
+  uint32_t * counts = u.counts;
+  if(failed) {
+    free(counts);
+    return g;
+  }
+  g.nframe = nframes;
+  g.rho = malloc(nvox * sizeof(double));
+  double norm = 1 / (nframes * g.delta[0]*g.delta[1]*g.delta[2]);
+  for(size_t k=0; k<nvox; k++)
+    g.rho[k] = counts[k] * norm;
+  free(counts);
+  return g;
+}
+
+/**
+ * Frees the memory allocated for a density grid
+ *
+ * @param[in] d The density to be freed.
+ */
+void freeDensity(struct density d) {
+  free(d.rho);
+}
+
+/**
+ * Write a density grid in OpenDX format
+ *
+ * Values are those at voxel centers, as read by VMD, PyMOL and Chimera.
+ *
+ * @param[in] path The path of the DX file.
+ * @param[in] d The density, as from densityMap.
+ * @return 0 on success, or -1 if the file cannot be written or the density
+ *         is invalid.
+ */
+int writeDX(const char * path, const struct density * d) {
+  if(d->nframe == -1)
+    return -1;
+  FILE * out = fopen(path, "w");
+  if(!out)
+    return -1;
+  size_t nvox = (size_t) d->n[0]*d->n[1]*d->n[2];
+  fprintf(out, "# Density of %ld frames\n", d->nframe);
+  fprintf(out, "object 1 class gridpositions counts %d %d %d\n", d->n[0],
+      d->n[1], d->n[2]);
+  fprintf(out, "origin %g %g %g\n", d->origin[0] + d->delta[0]/2,
+      d->origin[1] + d->delta[1]/2, d->origin[2] + d->delta[2]/2);
+  fprintf(out, "delta %g 0 0\ndelta 0 %g 0\ndelta 0 0 %g\n", d->delta[0],
+      d->delta[1], d->delta[2]);
+  fprintf(out, "object 2 class gridconnections counts %d %d %d\n", d->n[0],
+      d->n[1], d->n[2]);
+  fprintf(out, "object 3 class array type double rank 0 items %zu data "
+      "follows\n", nvox);
+  for(size_t k=0; k<nvox; k++)
+    fprintf(out, k%3 == 2 || k+1 == nvox ? "%g\n" : "%g ", d->rho[k]);
+  fprintf(out, "attribute \"dep\" string \"positions\"\n");
+  fprintf(out, "object \"density\" class field\n");
+  fprintf(out, "component \"positions\" value 1\n");
+  fprintf(out, "component \"connections\" value 2\n");
+  fprintf(out, "component \"data\" value 3\n");
+  return fclose(out) ? -1 : 0;
+}
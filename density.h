@@ -0,0 +1,20 @@
+#ifndef DENSITY
+#define DENSITY
+
+#include <stdint.h>
+
+#include "align.h"
+
+struct density {
+  int n[3]; // voxels along x, y and z
+  double origin[3]; // corner of the grid
+  double delta[3]; // voxel edge lengths
+  long nframe; // frames binned
+  double * rho; // number density of each voxel, z varying fastest
+};
+
+struct density densityMap(char * path, const uint64_t * mask, int natom,
+    double delta, const struct fitref * r);
+void freeDensity(struct density d);
+int writeDX(const char * path, const struct density * d);
+#endif
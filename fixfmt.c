@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fixfmt.h"
+
+/**
+ * Create an output buffer
+ *
+ * Output is collected in a large buffer and handed to fwrite in blocks, so
+ * that formatting a line costs little more than copying it.
+ *
+ * @param[in] hdl The open file to which the buffer is flushed.
+ * @param[in] cap The size of the buffer in bytes.
+ * @return The output buffer.
+ */
+struct outbuf openOut(FILE * hdl, size_t cap) {
+  struct outbuf o = { .hdl = hdl, .buf = malloc(cap), .len = 0, .cap = cap,
+                      .error = 0 };
+  if(!o.buf)
+    o.error = 1;
+  return o;
+}
+
+/**
+ * Write the contents of an output buffer to its file
+ *
+ * @param[in,out] o The output buffer.
+ */
+static void flushOut(struct outbuf * o) {
+  if(o->len && fwrite(o->buf, 1, o->len, o->hdl) != o->len)
+    o->error = 1;
+  o->len = 0;
+}
+
+/**
+ * Reserve space in an output buffer
+ *
+ * Flushes the buffer if fewer than n bytes remain, then returns a pointer to
+ * the free space. After writing at most n bytes there, the caller must pass
+ * the end of the written data to advanceOut.
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] n The number of bytes to be written, at most the buffer size.
+ * @return A pointer to the free space in the buffer.
+ */
+char * reserveOut(struct outbuf * o, size_t n) {
+  if(o->len + n > o->cap)
+    flushOut(o);
+  return o->buf + o->len;
+}
+
+/**
+ * Mark data written after reserveOut as ready for output
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] end One past the last byte written.
+ */
+void advanceOut(struct outbuf * o, char * end) {
+  o->len = end - o->buf;
+}
+
+/**
+ * Flush and release an output buffer
+ *
+ * The file itself is not closed.
+ *
+ * @param[in,out] o The output buffer.
+ * @return 0 if all output was written successfully, or -1 otherwise.
+ */
+int closeOut(struct outbuf * o) {
+  if(o->buf)
+    flushOut(o);
+  free(o->buf);
+  o->buf = NULL;
+  return o->error ? -1 : 0;
+}
+
+/**
+ * Write an integer right-justified in a fixed-width field
+ *
+ * Numbers too wide for the field are written in full, as Fortran would not,
+ * so that no information is lost; callers that need a hard limit should use a
+ * wider format such as hybrid-36.
+ *
+ * @param[out] dst Where the field is written.
+ * @param[in] v The value to write.
+ * @param[in] width The width of the field.
+ * @return One past the last character written.
+ */
+char * putInt(char * dst, long long v, int width) {
+  char digits[24];
+  int n = 0;
+  unsigned long long u = v<0 ? -(unsigned long long) v
+                             : (unsigned long long) v;
+  do {
+    digits[n++] = '0' + u%10;
+    u /= 10;
+  } while(u);
+  if(v<0)
+    digits[n++] = '-';
+  for(int i=n; i<width; i++)
+    *dst++ = ' ';
+  while(n)
+    *dst++ = digits[--n];
+  return dst;
+}
+
+/**
+ * Write a real number in fixed-point notation in a fixed-width field
+ *
+ * The value is rounded to the given number of decimal places and written
+ * right-justified. Values too large to be represented exactly in a 64-bit
+ * integer after scaling, as well as infinities and NaN, are written in
+ * exponent form instead. Either way the field is at most PUTFIXED_MAX
+ * characters wide, or width if that is larger, which callers must reserve.
+ *
+ * @param[out] dst Where the field is written.
+ * @param[in] v The value to write.
+ * @param[in] width The width of the field.
+ * @param[in] decimals The number of digits after the decimal point (at most 9).
+ * @return One past the last character written.
+ */
+char * putFixed(char * dst, double v, int width, int decimals) {
+  static const double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                   1e8, 1e9 };
+  double scaled = fabs(v) * scales[decimals];
+  if(!(scaled < 9e18)) { // Also catches NaN
+    char tmp[64];
+    int n = snprintf(tmp, sizeof(tmp), "%*.*e", width, decimals, v);
+    n = n < (int) sizeof(tmp) ? n : (int) sizeof(tmp)-1;
+    memcpy(dst, tmp, n);
+    return dst+n;
+  }
+  unsigned long long u = (unsigned long long) (scaled + 0.5);
+  char digits[32];
+  int n = 0;
+  for(int i=0; i<decimals; i++) {
+    digits[n++] = '0' + u%10;
+    u /= 10;
+  }
+  if(decimals)
+    digits[n++] = '.';
+  do {
+    digits[n++] = '0' + u%10;
+    u /= 10;
+  } while(u);
+  if(v<0 && scaled >= 0.5)
+    digits[n++] = '-'; // Values that round to zero are written unsigned
+  for(int i=n; i<width; i++)
+    *dst++ = ' ';
+  while(n)
+    *dst++ = digits[--n];
+  return dst;
+}
+
+/**
+ * Write a string in a fixed-width field
+ *
+ * Copies at most width characters of a null-terminated string and pads the
+ * field with spaces.
+ *
+ * @param[out] dst Where the field is written.
+ * @param[in] s The string to write.
+ * @param[in] width The width of the field.
+ * @param[in] left Nonzero to left-justify the string, zero to right-justify.
+ * @return One past the last character written.
+ */
+char * putString(char * dst, const char * s, int width, int left) {
+  int n = 0;
+  while(n<width && s[n])
+    n++;
+  if(!left)
+    for(int i=n; i<width; i++)
+      *dst++ = ' ';
+  memcpy(dst, s, n);
+  dst += n;
+  if(left)
+    for(int i=n; i<width; i++)
+      *dst++ = ' ';
+  return dst;
+}
@@ -0,0 +1,27 @@
+#ifndef FIXFMT
+#define FIXFMT
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct outbuf {
+  FILE * hdl;
+  char * buf;
+  size_t len; // number of bytes waiting to be written
+  size_t cap;
+  int error;
+};
+
+struct outbuf openOut(FILE * hdl, size_t cap);
+char * reserveOut(struct outbuf * o, size_t n);
+void advanceOut(struct outbuf * o, char * end);
+int closeOut(struct outbuf * o);
+
+// Widest field putFixed writes when width is smaller: a sign, 19 digits and
+// a decimal point
+#define PUTFIXED_MAX 21
+
+char * putInt(char * dst, long long v, int width);
+char * putFixed(char * dst, double v, int width, int decimals);
+char * putString(char * dst, const char * s, int width, int left);
+#endif
@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "geom.h"
+#include "topo.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+#define DEGREES 57.29577951308232
+
+/**
+ * Collect the bonded terms of a PSF
+ *
+ * @param[in] p The psf struct containing the terms.
+ * @param[in] impropers Whether to follow the dihedrals with the impropers.
+ * @return The terms, with nbond set to -1 if the PSF is invalid.
+ */
+struct geomterms allTerms(struct psf p, int impropers) {
+  struct geomterms t = { .nbond = -1, .nangle = 0, .ndihed = 0,
+                         .bonds = NULL, .angles = NULL, .dihedrals = NULL };
+  if(p.natom == -1)
+    return t;
+  t.nbond = p.nbond;
+  t.nangle = p.ntheta;
+  t.ndihed = p.nphi + (impropers ? p.nimphi : 0);
+  t.bonds = malloc((t.nbond ? t.nbond : 1) * sizeof(struct bond));
+  t.angles = malloc((t.nangle ? t.nangle : 1) * sizeof(struct angle));
+  t.dihedrals = malloc((t.ndihed ? t.ndihed : 1) * sizeof(struct dihedral));
+  if(p.nbond)
+    memcpy(t.bonds, p.bonds, p.nbond * sizeof(struct bond));
+  if(p.ntheta)
+    memcpy(t.angles, p.angles, p.ntheta * sizeof(struct angle));
+  if(p.nphi)
+    memcpy(t.dihedrals, p.dihedrals, p.nphi * sizeof(struct dihedral));
+  if(impropers && p.nimphi)
+    memcpy(&t.dihedrals[p.nphi], p.impropers,
+        p.nimphi * sizeof(struct dihedral));
+  return t;
+}
+
+/**
+ * Find the bonded neighbor of an atom with a given name
+ *
+ * @param[in] g The bond graph.
+ * @param[in] name The atom name ID of every atom.
+ * @param[in] i The atom.
+ * @param[in] id The name ID to look for.
+ * @param[in] skip An atom to pass over, or -1.
+ * @return The lowest such neighbor, or -1 if there is none.
+ */
+static int bondedNamed(struct graph g, const int * name, int i, int id,
+    int skip) {
+  int found = -1;
+  for(int k=g.offsets[i]; k<g.offsets[i+1]; k++) {
+    int j = g.neighbors[k];
+    if(j != skip && name[j] == id && (found == -1 || j < found))
+      found = j;
+  }
+  return found;
+}
+
+/**
+ * Find the backbone phi and psi dihedrals of the protein residues of a PSF
+ *
+ * Residues are recognized through the bonds between atoms named N, CA and
+ * C, so chain breaks and non-protein segments are handled without regard to
+ * residue numbering. Every residue whose CA is bonded to an N and a C, where
+ * the N is bonded to the C of a previous residue and the C to the N of a
+ * next residue, contributes phi (C'-N-CA-C) followed by psi (N-CA-C-N'), so
+ * the pairs for a Ramachandran plot are adjacent. Residues at the ends of
+ * chains are left out.
+ *
+ * @param[in] p The psf struct containing the atoms and bonds.
+ * @return The dihedrals, with nbond set to -1 if the PSF is invalid.
+ */
+struct geomterms backboneTerms(struct psf p) {
+  struct geomterms t = { .nbond = -1, .nangle = 0, .ndihed = 0,
+                         .bonds = NULL, .angles = NULL, .dihedrals = NULL };
+  if(p.natom == -1)
+    return t;
+  t.nbond = 0;
+  t.bonds = malloc(sizeof(struct bond));
+  t.angles = malloc(sizeof(struct angle));
+  int n = findSymbol(&p.table.syms, "N");
+  int ca = findSymbol(&p.table.syms, "CA");
+  int c = findSymbol(&p.table.syms, "C");
+  int cap = 2;
+  t.dihedrals = malloc(cap * sizeof(struct dihedral));
+  if(n == -1 || ca == -1 || c == -1)
+    return t;
+
+  struct graph g = buildGraph(p);
+  for(int i=0; i<p.natom; i++) {
+    if(p.table.name[i] != ca)
+      continue;
+    int ni = bondedNamed(g, p.table.name, i, n, -1);
+    int ci = bondedNamed(g, p.table.name, i, c, -1);
+    if(ni == -1 || ci == -1)
+      continue;
+    int prev = bondedNamed(g, p.table.name, ni, c, -1);
+    int next = bondedNamed(g, p.table.name, ci, n, -1);
+    if(prev == -1 || next == -1)
+      continue;
+    if(t.ndihed+2 > cap) {
+      cap *= 2;
+      t.dihedrals = realloc(t.dihedrals, cap * sizeof(struct dihedral));
+    }
+    t.dihedrals[t.ndihed++] = (struct dihedral) { prev, ni, i, ci };
+    t.dihedrals[t.ndihed++] = (struct dihedral) { ni, i, ci, next };
+  }
+  freeGraph(g);
+  return t;
+}
+
+/**
+ * Frees the memory allocated for a set of bonded terms
+ *
+ * @param[in] t The terms to be freed.
+ */
+void freeGeomTerms(struct geomterms t) {
+  free(t.bonds);
+  free(t.angles);
+  free(t.dihedrals);
+}
+
+/**
+ * Find the vector between two atoms by the minimum image
+ *
+ * @param[in] box The box lengths, zero for axes that are not periodic.
+ * @param[in] inv The inverse box lengths, zero for axes that are not
+ *                periodic.
+ * @param[in] i The atom the vector starts from.
+ * @param[in] j The atom the vector points to.
+ * @param[out] d The vector.
+ */
+static void imageDiff(const float * box, const float * inv, const float * xs,
+    const float * ys, const float * zs, int i, int j, float * d) {
+  d[0] = xs[j]-xs[i];
+  d[1] = ys[j]-ys[i];
+  d[2] = zs[j]-zs[i];
+  for(int q=0; q<3; q++)
+    d[q] -= box[q]*rintf(d[q]*inv[q]);
+}
+
+/**
+ * Compute the angle between two vectors, and the dihedral about a third
+ *
+ * @param[in] b1 The first vector.
+ * @param[in] b2 The second vector.
+ * @param[in] b3 The third vector, or NULL to compute the angle between -b1
+ *               and b2.
+ * @return The angle or dihedral, in degrees.
+ */
+static float angleOf(const float * b1, const float * b2, const float * b3) {
+  if(!b3) {
+    float cx = b1[1]*b2[2]-b1[2]*b2[1];
+    float cy = b1[2]*b2[0]-b1[0]*b2[2];
+    float cz = b1[0]*b2[1]-b1[1]*b2[0];
+    float dot = b1[0]*b2[0]+b1[1]*b2[1]+b1[2]*b2[2];
+    return DEGREES*atan2f(sqrtf(cx*cx+cy*cy+cz*cz), -dot);
+  }
+  float n1[3] = { b1[1]*b2[2]-b1[2]*b2[1], b1[2]*b2[0]-b1[0]*b2[2],
+                  b1[0]*b2[1]-b1[1]*b2[0] };
+  float n2[3] = { b2[1]*b3[2]-b2[2]*b3[1], b2[2]*b3[0]-b2[0]*b3[2],
+                  b2[0]*b3[1]-b2[1]*b3[0] };
+  float x = n1[0]*n2[0]+n1[1]*n2[1]+n1[2]*n2[2];
+  float y = sqrtf(b2[0]*b2[0]+b2[1]*b2[1]+b2[2]*b2[2]) *
+            (b1[0]*n2[0]+b1[1]*n2[1]+b1[2]*n2[2]);
+  return DEGREES*atan2f(y, x);
+}
+
+#ifdef __SSE2__
+/**
+ * Find the vectors between the atoms of four terms by the minimum image
+ *
+ * Coordinates are gathered lane by lane, then imaged four at a time.
+ *
+ * @param[in] box The box lengths, zero for axes that are not periodic.
+ * @param[in] inv The inverse box lengths, zero for axes that are not
+ *                periodic.
+ * @param[in] from The atom each vector starts from, in the first term.
+ * @param[in] to The atom each vector points to, in the first term.
+ * @param[in] stride The number of atoms in each term.
+ * @param[out] d The x, y and z components of the four vectors.
+ */
+static void imageDiff4(const float * box, const float * inv, const float * xs,
+    const float * ys, const float * zs, const int * from, const int * to,
+    int stride, __m128 * d) {
+  float dx[4], dy[4], dz[4];
+  for(int l=0; l<4; l++) {
+    int i = from[l*stride], j = to[l*stride];
+    dx[l] = xs[j]-xs[i];
+    dy[l] = ys[j]-ys[i];
+    dz[l] = zs[j]-zs[i];
+  }
+  d[0] = _mm_loadu_ps(dx);
+  d[1] = _mm_loadu_ps(dy);
+  d[2] = _mm_loadu_ps(dz);
+  for(int q=0; q<3; q++) {
+    __m128 shift = _mm_cvtepi32_ps(_mm_cvtps_epi32(
+        _mm_mul_ps(d[q], _mm_set1_ps(inv[q]))));
+    d[q] = _mm_sub_ps(d[q], _mm_mul_ps(shift, _mm_set1_ps(box[q])));
+  }
+}
+
+/**
+ * Compute the cross products of four pairs of vectors
+ */
+static void cross4(const __m128 * a, const __m128 * b, __m128 * c) {
+  c[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+  c[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+  c[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+/**
+ * Compute the dot products of four pairs of vectors
+ */
+static __m128 dot4(const __m128 * a, const __m128 * b) {
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]),
+      _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+#endif
+
+/**
+ * Compute the geometry of every bonded term in a frame
+ *
+ * Bond lengths come first, then angles in degrees, then dihedrals in
+ * degrees in (-180, 180] following the IUPAC sign convention. With SSE2, the
+ * coordinates of four terms at a time are gathered into vectors and the
+ * vector algebra is done on all four together, leaving only the final
+ * arctangents to scalar code.
+ *
+ * @param[in] t The terms, as from allTerms or backboneTerms.
+ * @param[in] uc The box lengths a, b and c, as from getUnitCell, for the
+ *               minimum image, or NULL. Axes whose length is not positive
+ *               are not periodic.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[out] out The value of each term, nbond+nangle+ndihed in all.
+ */
+void computeGeometry(const struct geomterms * t, const double * uc,
+    const float * xs, const float * ys, const float * zs, float * out) {
+  float box[3] = { 0, 0, 0 }, inv[3] = { 0, 0, 0 };
+  for(int q=0; uc && q<3; q++)
+    if(uc[q] > 0) {
+      box[q] = uc[q];
+      inv[q] = 1/uc[q];
+    }
+
+  int k = 0;
+#ifdef __SSE2__
+  for(; k+4<=t->nbond; k+=4) {
+    __m128 d[3];
+    imageDiff4(box, inv, xs, ys, zs, &t->bonds[k].a, &t->bonds[k].b, 2, d);
+    _mm_storeu_ps(&out[k], _mm_sqrt_ps(dot4(d, d)));
+  }
+#endif
+  for(; k<t->nbond; k++) {
+    float d[3];
+    imageDiff(box, inv, xs, ys, zs, t->bonds[k].a, t->bonds[k].b, d);
+    out[k] = sqrtf(d[0]*d[0]+d[1]*d[1]+d[2]*d[2]);
+  }
+  out += t->nbond;
+
+  k = 0;
+#ifdef __SSE2__
+  for(; k+4<=t->nangle; k+=4) {
+    __m128 u[3], v[3], c[3];
+    const struct angle * a = &t->angles[k];
+    imageDiff4(box, inv, xs, ys, zs, &a->b, &a->a, 3, u);
+    imageDiff4(box, inv, xs, ys, zs, &a->b, &a->c, 3, v);
+    cross4(u, v, c);
+    float s[4], cs[4];
+    _mm_storeu_ps(s, _mm_sqrt_ps(dot4(c, c)));
+    _mm_storeu_ps(cs, dot4(u, v));
+    for(int l=0; l<4; l++)
+      out[k+l] = DEGREES*atan2f(s[l], cs[l]);
+  }
+#endif
+  for(; k<t->nangle; k++) {
+    float u[3], v[3];
+    const struct angle * a = &t->angles[k];
+    imageDiff(box, inv, xs, ys, zs, a->a, a->b, u);
+    imageDiff(box, inv, xs, ys, zs, a->b, a->c, v);
+    out[k] = angleOf(u, v, NULL);
+  }
+  out += t->nangle;
+
+  k = 0;
+#ifdef __SSE2__
+  for(; k+4<=t->ndihed; k+=4) {
+    __m128 b1[3], b2[3], b3[3], n1[3], n2[3];
+    const struct dihedral * a = &t->dihedrals[k];
+    imageDiff4(box, inv, xs, ys, zs, &a->a, &a->b, 4, b1);
+    imageDiff4(box, inv, xs, ys, zs, &a->b, &a->c, 4, b2);
+    imageDiff4(box, inv, xs, ys, zs, &a->c, &a->d, 4, b3);
+    cross4(b1, b2, n1);
+    cross4(b2, b3, n2);
+    float x[4], y[4];
+    _mm_storeu_ps(x, dot4(n1, n2));
+    _mm_storeu_ps(y, _mm_mul_ps(_mm_sqrt_ps(dot4(b2, b2)), dot4(b1, n2)));
+    for(int l=0; l<4; l++)
+      out[k+l] = DEGREES*atan2f(y[l], x[l]);
+  }
+#endif
+  for(; k<t->ndihed; k++) {
+    float b1[3], b2[3], b3[3];
+    const struct dihedral * a = &t->dihedrals[k];
+    imageDiff(box, inv, xs, ys, zs, a->a, a->b, b1);
+    imageDiff(box, inv, xs, ys, zs, a->b, a->c, b2);
+    imageDiff(box, inv, xs, ys, zs, a->c, a->d, b3);
+    out[k] = angleOf(b1, b2, b3);
+  }
+}
+
+struct seriesrun {
+  const struct geomterms * t;
+  int minimage; // whether to measure by the minimum image
+  size_t nterm; // number of terms
+  uint32_t nframes; // number of frames
+  float * series; // value of every term in every frame
+};
+
+/**
+ * Allocate one thread's values of every term
+ *
+ * The init callback of the pipeline stage of geometrySeries.
+ *
+ * @param[in] data The seriesrun struct.
+ * @return Space for the value of every term.
+ */
+static void *seriesInit(void * data) {
+  struct seriesrun * r = data;
+  return malloc((r->nterm ? r->nterm : 1) * sizeof(float));
+}
+
+/**
+ * Measure every term in a frame and store the values in the series
+ *
+ * The frame callback of the pipeline stage of geometrySeries.
+ *
+ * @param[in,out] data The seriesrun struct, receiving frame f.
+ * @param[out] state The thread's values of every term.
+ * @param[in] f The frame.
+ * @param[in] uc The unit cell of the frame.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void seriesFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct seriesrun * r = data;
+  float * v = state;
+  computeGeometry(r->t, r->minimage ? uc : NULL, xs, ys, zs, v);
+  for(size_t k=0; k<r->nterm; k++)
+    r->series[k*r->nframes+f] = v[k];
+}
+
+/**
+ * Release one thread's values of every term
+ *
+ * The merge callback of the pipeline stage of geometrySeries.
+ *
+ * @param[in] data Unused.
+ * @param[in] state The thread's values of every term.
+ */
+static void seriesMerge(void * data, void * state) {
+  free(state);
+}
+
+/**
+ * Compute the geometry of every bonded term in every frame of a DCD
+ *
+ * Frames are read in parallel by runPipeline. The result is stored term by
+ * term, so that the time series of each term is contiguous.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] t The terms, as from allTerms or backboneTerms.
+ * @param[in] minimage Whether to measure by the minimum image in the box of
+ *                     each frame.
+ * @param[in] outpath The path of a file to write the series to as raw
+ *                    native-endian floats in the same order, or NULL.
+ * @return The value of term k in frame f at index k*nframes+f, or NULL if
+ *         the DCD cannot be read or the file cannot be written.
+ */
+float *geometrySeries(char * path, const struct geomterms * t, int minimage,
+    char * outpath) {
+  struct dcd * d = openDCD(path);
+  if(!d || t->nbond == -1)
+    return NULL;
+  uint32_t nframes = getNFrames(d);
+  closeDCD(d);
+  size_t nterm = (size_t) t->nbond + t->nangle + t->ndihed;
+  size_t nval = nterm*nframes;
+
+  float * series = malloc((nval ? nval : 1) * sizeof(float));
+  struct seriesrun r = { .t = t, .minimage = minimage, .nterm = nterm,
+                         .nframes = nframes, .series = series };
+  struct stage s = { .data = &r, .mask = NULL, .init = seriesInit,
+                     .frame = seriesFrame, .combine = NULL,
+                     .merge = seriesMerge };
+  bool failed = runPipeline(path, 1, &s, NULL) == -1;
+  if(!failed && outpath) {
+    FILE * out = fopen(outpath, "wb");
+    failed = !out || fwrite(series, sizeof(float), nval, out) != nval;
+    if(out && fclose(out))
+      failed = true;
+  }
+  if(failed) {
+    free(series);
+    return NULL;
+  }
+  return series;
+}
+
+/**
+ * Create empty histograms for a set of bonded terms
+ *
+ * Bond lengths are binned over [0, maxlen), angles over [0, 180] degrees and
+ * dihedrals over [-180, 180] degrees. Values beyond the range are counted in
+ * the bin at its end.
+ *
+ * @param[in] t The terms, as from allTerms or backboneTerms.
+ * @param[in] nbin The number of bins for each term.
+ * @param[in] maxlen The upper limit of bond lengths.
+ * @return The histograms, with nterm set to -1 if the terms are invalid or
+ *         nbin or maxlen is not positive.
+ */
+struct geomhist newGeomHistogram(const struct geomterms * t, int nbin,
+    double maxlen) {
+  struct geomhist h = { .nterm = -1, .nbin = nbin, .maxlen = maxlen,
+                        .counts = NULL };
+  if(t->nbond == -1 || nbin <= 0 || !(maxlen > 0))
+    return h;
+  h.nterm = t->nbond + t->nangle + t->ndihed;
+  h.counts = calloc(h.nterm ? (size_t) h.nterm*nbin : 1, sizeof(uint32_t));
+  return h;
+}
+
+/**
+ * Frees the memory allocated for histograms of bonded terms
+ *
+ * @param[in] h The histograms to be freed.
+ */
+void freeGeomHistogram(struct geomhist h) {
+  free(h.counts);
+}
+
+struct histrun {
+  const struct geomterms * t;
+  int minimage; // whether to measure by the minimum image
+  int nterm, nbin; // number of terms and of bins for each
+  int nlen, nang; // first angle and first dihedral term
+  double scale[3], lower[3]; // binning of lengths, angles and dihedrals
+  uint32_t * counts; // counts of every thread added together
+};
+
+struct histstate {
+  float * v; // value of every term in the current frame
+  uint32_t * counts; // count of every bin of every term
+};
+
+/**
+ * Create one thread's empty histograms
+ *
+ * The init callback of the pipeline stage of histogramGeometry.
+ *
+ * @param[in] data The histrun struct.
+ * @return The thread's histstate struct.
+ */
+static void *histInit(void * data) {
+  struct histrun * r = data;
+  struct histstate * h = malloc(sizeof(struct histstate));
+  h->v = malloc((r->nterm ? r->nterm : 1) * sizeof(float));
+  h->counts = calloc(r->nterm ? (size_t) r->nterm*r->nbin : 1,
+      sizeof(uint32_t));
+  return h;
+}
+
+/**
+ * Add a frame to one thread's histograms
+ *
+ * The frame callback of the pipeline stage of histogramGeometry.
+ *
+ * @param[in] data The histrun struct.
+ * @param[in,out] state The thread's histstate struct.
+ * @param[in] f Unused.
+ * @param[in] uc The unit cell of the frame.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void histFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct histrun * r = data;
+  struct histstate * h = state;
+  int nbin = r->nbin;
+  computeGeometry(r->t, r->minimage ? uc : NULL, xs, ys, zs, h->v);
+  for(int k=0; k<r->nterm; k++) {
+    int kind = k < r->nlen ? 0 : (k < r->nang ? 1 : 2);
+    int b = (int) floor((h->v[k]-r->lower[kind])*r->scale[kind]);
+    b = b < 0 ? 0 : (b >= nbin ? nbin-1 : b);
+    h->counts[(size_t) k*nbin+b]++;
+  }
+}
+
+/**
+ * Add the histograms of one thread to those of another
+ *
+ * The combine callback of the pipeline stage of histogramGeometry.
+ *
+ * @param[in] data The histrun struct.
+ * @param[in,out] into The histstate struct added to.
+ * @param[in] from The histstate struct added, which is released.
+ */
+static void histCombine(void * data, void * into, void * from) {
+  struct histrun * r = data;
+  struct histstate * a = into, * b = from;
+  for(size_t k=0; k<(size_t) r->nterm*r->nbin; k++)
+    a->counts[k] += b->counts[k];
+  free(b->v);
+  free(b->counts);
+  free(b);
+}
+
+/**
+ * Hand the combined histograms of every thread over to the run
+ *
+ * The merge callback of the pipeline stage of histogramGeometry.
+ *
+ * @param[in,out] data The histrun struct, receiving the counts.
+ * @param[in] state The combined histstate struct, which is released.
+ */
+static void histMerge(void * data, void * state) {
+  struct histrun * r = data;
+  struct histstate * h = state;
+  r->counts = h->counts;
+  free(h->v);
+  free(h);
+}
+
+/**
+ * Add every frame of a DCD to histograms of bonded terms
+ *
+ * Frames are read in parallel by runPipeline, each thread filling its own
+ * copy of the histograms; the copies are added together pairwise at the end.
+ * Calling this for several DCDs accumulates histograms over all of them.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] t The terms, as from allTerms or backboneTerms.
+ * @param[in] minimage Whether to measure by the minimum image in the box of
+ *                     each frame.
+ * @param[in,out] h The histograms, as from newGeomHistogram for the same
+ *                  terms, left untouched if the DCD cannot be read.
+ * @return The number of frames added, or -1 if the DCD cannot be read.
+ */
+int histogramGeometry(char * path, const struct geomterms * t, int minimage,
+    struct geomhist * h) {
+  if(h->nterm == -1)
+    return -1;
+  struct histrun r = { .t = t, .minimage = minimage, .nterm = h->nterm,
+                       .nbin = h->nbin, .nlen = t->nbond,
+                       .nang = t->nbond + t->nangle,
+                       .scale = { h->nbin/h->maxlen, h->nbin/180.0,
+                                  h->nbin/360.0 },
+                       .lower = { 0, 0, -180 }, .counts = NULL };
+  struct stage s = { .data = &r, .mask = NULL, .init = histInit,
+                     .frame = histFrame, .combine = histCombine,
+                     .merge = histMerge };
+  int nframes = runPipeline(path, 1, &s, NULL);
+  if(nframes != -1)
+    for(size_t k=0; k<(size_t) r.nterm*r.nbin; k++)
+      h->counts[k] += r.counts[k];
+  free(r.counts);
+  return nframes;
+}
@@ -0,0 +1,36 @@
+#ifndef GEOM
+#define GEOM
+
+#include <stdint.h>
+
+#include "psf.h"
+
+struct geomterms {
+  int nbond;
+  int nangle;
+  int ndihed;
+  struct bond * bonds;
+  struct angle * angles;
+  struct dihedral * dihedrals; // dihedrals and any impropers
+};
+
+struct geomhist {
+  int nterm;
+  int nbin;
+  double maxlen; // upper limit of bond length bins
+  uint32_t * counts; // bins of term k are counts[k*nbin..(k+1)*nbin]
+};
+
+struct geomterms allTerms(struct psf p, int impropers);
+struct geomterms backboneTerms(struct psf p);
+void freeGeomTerms(struct geomterms t);
+void computeGeometry(const struct geomterms * t, const double * uc,
+    const float * xs, const float * ys, const float * zs, float * out);
+float *geometrySeries(char * path, const struct geomterms * t, int minimage,
+    char * outpath);
+struct geomhist newGeomHistogram(const struct geomterms * t, int nbin,
+    double maxlen);
+void freeGeomHistogram(struct geomhist h);
+int histogramGeometry(char * path, const struct geomterms * t, int minimage,
+    struct geomhist * h);
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hier.h"
+
+/**
+ * Group items into a compressed sparse row list by a key
+ *
+ * A counting sort: items are listed under their key in ascending order of
+ * item index.
+ *
+ * @param[in] key The key of each item, from 0 to nkey-1.
+ * @param[in] nitem The number of items.
+ * @param[in] nkey The number of keys.
+ * @param[out] offsets The nkey+1 offsets into items of each key's list.
+ * @param[out] items The nitem items, grouped by key.
+ */
+static void groupByKey(const int * key, int nitem, int nkey, int * offsets,
+    int * items) {
+  for(int k=0; k<=nkey; k++)
+    offsets[k] = 0;
+  for(int i=0; i<nitem; i++)
+    offsets[key[i]+1]++;
+  for(int k=0; k<nkey; k++)
+    offsets[k+1] += offsets[k];
+  int * fill = malloc((nkey>0 ? (size_t) nkey : 1) * sizeof(int));
+  for(int k=0; k<nkey; k++)
+    fill[k] = offsets[k];
+  for(int i=0; i<nitem; i++)
+    items[fill[key[i]]++] = i;
+  free(fill);
+}
+
+/**
+ * Find or add a residue in an open-addressing hash table
+ *
+ * Residues are keyed by the symbol IDs of their segment and residue ID. The
+ * table stores residue index + 1 in each occupied slot, and keys are compared
+ * through the segment and residue ID of each residue's first atom.
+ *
+ * @param[in] slots The hash slots; the length is a power of two.
+ * @param[in] nslot The number of slots.
+ * @param[in] resKey The key of each residue found so far.
+ * @param[in] key The key sought.
+ * @return The slot holding the key, or the empty slot where it belongs.
+ */
+static int findSlot(const int * slots, int nslot, const uint64_t * resKey,
+    uint64_t key) {
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+  int s = (int) (h >> 32) & (nslot-1);
+  while(slots[s] && resKey[slots[s]-1]!=key)
+    s = (s+1) & (nslot-1);
+  return s;
+}
+
+/**
+ * Build the residue and segment hierarchy of an atom table
+ *
+ * A residue is the set of atoms sharing a segment and residue ID, and a
+ * segment the set of residues sharing a segment name. Residues and segments
+ * are numbered in order of their first atom. Consecutive atoms of the same
+ * residue are recognized without a lookup, so that the usual layout of one
+ * residue after another costs a single pass; residues whose atoms are
+ * interleaved with others are found through a hash table of their keys and
+ * still grouped correctly, with the contiguous flag cleared.
+ *
+ * If the table has no atoms, natom is set to -1.
+ *
+ * @param[in] t The atom table.
+ * @return The hierarchy.
+ */
+struct hierarchy buildHierarchy(const struct atomtable * t) {
+  struct hierarchy h = { .natom = -1, .nres = 0, .nseg = 0, .contiguous = 1,
+                         .atomRes = NULL, .resOffsets = NULL,
+                         .resAtoms = NULL, .resSeg = NULL,
+                         .segOffsets = NULL, .segRes = NULL };
+  if(t->natom == -1)
+    return h;
+  h.natom = t->natom;
+  h.atomRes = malloc((h.natom ? h.natom : 1) * sizeof(int));
+
+  // Segment of each segment name symbol, numbered by first appearance
+  int * symSeg = malloc((t->syms.nsym ? t->syms.nsym : 1) * sizeof(int));
+  for(int i=0; i<t->syms.nsym; i++)
+    symSeg[i] = -1;
+
+  int rescap = 1024; // Capacity of the per-residue arrays, grown by doubling
+  uint64_t * resKey = malloc(rescap * sizeof(uint64_t));
+  h.resSeg = malloc(rescap * sizeof(int));
+  int nslot = 2048; // Kept at least twice the number of residues
+  int * slots = calloc(nslot, sizeof(int));
+
+  for(int i=0; i<h.natom; i++) {
+    uint64_t key = (uint64_t) (uint32_t) t->seg[i] << 32 |
+      (uint32_t) t->resid[i];
+    if(i && resKey[h.atomRes[i-1]]==key) {
+      h.atomRes[i] = h.atomRes[i-1]; // Same residue as the previous atom
+      continue;
+    }
+    int s = findSlot(slots, nslot, resKey, key);
+    if(slots[s]) {
+      h.atomRes[i] = slots[s]-1; // A residue seen earlier, interrupted
+      h.contiguous = 0;
+      continue;
+    }
+
+    // New residue
+    if(h.nres==rescap) {
+      rescap *= 2;
+      resKey = realloc(resKey, rescap * sizeof(uint64_t));
+      h.resSeg = realloc(h.resSeg, rescap * sizeof(int));
+    }
+    if(symSeg[t->seg[i]]==-1)
+      symSeg[t->seg[i]] = h.nseg++;
+    resKey[h.nres] = key;
+    h.resSeg[h.nres] = symSeg[t->seg[i]];
+    h.atomRes[i] = h.nres;
+    slots[s] = ++h.nres;
+
+    if(2*h.nres > nslot) { // Rehash into a table twice the size
+      free(slots);
+      nslot *= 2;
+      slots = calloc(nslot, sizeof(int));
+      for(int r=0; r<h.nres; r++)
+        slots[findSlot(slots, nslot, resKey, resKey[r])] = r+1;
+    }
+  }
+  free(slots);
+  free(resKey);
+  free(symSeg);
+  h.resSeg = realloc(h.resSeg, (h.nres ? h.nres : 1) * sizeof(int)); // Trim
+
+  // Group atoms by residue and residues by segment
+  h.resOffsets = malloc((h.nres+1) * sizeof(int));
+  h.resAtoms = malloc((h.natom ? h.natom : 1) * sizeof(int));
+  groupByKey(h.atomRes, h.natom, h.nres, h.resOffsets, h.resAtoms);
+  h.segOffsets = malloc((h.nseg+1) * sizeof(int));
+  h.segRes = malloc((h.nres ? h.nres : 1) * sizeof(int));
+  groupByKey(h.resSeg, h.nres, h.nseg, h.segOffsets, h.segRes);
+  return h;
+}
+
+/**
+ * Frees the memory allocated for a hierarchy
+ *
+ * @param[in] h The hierarchy to be freed.
+ */
+void freeHierarchy(struct hierarchy h) {
+  free(h.atomRes);
+  free(h.resOffsets);
+  free(h.resAtoms);
+  free(h.resSeg);
+  free(h.segOffsets);
+  free(h.segRes);
+}
+
+/**
+ * Compute the center of every residue in one frame
+ *
+ * Averages the coordinates of the atoms of each residue, weighted by mass if
+ * masses are given. Residues whose total mass is zero (such as those read
+ * from a PDB, which carries no masses) fall back to the geometric center.
+ * When the hierarchy is contiguous, each residue is a plain range of the
+ * coordinate arrays and no index lookup is needed.
+ *
+ * @param[in] h The hierarchy.
+ * @param[in] xs The x coordinates of every atom, as from getCoords.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[in] mass The mass of every atom (such as the mass array of an atom
+ *                 table), or NULL for geometric centers.
+ * @param[out] cx The x coordinate of the center of each residue.
+ * @param[out] cy The y coordinate of the center of each residue.
+ * @param[out] cz The z coordinate of the center of each residue.
+ */
+void residueCenters(const struct hierarchy * h, const float * xs,
+    const float * ys, const float * zs, const double * mass, double * cx,
+    double * cy, double * cz) {
+  #pragma omp parallel for schedule(static)
+  for(int r=0; r<h->nres; r++) {
+    double sx = 0, sy = 0, sz = 0, sm = 0; // Weighted sums
+    double gx = 0, gy = 0, gz = 0; // Unweighted sums
+    for(int k=h->resOffsets[r]; k<h->resOffsets[r+1]; k++) {
+      int a = h->contiguous ? k : h->resAtoms[k];
+      double m = mass ? mass[a] : 0;
+      sx += m*xs[a];
+      sy += m*ys[a];
+      sz += m*zs[a];
+      sm += m;
+      gx += xs[a];
+      gy += ys[a];
+      gz += zs[a];
+    }
+    if(sm > 0) {
+      cx[r] = sx/sm;
+      cy[r] = sy/sm;
+      cz[r] = sz/sm;
+    } else {
+      int n = h->resOffsets[r+1]-h->resOffsets[r];
+      cx[r] = n ? gx/n : 0;
+      cy[r] = n ? gy/n : 0;
+      cz[r] = n ? gz/n : 0;
+    }
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef HIER
+#define HIER
+
+#include "symtab.h"
+
+struct hierarchy {
+  int natom;
+  int nres;
+  int nseg;
+  int contiguous; // 1 if the atoms of every residue are consecutive
+  int * atomRes; // residue index of each atom
+  int * resOffsets; // atoms of residue r: resAtoms[resOffsets[r]..[r+1]]
+  int * resAtoms; // resAtoms[k] == k when contiguous
+  int * resSeg; // segment index of each residue
+  int * segOffsets; // residues of segment s: segRes[segOffsets[s]..[s+1]]
+  int * segRes;
+};
+
+struct hierarchy buildHierarchy(const struct atomtable * t);
+void freeHierarchy(struct hierarchy h);
+void residueCenters(const struct hierarchy * h, const float * xs,
+    const float * ys, const float * zs, const double * mass, double * cx,
+    double * cy, double * cz);
+#endif
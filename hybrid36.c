@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hybrid36.h"
+
+/**
+ * Digit values for hybrid-36 decoding
+ *
+ * Each table maps a character to one more than its value as a digit, so that
+ * every character not listed maps to zero. Decimal digits are 0-9 in both
+ * alphabets; letters are 10-35 in the alphabet of their own case only.
+ */
+static const signed char upperDigits[256] = {
+  ['0']=1, ['1']=2, ['2']=3, ['3']=4, ['4']=5, ['5']=6, ['6']=7, ['7']=8,
+  ['8']=9, ['9']=10, ['A']=11, ['B']=12, ['C']=13, ['D']=14, ['E']=15,
+  ['F']=16, ['G']=17, ['H']=18, ['I']=19, ['J']=20, ['K']=21, ['L']=22,
+  ['M']=23, ['N']=24, ['O']=25, ['P']=26, ['Q']=27, ['R']=28, ['S']=29,
+  ['T']=30, ['U']=31, ['V']=32, ['W']=33, ['X']=34, ['Y']=35, ['Z']=36
+};
+
+static const signed char lowerDigits[256] = {
+  ['0']=1, ['1']=2, ['2']=3, ['3']=4, ['4']=5, ['5']=6, ['6']=7, ['7']=8,
+  ['8']=9, ['9']=10, ['a']=11, ['b']=12, ['c']=13, ['d']=14, ['e']=15,
+  ['f']=16, ['g']=17, ['h']=18, ['i']=19, ['j']=20, ['k']=21, ['l']=22,
+  ['m']=23, ['n']=24, ['o']=25, ['p']=26, ['q']=27, ['r']=28, ['s']=29,
+  ['t']=30, ['u']=31, ['v']=32, ['w']=33, ['x']=34, ['y']=35, ['z']=36
+};
+
+/**
+ * Decode a hybrid-36 number
+ *
+ * Hybrid-36 extends fixed-width decimal fields of PDB files: values that fit
+ * are written in decimal as usual, larger values continue with base-36 numbers
+ * starting with an upper-case letter ("A0000" follows "99999" in a field of
+ * width five), and after those come base-36 numbers starting with a lower-case
+ * letter. Decimal fields may be padded with spaces; base-36 fields must fill
+ * the whole width.
+ *
+ * @param[in] s The field to decode (need not be null-terminated).
+ * @param[in] width The width of the field, from 1 to 6.
+ * @param[out] value The decoded value; unchanged if decoding fails.
+ * @return 0 on success, or -1 if the field is blank or not a valid number.
+ */
+int hy36decode(const char * s, int width, int * value) {
+  if(width<1 || width>6)
+    return -1;
+  long long pow10 = 1; // 10^width
+  long long pow36 = 1; // 36^(width-1)
+  for(int i=0; i<width; i++)
+    pow10 *= 10;
+  for(int i=1; i<width; i++)
+    pow36 *= 36;
+
+  unsigned char c = s[0];
+  const signed char * table = (c>='A' && c<='Z') ? upperDigits
+                            : (c>='a' && c<='z') ? lowerDigits : NULL;
+  if(table) {
+    long long v = 0;
+    int valid = 1; // Stays nonzero only if every character is a digit
+    for(int i=0; i<width; i++) {
+      int d = table[(unsigned char) s[i]];
+      valid &= d!=0;
+      v = 36*v + d-1;
+    }
+    if(!valid)
+      return -1;
+    // Upper-case numbers start at 10*36^(width-1), and continue from 10^width
+    v += pow10 - 10*pow36;
+    if(table==lowerDigits) // Lower-case numbers follow the upper-case ones
+      v += 26*pow36;
+    *value = v;
+    return 0;
+  }
+
+  // Plain decimal, possibly padded with spaces and signed
+  int i = 0;
+  while(i<width && s[i]==' ')
+    i++;
+  bool neg = i<width && s[i]=='-';
+  if(neg)
+    i++;
+  if(i==width)
+    return -1; // Blank field
+  long long v = 0;
+  for(; i<width && s[i]!=' '; i++) {
+    if((unsigned) (s[i]-'0') >= 10)
+      return -1;
+    v = 10*v + (s[i]-'0');
+  }
+  for(; i<width; i++)
+    if(s[i]!=' ')
+      return -1; // Embedded space
+  *value = neg ? -v : v;
+  return 0;
+}
+
+/**
+ * Encode a hybrid-36 number
+ *
+ * Writes value right-justified in decimal if it fits in the field, and as a
+ * hybrid-36 base-36 number otherwise. Exactly width characters are written,
+ * with no null terminator.
+ *
+ * @param[in] value The value to encode.
+ * @param[in] width The width of the field, from 1 to 6.
+ * @param[out] s Where the field is written.
+ * @return 0 on success, or -1 if the value is out of range for the width, in
+ *         which case the field is filled with asterisks.
+ */
+int hy36encode(int value, int width, char * s) {
+  static const char upper[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  static const char lower[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  if(width<1 || width>6)
+    return -1;
+  long long pow10 = 1; // 10^width
+  long long pow36 = 1; // 36^(width-1)
+  for(int i=0; i<width; i++)
+    pow10 *= 10;
+  for(int i=1; i<width; i++)
+    pow36 *= 36;
+
+  long long v = value;
+  const char * digits = upper;
+  int base = 10;
+  bool fits = v > -pow10/10; // Room for the sign and remaining digits
+  if(v >= pow10) {
+    v -= pow10 - 10*pow36; // Offset into the upper-case range
+    base = 36;
+    if(v >= 36*pow36) {
+      v -= 26*pow36; // Offset into the lower-case range
+      digits = lower;
+    }
+    fits = v < 36*pow36;
+  }
+  if(!fits) {
+    for(int i=0; i<width; i++)
+      s[i] = '*';
+    return -1;
+  }
+
+  bool neg = v<0;
+  if(neg)
+    v = -v;
+  int i = width;
+  do {
+    s[--i] = digits[v%base];
+    v /= base;
+  } while(v && i>0);
+  if(neg)
+    s[--i] = '-';
+  while(i>0)
+    s[--i] = ' ';
+  return 0;
+}
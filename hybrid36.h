@@ -0,0 +1,6 @@
+#ifndef HYBRID36
+#define HYBRID36
+
+int hy36decode(const char * s, int width, int * value);
+int hy36encode(int value, int width, char * s);
+#endif
@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+/**
+ * Read a whole file into memory
+ *
+ * Used when a file cannot be memory mapped, such as a pipe or a file on a
+ * filesystem without mmap support. The buffer grows by doubling until the end
+ * of the file is reached.
+ *
+ * @param[in] fd The open file descriptor.
+ * @param[out] m The struct into which the buffer and its size are written.
+ */
+static void readWhole(int fd, struct mappedfile * m) {
+  size_t cap = 1<<16;
+  char * buf = malloc(cap);
+  size_t n = 0;
+  ssize_t got;
+  while((got = read(fd, buf+n, cap-n)) > 0) {
+    n += got;
+    if(n==cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  if(got<0 || n==0) { // Read error or empty file
+    free(buf);
+    return;
+  }
+  m->data = buf;
+  m->size = n;
+}
+
+/**
+ * Map a file into memory for reading
+ *
+ * Maps the whole file read-only, so that parsers can work directly on its
+ * contents without copying lines into buffers. If the file cannot be mapped,
+ * its contents are read into an allocated buffer instead. Either way, the
+ * result must be released with unmapFile.
+ *
+ * @param[in] path The filesystem path of the file.
+ * @return The mapped file. If the file cannot be opened or read, or is empty,
+ *         the data field is NULL and the size is zero.
+ */
+struct mappedfile mapFile(const char * path) {
+  struct mappedfile m = { .data = NULL, .size = 0, .mapped = 0 };
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) // Error encountered while opening file.
+    return m;
+
+  struct stat st;
+  if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data != MAP_FAILED) {
+      posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+      m.data = data;
+      m.size = st.st_size;
+      m.mapped = 1;
+    }
+  }
+  if(!m.mapped)
+    readWhole(fd, &m);
+  close(fd);
+  return m;
+}
+
+/**
+ * Release a mapped file
+ *
+ * @param[in] m The mapped file to be released.
+ */
+void unmapFile(struct mappedfile m) {
+  if(!m.data)
+    return;
+  if(m.mapped)
+    munmap((void *) m.data, m.size);
+  else
+    free((void *) m.data);
+}
@@ -0,0 +1,14 @@
+#ifndef MAPFILE
+#define MAPFILE
+
+#include <stddef.h>
+
+struct mappedfile {
+  const char * data;
+  size_t size;
+  int mapped; // 1 if data is a memory mapping, 0 if it was read into memory
+};
+
+struct mappedfile mapFile(const char * path);
+void unmapFile(struct mappedfile m);
+#endif
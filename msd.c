@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "msd.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+// Default memory for the coordinate series of one block of groups
+#define BLOCKBYTES ((size_t) 256 << 20)
+
+#define TWOPI 6.283185307179586
+
+/**
+ * Make every selected atom a group of its own
+ *
+ * @param[in] natom The number of atoms.
+ * @param[in] mask The atom mask of the selection, as from evalSelection, or
+ *                 NULL for every atom.
+ * @return The groups, with ngroup set to -1 if natom is negative.
+ */
+struct msdgroups atomGroups(int natom, const uint64_t * mask) {
+  struct msdgroups g = { .ngroup = -1, .offsets = NULL, .atoms = NULL,
+                         .w = NULL };
+  if(natom < 0)
+    return g;
+  g.ngroup = 0;
+  g.offsets = malloc((natom+1) * sizeof(int));
+  g.atoms = malloc((natom ? natom : 1) * sizeof(int));
+  g.w = malloc((natom ? natom : 1) * sizeof(double));
+  g.offsets[0] = 0;
+  for(int i=0; i<natom; i++)
+    if(!mask || mask[i/64] >> (i%64) & 1) {
+      g.atoms[g.ngroup] = i;
+      g.w[g.ngroup++] = 1;
+      g.offsets[g.ngroup] = g.ngroup;
+    }
+  return g;
+}
+
+/**
+ * Group the selected atoms by residue, to follow residue centers of mass
+ *
+ * Consecutive selected atoms with the same segment and residue ID form a
+ * group, weighted by mass, or equally if the masses of the group add up to
+ * zero.
+ *
+ * @param[in] t The atom table.
+ * @param[in] mask The atom mask of the selection, as from evalSelection, or
+ *                 NULL for every atom.
+ * @return The groups.
+ */
+struct msdgroups residueGroups(const struct atomtable * t,
+    const uint64_t * mask) {
+  struct msdgroups g = { .ngroup = 0, .offsets = NULL, .atoms = NULL,
+                         .w = NULL };
+  g.offsets = malloc((t->natom+1) * sizeof(int));
+  g.atoms = malloc((t->natom ? t->natom : 1) * sizeof(int));
+  g.w = malloc((t->natom ? t->natom : 1) * sizeof(double));
+  g.offsets[0] = 0;
+  int n = 0, last = -1;
+  for(int i=0; i<t->natom; i++) {
+    if(mask && !(mask[i/64] >> (i%64) & 1))
+      continue;
+    if(last == -1 || t->seg[i] != t->seg[last] ||
+        t->resid[i] != t->resid[last])
+      g.ngroup++;
+    g.offsets[g.ngroup] = n+1;
+    g.atoms[n] = i;
+    g.w[n++] = t->mass[i];
+    last = i;
+  }
+  for(int k=0; k<g.ngroup; k++) {
+    double sum = 0;
+    for(int e=g.offsets[k]; e<g.offsets[k+1]; e++)
+      sum += g.w[e];
+    for(int e=g.offsets[k]; e<g.offsets[k+1]; e++)
+      g.w[e] = sum != 0 ? g.w[e]/sum : 1.0/(g.offsets[k+1]-g.offsets[k]);
+  }
+  return g;
+}
+
+/**
+ * Frees the memory allocated for MSD groups
+ *
+ * @param[in] g The groups to be freed.
+ */
+void freeMSDGroups(struct msdgroups g) {
+  free(g.offsets);
+  free(g.atoms);
+  free(g.w);
+}
+
+/**
+ * Frees the memory allocated for an MSD curve
+ *
+ * @param[in] m The curve to be freed.
+ */
+void freeMSD(struct msd m) {
+  free(m.mean);
+}
+
+/**
+ * Transform a complex sequence in place with a radix-2 FFT
+ *
+ * The transform is unnormalized, so a forward and an inverse transform
+ * multiply the sequence by its length.
+ *
+ * @param[in,out] a The real and imaginary parts of each element, interleaved.
+ * @param[in] m The number of elements, a power of two.
+ * @param[in] w The cosine and sine of 2 pi k/m for k below m/2, interleaved.
+ * @param[in] inverse Whether to do the inverse transform.
+ */
+static void fft(double * a, int m, const double * w, int inverse) {
+  for(int i=1, j=0; i<m; i++) { // Bit-reversal permutation
+    int bit = m >> 1;
+    for(; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if(i < j) {
+      double re = a[2*i], im = a[2*i+1];
+      a[2*i] = a[2*j];
+      a[2*i+1] = a[2*j+1];
+      a[2*j] = re;
+      a[2*j+1] = im;
+    }
+  }
+  double sign = inverse ? 1 : -1;
+  for(int len=2; len<=m; len<<=1) {
+    int half = len/2, step = m/len;
+    for(int i=0; i<m; i+=len)
+      for(int k=0; k<half; k++) {
+        double wr = w[2*k*step], wi = sign*w[2*k*step+1];
+        double * u = &a[2*(i+k)], * v = &a[2*(i+k+half)];
+#ifdef __SSE2__
+        __m128d vv = _mm_loadu_pd(v), uu = _mm_loadu_pd(u);
+        __m128d t = _mm_add_pd(_mm_mul_pd(vv, _mm_set1_pd(wr)),
+            _mm_mul_pd(_mm_mul_pd(_mm_shuffle_pd(vv, vv, 1),
+            _mm_set1_pd(wi)), _mm_set_pd(1, -1)));
+        _mm_storeu_pd(v, _mm_sub_pd(uu, t));
+        _mm_storeu_pd(u, _mm_add_pd(uu, t));
+#else
+        double tr = wr*v[0] - wi*v[1], ti = wr*v[1] + wi*v[0];
+        v[0] = u[0] - tr;
+        v[1] = u[1] - ti;
+        u[0] += tr;
+        u[1] += ti;
+#endif
+      }
+  }
+}
+
+/**
+ * Find the summed autocorrelation of two real sequences
+ *
+ * The sequences are packed as the real and imaginary parts of one complex
+ * sequence, padded with zeros to avoid wrapping around. The real part of its
+ * autocorrelation is the sum of the autocorrelations of the two.
+ *
+ * @param[in] n The length of the sequences.
+ * @param[in] x The first sequence.
+ * @param[in] y The second sequence, or NULL for zeros.
+ * @param[in] m The padded length, a power of two at least 2n.
+ * @param[in] w The twiddle factors, as for fft.
+ * @param[out] a Scratch space of 2m doubles.
+ * @param[out] ac The sum over k of x[k]x[k+j] + y[k]y[k+j] for each lag j,
+ *                added to what it holds.
+ */
+static void autocorrelate(int n, const double * x, const double * y, int m,
+    const double * w, double * a, double * ac) {
+  for(int k=0; k<n; k++) {
+    a[2*k] = x[k];
+    a[2*k+1] = y ? y[k] : 0;
+  }
+  memset(&a[2*n], 0, 2*(size_t) (m-n) * sizeof(double));
+  fft(a, m, w, 0);
+  for(int k=0; k<m; k++) {
+    a[2*k] = a[2*k]*a[2*k] + a[2*k+1]*a[2*k+1];
+    a[2*k+1] = 0;
+  }
+  fft(a, m, w, 1);
+  for(int j=0; j<n; j++)
+    ac[j] += a[2*j]/m;
+}
+
+/**
+ * Compute the MSD of one trajectory at every lag
+ *
+ * Uses the fast correlation algorithm: the MSD at lag j is the mean of
+ * r(k)^2 + r(k+j)^2, found by a running sum, less twice the autocorrelation
+ * of r, found by FFT, for O(n log n) work instead of O(n^2). The trajectory
+ * is first centered on its mean position, to which the MSD is indifferent,
+ * so the two terms are not large numbers that nearly cancel.
+ *
+ * @param[in] n The number of frames.
+ * @param[in,out] x The x coordinate in every frame, centered on return.
+ * @param[in,out] y The y coordinate in every frame, centered on return.
+ * @param[in,out] z The z coordinate in every frame, centered on return.
+ * @param[in] m The padded length, a power of two at least 2n.
+ * @param[in] w The twiddle factors, as for fft.
+ * @param[out] a Scratch space of 2m doubles.
+ * @param[out] ac Scratch space of n doubles.
+ * @param[in,out] msd The MSD at every lag, added to what it holds.
+ */
+static void seriesMSD(int n, double * x, double * y, double * z, int m,
+    const double * w, double * a, double * ac, double * msd) {
+  double c[3] = { 0, 0, 0 };
+  for(int k=0; k<n; k++) {
+    c[0] += x[k];
+    c[1] += y[k];
+    c[2] += z[k];
+  }
+  double q = 0; // Sum of r^2 over the frames not yet dropped, doubled
+  for(int k=0; k<n; k++) {
+    x[k] -= c[0]/n;
+    y[k] -= c[1]/n;
+    z[k] -= c[2]/n;
+    q += 2*(x[k]*x[k] + y[k]*y[k] + z[k]*z[k]);
+  }
+  memset(ac, 0, n * sizeof(double));
+  autocorrelate(n, x, y, m, w, a, ac);
+  autocorrelate(n, z, NULL, m, w, a, ac);
+  for(int j=0; j<n; j++) {
+    if(j) {
+      int lo = j-1, hi = n-j;
+      q -= x[lo]*x[lo] + y[lo]*y[lo] + z[lo]*z[lo] +
+           x[hi]*x[hi] + y[hi]*y[hi] + z[hi]*z[hi];
+    }
+    double v = (q - 2*ac[j]) / (n-j);
+    msd[j] += v > 0 ? v : 0; // Rounding can leave tiny negatives
+  }
+}
+
+struct msdread {
+  const struct msdgroups * g;
+  int e0, ne; // first entry of the block and number of entries
+  int n; // number of frames
+  float * series; // coordinate series of every entry of the block
+  double * box; // unit cell of every frame
+};
+
+/**
+ * Store the coordinates of the atoms of a block of groups in a frame
+ *
+ * The frame callback of the pipeline stage of computeMSD.
+ *
+ * @param[in,out] data The msdread struct, receiving frame f.
+ * @param[in] state Unused.
+ * @param[in] f The frame.
+ * @param[in] uc The unit cell of the frame.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void readMSDFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct msdread * b = data;
+  size_t n = b->n;
+  for(int q=0; q<3; q++)
+    b->box[3*f+q] = uc[q];
+  for(int e=0; e<b->ne; e++) {
+    int i = b->g->atoms[b->e0+e];
+    b->series[(3*(size_t) e)*n + f] = xs[i];
+    b->series[(3*(size_t) e+1)*n + f] = ys[i];
+    b->series[(3*(size_t) e+2)*n + f] = zs[i];
+  }
+}
+
+/**
+ * Compute the MSD averaged over groups of atoms in a DCD
+ *
+ * Groups are handled in blocks whose coordinates over the whole trajectory
+ * fit in blockbytes of memory. For each block, the atoms of the block are
+ * read from every frame by runPipeline and stored atom by atom. The MSD of
+ * each group's center is then found by FFT, the groups divided between
+ * OpenMP threads.
+ *
+ * Each block costs a pass over the whole DCD, so the trajectory is read
+ * ceil(12*nframes*nentry/blockbytes) times, nentry being the number of
+ * group entries. For example, at 100k frames the default 256 MiB holds about
+ * 220 atoms, so a 30k-atom selection takes some 135 passes. Give a budget of
+ * 12*nframes*nentry bytes, if that much memory is available, to read the
+ * DCD once.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] g The groups, as from atomGroups or residueGroups.
+ * @param[in] unwrap Whether to unwrap the trajectory of each atom, taking
+ *                   each step to the nearest image in the box of the frame.
+ *                   Otherwise the coordinates must already be unwrapped.
+ * @param[in] blockbytes The memory for the coordinates of one block, or 0
+ *                       for 256 MiB. At least one group is taken per block.
+ * @return The MSD at every lag, with nlag set to -1 if the DCD cannot be
+ *         read, has no frames or lacks atoms of the groups, or there are no
+ *         groups.
+ */
+struct msd computeMSD(char * path, const struct msdgroups * g, int unwrap,
+    size_t blockbytes) {
+  struct msd r = { .nlag = -1, .ngroup = g->ngroup, .mean = NULL };
+  struct dcd * d = openDCD(path);
+  if(!d || g->ngroup <= 0)
+    return r;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+  if(!nframes)
+    return r;
+  for(int e=0; e<g->offsets[g->ngroup]; e++)
+    if(g->atoms[e] < 0 || (uint32_t) g->atoms[e] >= natoms)
+      return r;
+  int n = nframes;
+  int m = 1;
+  while(m < 2*n)
+    m *= 2;
+  double * w = malloc(m * sizeof(double));
+  for(int k=0; k<m/2; k++) {
+    w[2*k] = cos(TWOPI*k/m);
+    w[2*k+1] = sin(TWOPI*k/m);
+  }
+  double * box = calloc(3*(size_t) n, sizeof(double));
+  size_t perAtom = 3*(size_t) n * sizeof(float);
+  if(!blockbytes)
+    blockbytes = BLOCKBYTES;
+  size_t fit = blockbytes/perAtom;
+  int maxEntries = fit > INT_MAX ? INT_MAX : (fit > 0 ? (int) fit : 1);
+  float * series = NULL;
+#ifdef _OPENMP
+  int nthreads = omp_get_max_threads();
+#else
+  int nthreads = 1;
+#endif
+  double * partial = calloc((size_t) nthreads*n, sizeof(double));
+  int nword = (natoms+63)/64;
+  uint64_t * mask = malloc((nword ? nword : 1) * sizeof(uint64_t));
+
+  bool failed = false;
+  for(int g0=0, g1; g0<g->ngroup && !failed; g0=g1) {
+    // The next block of groups, taking at least one
+    g1 = g0+1;
+    while(g1 < g->ngroup && g->offsets[g1+1]-g->offsets[g0] <= maxEntries)
+      g1++;
+    int e0 = g->offsets[g0], ne = g->offsets[g1] - e0;
+    memset(mask, 0, (nword ? nword : 1) * sizeof(uint64_t));
+    for(int e=e0; e<e0+ne; e++)
+      mask[g->atoms[e]/64] |= (uint64_t) 1 << (g->atoms[e]%64);
+    series = realloc(series, ne*perAtom);
+
+    struct msdread b = { .g = g, .e0 = e0, .ne = ne, .n = n,
+                         .series = series, .box = box };
+    struct stage s = { .data = &b, .mask = mask, .init = NULL,
+                       .frame = readMSDFrame, .combine = NULL,
+                       .merge = NULL };
+    failed = runPipeline(path, 1, &s, NULL) == -1;
+    if(failed)
+      break;
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+#ifdef _OPENMP
+      double * msd = &partial[(size_t) omp_get_thread_num()*n];
+#else
+      double * msd = partial;
+#endif
+      double * c = malloc(3*(size_t) n * sizeof(double));
+      double * a = malloc(2*(size_t) m * sizeof(double));
+      double * ac = malloc(n * sizeof(double));
+      // A fixed share of groups per thread keeps each partial sum the same
+      // from run to run
+      #pragma omp for schedule(static)
+      for(int k=g0; k<g1; k++) {
+        memset(c, 0, 3*(size_t) n * sizeof(double));
+        for(int e=g->offsets[k]; e<g->offsets[k+1]; e++)
+          for(int q=0; q<3; q++) {
+            const float * s = &series[(3*(size_t) (e-e0)+q)*n];
+            double u = s[0]; // Unwrapped position
+            c[(size_t) q*n] += g->w[e]*u;
+            for(int f=1; f<n; f++) {
+              double step = s[f] - s[f-1];
+              double len = box[3*f+q];
+              if(unwrap && len > 0)
+                step -= len*rint(step/len);
+              u += step;
+              c[(size_t) q*n+f] += g->w[e]*u;
+            }
+          }
+        seriesMSD(n, c, &c[n], &c[2*(size_t) n], m, w, a, ac, msd);
+      }
+      free(c);
+      free(a);
+      free(ac);
+    }
+  }
+  free(series);
+  free(mask);
+  free(box);
+  free(w);
+  if(failed) {
+    free(partial);
+    return r;
+  }
+
+  // Add up the threads in a fixed order, so the result does not depend on
+  // their scheduling
+  r.nlag = n;
+  r.mean = calloc(n, sizeof(double));
+  for(int t=0; t<nthreads; t++)
+    for(int j=0; j<n; j++)
+      r.mean[j] += partial[(size_t) t*n+j];
+  for(int j=0; j<n; j++)
+    r.mean[j] /= g->ngroup;
+  free(partial);
+  return r;
+}
+
+/**
+ * Fit a diffusion coefficient to an MSD curve
+ *
+ * Fits a line to the MSD against time by least squares and divides its
+ * slope by six, for diffusion in three dimensions.
+ *
+ * @param[in] m The MSD curve, as from computeMSD.
+ * @param[in] dt The time between frames.
+ * @param[in] first The first lag of the fit, in frames.
+ * @param[in] last The lag after the last of the fit, in frames.
+ * @return The diffusion coefficient, in squared length units of the DCD per
+ *         unit of dt, or NaN if the range holds fewer than two lags.
+ */
+double fitDiffusion(const struct msd * m, double dt, int first, int last) {
+  if(first < 0)
+    first = 0;
+  if(last > m->nlag)
+    last = m->nlag;
+  int n = last - first;
+  if(n < 2)
+    return NAN;
+  double st = 0, sm = 0, stt = 0, stm = 0;
+  for(int j=first; j<last; j++) {
+    double t = j*dt;
+    st += t;
+    sm += m->mean[j];
+    stt += t*t;
+    stm += t*m->mean[j];
+  }
+  double slope = (n*stm - st*sm) / (n*stt - st*st);
+  return slope/6;
+}
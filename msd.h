@@ -0,0 +1,30 @@
+#ifndef MSD
+#define MSD
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "symtab.h"
+
+struct msdgroups {
+  int ngroup;
+  int * offsets; // atoms of group g are atoms[offsets[g]..offsets[g+1]]
+  int * atoms;
+  double * w; // weight of each atom within its group, summing to one
+};
+
+struct msd {
+  int nlag; // lags of 0 to nlag-1 frames
+  int ngroup;
+  double * mean; // MSD at each lag, averaged over the groups
+};
+
+struct msdgroups atomGroups(int natom, const uint64_t * mask);
+struct msdgroups residueGroups(const struct atomtable * t,
+    const uint64_t * mask);
+void freeMSDGroups(struct msdgroups g);
+struct msd computeMSD(char * path, const struct msdgroups * g, int unwrap,
+    size_t blockbytes);
+void freeMSD(struct msd m);
+double fitDiffusion(const struct msd * m, double dt, int first, int last);
+#endif
@@ -0,0 +1,656 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "nsearch.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct nsearch {
+  double cutoff;
+  double skin;
+  bool built; // false until the first update
+  int n; // number of atoms in the grid
+  int * idx; // atom index of each grid atom, in the order given
+  double box[3]; // box lengths the grid was built for, 0 if not periodic
+  double origin[3]; // corner of the first cell
+  double far[3]; // highest coordinate of a non-periodic axis at build
+  double size[3]; // cell edge lengths, at least cutoff+skin
+  int ncell[3];
+  int * offsets; // slots of cell c are offsets[c]..offsets[c+1]
+  int * slotAtom; // atom index of each slot; slots are in cell order
+  float * cx; // current coordinates of each slot, kept near its cell
+  float * cy;
+  float * cz;
+  float * wx; // coordinates of each slot when the grid was built, wrapped
+  float * wy;
+  float * wz;
+};
+
+/**
+ * Create a neighbor search
+ *
+ * The search is empty until updateNeighborSearch places a frame in its grid.
+ * The skin is a margin added to the cell size, so that the grid can be
+ * reused for later frames as long as no atom has moved more than half the
+ * skin since it was built. A skin of 0 rebuilds the grid on every frame that
+ * differs from the last.
+ *
+ * @param[in] cutoff The largest distance that queries will look for.
+ * @param[in] skin The margin for reusing the grid.
+ * @return The neighbor search handle.
+ */
+struct nsearch *newNeighborSearch(double cutoff, double skin) {
+  struct nsearch * ns = calloc(1, sizeof(struct nsearch));
+  ns->cutoff = cutoff > 0 ? cutoff : 0;
+  ns->skin = skin > 0 ? skin : 0;
+  ns->built = false;
+  return ns;
+}
+
+/**
+ * Frees the memory allocated for a neighbor search
+ *
+ * @param[in] ns The neighbor search to be freed.
+ */
+void freeNeighborSearch(struct nsearch * ns) {
+  if(!ns)
+    return;
+  free(ns->idx);
+  free(ns->offsets);
+  free(ns->slotAtom);
+  free(ns->cx);
+  free(ns->cy);
+  free(ns->cz);
+  free(ns->wx);
+  free(ns->wy);
+  free(ns->wz);
+  free(ns);
+}
+
+/**
+ * Wrap a coordinate into [0,len)
+ *
+ * @param[in] x The coordinate.
+ * @param[in] len The box length, or 0 if the axis is not periodic.
+ * @return The wrapped coordinate, or x itself if the axis is not periodic.
+ */
+static float wrapInto(float x, double len) {
+  if(!(len > 0))
+    return x;
+  float l = len;
+  float w = x - l*floorf(x/l);
+  if(w < 0)
+    w += l;
+  if(w >= l)
+    w -= l;
+  return w;
+}
+
+/**
+ * Find the cell of a coordinate along one axis
+ *
+ * Coordinates beyond the grid are placed in its first or last cell, which
+ * keeps every pair closer than a cell edge in the same or adjacent cells.
+ *
+ * @param[in] ns The neighbor search.
+ * @param[in] d The axis.
+ * @param[in] x The coordinate, wrapped if the axis is periodic.
+ * @return The cell index along the axis.
+ */
+static int cellOf(const struct nsearch * ns, int d, float x) {
+  double c = floor((x - ns->origin[d]) / ns->size[d]);
+  if(c < 0)
+    return 0;
+  if(c >= ns->ncell[d])
+    return ns->ncell[d]-1;
+  return (int) c;
+}
+
+/**
+ * Place the atoms of a frame in a new grid
+ *
+ * Periodic axes are split into a whole number of cells across the box, and
+ * other axes are covered from the lowest to the highest coordinate. If that
+ * would give many more cells than atoms (as for a sparse selection), cells
+ * are merged. Slots are grouped by cell with a counting sort.
+ *
+ * @param[in,out] ns The neighbor search.
+ * @param[in] uc The box lengths, or NULL.
+ * @param[in] n The number of atoms.
+ * @param[in] idx The atom indices, or NULL for atoms 0 to n-1.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void buildGrid(struct nsearch * ns, const double * uc, int n,
+    const int * idx, const float * xs, const float * ys, const float * zs) {
+  const float * coords[3] = { xs, ys, zs };
+  ns->n = n;
+  size_t len = (n ? n : 1);
+  ns->idx = realloc(ns->idx, len * sizeof(int));
+  for(int k=0; k<n; k++)
+    ns->idx[k] = idx ? idx[k] : k;
+
+  double edge = ns->cutoff + ns->skin;
+  if(!(edge > 0))
+    edge = 1;
+  for(int d=0; d<3; d++) {
+    ns->box[d] = uc && uc[d] > 0 ? uc[d] : 0;
+    if(ns->box[d] > 0) {
+      ns->origin[d] = 0;
+      ns->ncell[d] = ns->box[d] >= edge ? (int) (ns->box[d]/edge) : 1;
+      ns->size[d] = ns->box[d]/ns->ncell[d];
+    } else {
+      float lo = n ? coords[d][ns->idx[0]] : 0;
+      float hi = lo;
+      for(int k=1; k<n; k++) {
+        float x = coords[d][ns->idx[k]];
+        lo = x < lo ? x : lo;
+        hi = x > hi ? x : hi;
+      }
+      ns->origin[d] = lo;
+      ns->far[d] = hi;
+      ns->size[d] = edge;
+      double cells = floor((hi-lo)/edge) + 1;
+      ns->ncell[d] = cells < (1<<20) ? (int) cells : (1<<20);
+      if(ns->ncell[d]==(1<<20)) // Far apart atoms: make the cells fit
+        ns->size[d] = (hi-lo)/((1<<20)-1);
+    }
+  }
+
+  // Merge cells along the longest axis until there are not many more cells
+  // than atoms
+  while((double) ns->ncell[0]*ns->ncell[1]*ns->ncell[2] > 2.0*n + 64) {
+    int d = 0;
+    for(int e=1; e<3; e++)
+      if(ns->ncell[e] > ns->ncell[d])
+        d = e;
+    ns->ncell[d] = (ns->ncell[d]+1)/2;
+    ns->size[d] = ns->box[d] > 0 ? ns->box[d]/ns->ncell[d] : 2*ns->size[d];
+  }
+
+  int ncell = ns->ncell[0]*ns->ncell[1]*ns->ncell[2];
+  ns->offsets = realloc(ns->offsets, (ncell+1) * sizeof(int));
+  ns->slotAtom = realloc(ns->slotAtom, len * sizeof(int));
+  ns->cx = realloc(ns->cx, len * sizeof(float));
+  ns->cy = realloc(ns->cy, len * sizeof(float));
+  ns->cz = realloc(ns->cz, len * sizeof(float));
+  ns->wx = realloc(ns->wx, len * sizeof(float));
+  ns->wy = realloc(ns->wy, len * sizeof(float));
+  ns->wz = realloc(ns->wz, len * sizeof(float));
+
+  // Cell of each atom, then a counting sort of the atoms by cell
+  int * cell = malloc(len * sizeof(int));
+  memset(ns->offsets, 0, (ncell+1) * sizeof(int));
+  #pragma omp parallel for schedule(static)
+  for(int k=0; k<n; k++) {
+    int a = ns->idx[k];
+    int c[3];
+    for(int d=0; d<3; d++)
+      c[d] = cellOf(ns, d, wrapInto(coords[d][a], ns->box[d]));
+    cell[k] = (c[2]*ns->ncell[1] + c[1])*ns->ncell[0] + c[0];
+  }
+  for(int k=0; k<n; k++)
+    ns->offsets[cell[k]+1]++;
+  for(int c=0; c<ncell; c++)
+    ns->offsets[c+1] += ns->offsets[c];
+  int * fill = malloc(ncell * sizeof(int));
+  memcpy(fill, ns->offsets, ncell * sizeof(int));
+  for(int k=0; k<n; k++) {
+    int s = fill[cell[k]]++;
+    int a = ns->idx[k];
+    ns->slotAtom[s] = a;
+    ns->wx[s] = ns->cx[s] = wrapInto(xs[a], ns->box[0]);
+    ns->wy[s] = ns->cy[s] = wrapInto(ys[a], ns->box[1]);
+    ns->wz[s] = ns->cz[s] = wrapInto(zs[a], ns->box[2]);
+  }
+  free(fill);
+  free(cell);
+  ns->built = true;
+}
+
+/**
+ * Place the atoms of a frame in the grid of a neighbor search
+ *
+ * If the box and atoms are those of the current grid and no atom has moved
+ * more than half the skin since the grid was built, the grid is kept and only
+ * the coordinates of its atoms are refreshed. Otherwise the grid is rebuilt.
+ * Each axis with a positive box length is periodic, and distances along it
+ * follow the minimum image convention; such box lengths must be at least
+ * twice the cutoff. With a NULL uc, no axis is periodic.
+ *
+ * @param[in,out] ns The neighbor search.
+ * @param[in] uc The box lengths a, b and c, as from getUnitCell, or NULL.
+ * @param[in] n The number of atoms to place in the grid.
+ * @param[in] idx The indices of those atoms (such as from maskToIndices), or
+ *                NULL for atoms 0 to n-1.
+ * @param[in] xs The x coordinates of every atom, as from getCoords.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @return 1 if the grid was rebuilt, or 0 if it was reused.
+ */
+int updateNeighborSearch(struct nsearch * ns, const double * uc, int n,
+    const int * idx, const float * xs, const float * ys, const float * zs) {
+  bool same = ns->built && n==ns->n;
+  for(int d=0; d<3 && same; d++)
+    same = ns->box[d] == (uc && uc[d] > 0 ? uc[d] : 0);
+  for(int k=0; k<n && same; k++)
+    same = ns->idx[k] == (idx ? idx[k] : k);
+  if(same) {
+    float len[3], inv[3];
+    for(int d=0; d<3; d++) {
+      len[d] = ns->box[d];
+      inv[d] = ns->box[d] > 0 ? 1/ns->box[d] : 0;
+    }
+    float maxd2 = 0;
+    #pragma omp parallel for schedule(static) reduction(max:maxd2)
+    for(int s=0; s<n; s++) {
+      int a = ns->slotAtom[s];
+      // Displacement since the grid was built, by the minimum image
+      float dx = xs[a]-ns->wx[s];
+      float dy = ys[a]-ns->wy[s];
+      float dz = zs[a]-ns->wz[s];
+      dx -= len[0]*rintf(dx*inv[0]);
+      dy -= len[1]*rintf(dy*inv[1]);
+      dz -= len[2]*rintf(dz*inv[2]);
+      ns->cx[s] = ns->wx[s]+dx;
+      ns->cy[s] = ns->wy[s]+dy;
+      ns->cz[s] = ns->wz[s]+dz;
+      float d2 = dx*dx + dy*dy + dz*dz;
+      if(d2 > maxd2)
+        maxd2 = d2;
+    }
+    if(maxd2 <= 0.25*ns->skin*ns->skin)
+      return 0;
+  }
+  buildGrid(ns, uc, n, idx, xs, ys, zs);
+  return 1;
+}
+
+/**
+ * Find the slots of a cell within a distance of a point
+ *
+ * Compares four slots at a time with SSE2 where available.
+ *
+ * @param[in] ns The neighbor search.
+ * @param[in] start The first slot of the cell.
+ * @param[in] end One past the last slot of the cell.
+ * @param[in] qx The x coordinate of the point, in the image of the cell.
+ * @param[in] qy The y coordinate of the point.
+ * @param[in] qz The z coordinate of the point.
+ * @param[in] r2 The square of the distance.
+ * @param[out] hits The slots found.
+ * @return The number of slots found.
+ */
+static int scanCell(const struct nsearch * ns, int start, int end, float qx,
+    float qy, float qz, float r2, int * hits) {
+  const float * cx = ns->cx, * cy = ns->cy, * cz = ns->cz;
+  int nhit = 0;
+  int s = start;
+#ifdef __SSE2__
+  const __m128 vx = _mm_set1_ps(qx);
+  const __m128 vy = _mm_set1_ps(qy);
+  const __m128 vz = _mm_set1_ps(qz);
+  const __m128 vr2 = _mm_set1_ps(r2);
+  for(; s+4<=end; s+=4) {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(&cx[s]),vx);
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(&cy[s]),vy);
+    __m128 dz = _mm_sub_ps(_mm_loadu_ps(&cz[s]),vz);
+    __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy)),
+                           _mm_mul_ps(dz,dz));
+    int m = _mm_movemask_ps(_mm_cmple_ps(d2,vr2));
+    while(m) {
+      hits[nhit++] = s + __builtin_ctz(m);
+      m &= m-1;
+    }
+  }
+#endif
+  for(; s<end; s++) {
+    float dx = cx[s]-qx;
+    float dy = cy[s]-qy;
+    float dz = cz[s]-qz;
+    if(dx*dx + dy*dy + dz*dz <= r2)
+      hits[nhit++] = s;
+  }
+  return nhit;
+}
+
+/**
+ * Find the slots within the cutoff of a point
+ *
+ * Scans the cell of the point and its neighbors. Across a periodic face, the
+ * point is shifted by the box length instead of the slots, so that each cell
+ * is compared with a single image of the point.
+ *
+ * @param[in] ns The neighbor search.
+ * @param[in] x The x coordinate of the point.
+ * @param[in] y The y coordinate of the point.
+ * @param[in] z The z coordinate of the point.
+ * @param[in] first Whether to stop at the first cell with a slot found.
+ * @param[out] hits The slots found, with room for maxHits slots.
+ * @return The number of slots found.
+ */
+static int querySlots(const struct nsearch * ns, float x, float y, float z,
+    bool first, int * hits) {
+  float q[3] = { wrapInto(x, ns->box[0]), wrapInto(y, ns->box[1]),
+                 wrapInto(z, ns->box[2]) };
+  // Along a non-periodic axis, nothing is found beyond the atoms' range
+  double reach = ns->cutoff + 0.5*ns->skin;
+  for(int d=0; d<3; d++)
+    if(!(ns->box[d] > 0) && (q[d] < ns->origin[d]-reach ||
+                             q[d] > ns->far[d]+reach))
+      return 0;
+  int c[3];
+  for(int d=0; d<3; d++)
+    c[d] = cellOf(ns, d, q[d]);
+  float r2 = ns->cutoff*ns->cutoff;
+
+  // Cell index and point image for each of the three neighbors along an axis
+  int nbr[3][3];
+  float img[3][3];
+  for(int d=0; d<3; d++) {
+    for(int o=0; o<3; o++) {
+      int nc = c[d]+o-1;
+      img[d][o] = q[d];
+      if(ns->box[d] > 0) {
+        if(nc < 0) {
+          nc += ns->ncell[d];
+          img[d][o] += ns->box[d];
+        } else if(nc >= ns->ncell[d]) {
+          nc -= ns->ncell[d];
+          img[d][o] -= ns->box[d];
+        }
+      } else if(nc < 0 || nc >= ns->ncell[d])
+        nc = -1;
+      nbr[d][o] = nc;
+    }
+  }
+
+  int nhit = 0;
+  for(int oz=0; oz<3; oz++) {
+    if(nbr[2][oz] < 0)
+      continue;
+    for(int oy=0; oy<3; oy++) {
+      if(nbr[1][oy] < 0)
+        continue;
+      int row = (nbr[2][oz]*ns->ncell[1] + nbr[1][oy])*ns->ncell[0];
+      if(nbr[0][0] >= 0 && nbr[0][2]==nbr[0][0]+2) {
+        // The three cells are consecutive in the same image, so their slots
+        // are too and can be scanned in one run
+        nhit += scanCell(ns, ns->offsets[row+nbr[0][0]],
+            ns->offsets[row+nbr[0][2]+1], img[0][1], img[1][oy], img[2][oz],
+            r2, &hits[nhit]);
+        if(first && nhit)
+          return nhit;
+        continue;
+      }
+      for(int ox=0; ox<3; ox++) {
+        if(nbr[0][ox] < 0)
+          continue;
+        int cell = row + nbr[0][ox];
+        nhit += scanCell(ns, ns->offsets[cell], ns->offsets[cell+1],
+            img[0][ox], img[1][oy], img[2][oz], r2, &hits[nhit]);
+        if(first && nhit)
+          return nhit;
+      }
+    }
+  }
+  return nhit;
+}
+
+/**
+ * Order query atoms by the cell they fall in
+ *
+ * Consecutive queries then scan the same cells, which stay in cache, instead
+ * of jumping across the grid as they would in atom order.
+ *
+ * @param[in] ns The neighbor search.
+ * @param[in] n The number of query atoms.
+ * @param[in] idx The indices of the query atoms, or NULL for atoms 0 to
+ *                n-1.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @return The positions in idx of the query atoms, ordered by cell.
+ */
+static int * queryOrder(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs) {
+  int ncell = ns->ncell[0]*ns->ncell[1]*ns->ncell[2];
+  int * cell = malloc((n ? n : 1) * sizeof(int));
+  int * start = calloc(ncell+1, sizeof(int));
+  #pragma omp parallel for schedule(static)
+  for(int i=0; i<n; i++) {
+    int a = idx ? idx[i] : i;
+    int cx = cellOf(ns, 0, wrapInto(xs[a], ns->box[0]));
+    int cy = cellOf(ns, 1, wrapInto(ys[a], ns->box[1]));
+    int cz = cellOf(ns, 2, wrapInto(zs[a], ns->box[2]));
+    cell[i] = (cz*ns->ncell[1] + cy)*ns->ncell[0] + cx;
+  }
+  for(int i=0; i<n; i++)
+    start[cell[i]+1]++;
+  for(int c=0; c<ncell; c++)
+    start[c+1] += start[c];
+  int * order = malloc((n ? n : 1) * sizeof(int));
+  for(int i=0; i<n; i++)
+    order[start[cell[i]]++] = i;
+  free(start);
+  free(cell);
+  return order;
+}
+
+/**
+ * Get the most slots a single query can find
+ *
+ * A periodic axis split into fewer than three cells has some cells visited
+ * more than once, in different images, and a box shorter than twice the
+ * cutoff can then give the same slot several times.
+ *
+ * @param[in] ns The neighbor search.
+ * @return The length needed for the hits of querySlots.
+ */
+static size_t maxHits(const struct nsearch * ns) {
+  size_t n = ns->n ? ns->n : 1;
+  for(int d=0; d<3; d++)
+    if(ns->box[d] > 0 && ns->ncell[d] < 3)
+      n *= 3;
+  return n;
+}
+
+/**
+ * Find every pair of a query atom and a grid atom within the cutoff
+ *
+ * Queries are taken in order of their cell and split into chunks, each
+ * gathering its pairs in its own buffer on one of the OpenMP threads; the
+ * buffers are then joined in order. The pairs of each query atom are
+ * consecutive, but query atoms are not in index order. An atom is never
+ * paired with itself, but
+ * when the query and grid atoms overlap, each pair between them is found
+ * from both sides.
+ *
+ * @param[in] ns The neighbor search, updated with the current frame.
+ * @param[in] n The number of query atoms.
+ * @param[in] idx The indices of the query atoms, or NULL for atoms 0 to
+ *                n-1.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @return The pairs, with npair set to -1 if the grid has not been built.
+ */
+struct pairlist findPairs(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs) {
+  struct pairlist p = { .npair = -1, .a = NULL, .b = NULL, .r = NULL };
+  if(!ns->built)
+    return p;
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  int nchunk = 4*nthreads;
+  if(nchunk > n/256+1)
+    nchunk = n/256+1; // Don't split small queries into tiny chunks
+  struct pairlist * part = malloc(nchunk * sizeof(struct pairlist));
+  int * order = queryOrder(ns, n, idx, xs, ys, zs);
+
+  #pragma omp parallel
+  {
+    int * hits = malloc(maxHits(ns) * sizeof(int));
+    #pragma omp for schedule(dynamic)
+    for(int k=0; k<nchunk; k++) {
+      struct pairlist q = { .npair = 0 };
+      int cap = 1024; // Capacity of the chunk's buffers, grown by doubling
+      q.a = malloc(cap * sizeof(int));
+      q.b = malloc(cap * sizeof(int));
+      q.r = malloc(cap * sizeof(float));
+      for(int j=(int) ((long) n*k/nchunk); j<(long) n*(k+1)/nchunk; j++) {
+        int a = idx ? idx[order[j]] : order[j];
+        int nhit = querySlots(ns, xs[a], ys[a], zs[a], false, hits);
+        if(q.npair+nhit > cap) {
+          while(q.npair+nhit > cap)
+            cap *= 2;
+          q.a = realloc(q.a, cap * sizeof(int));
+          q.b = realloc(q.b, cap * sizeof(int));
+          q.r = realloc(q.r, cap * sizeof(float));
+        }
+        for(int h=0; h<nhit; h++) {
+          int s = hits[h];
+          if(ns->slotAtom[s]==a)
+            continue;
+          // The slot coordinates are near the query's image, not the query's
+          float dx = xs[a]-ns->cx[s];
+          float dy = ys[a]-ns->cy[s];
+          float dz = zs[a]-ns->cz[s];
+          if(ns->box[0] > 0)
+            dx -= ns->box[0]*rint(dx/ns->box[0]);
+          if(ns->box[1] > 0)
+            dy -= ns->box[1]*rint(dy/ns->box[1]);
+          if(ns->box[2] > 0)
+            dz -= ns->box[2]*rint(dz/ns->box[2]);
+          q.a[q.npair] = a;
+          q.b[q.npair] = ns->slotAtom[s];
+          q.r[q.npair++] = sqrtf(dx*dx + dy*dy + dz*dz);
+        }
+      }
+      part[k] = q;
+    }
+    free(hits);
+  }
+  free(order);
+
+  p.npair = 0;
+  for(int k=0; k<nchunk; k++)
+    p.npair += part[k].npair;
+  size_t len = p.npair ? p.npair : 1;
+  p.a = malloc(len * sizeof(int));
+  p.b = malloc(len * sizeof(int));
+  p.r = malloc(len * sizeof(float));
+  int at = 0;
+  for(int k=0; k<nchunk; k++) {
+    memcpy(&p.a[at], part[k].a, part[k].npair * sizeof(int));
+    memcpy(&p.b[at], part[k].b, part[k].npair * sizeof(int));
+    memcpy(&p.r[at], part[k].r, part[k].npair * sizeof(float));
+    at += part[k].npair;
+    freePairList(part[k]);
+  }
+  free(part);
+  return p;
+}
+
+/**
+ * Frees the memory allocated for a pair list
+ *
+ * @param[in] p The pair list to be freed.
+ */
+void freePairList(struct pairlist p) {
+  free(p.a);
+  free(p.b);
+  free(p.r);
+}
+
+/**
+ * Count the grid atoms within the cutoff of each query atom
+ *
+ * Gives coordination numbers without listing the pairs. An atom is not
+ * counted as its own neighbor.
+ *
+ * @param[in] ns The neighbor search, updated with the current frame.
+ * @param[in] n The number of query atoms.
+ * @param[in] idx The indices of the query atoms, or NULL for atoms 0 to
+ *                n-1.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[out] counts The number of neighbors of each query atom.
+ */
+void countNeighbors(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs, int * counts) {
+  if(!ns->built) {
+    memset(counts, 0, n * sizeof(int));
+    return;
+  }
+  int * order = queryOrder(ns, n, idx, xs, ys, zs);
+  #pragma omp parallel
+  {
+    int * hits = malloc(maxHits(ns) * sizeof(int));
+    #pragma omp for schedule(dynamic,256)
+    for(int j=0; j<n; j++) {
+      int i = order[j];
+      int a = idx ? idx[i] : i;
+      int nhit = querySlots(ns, xs[a], ys[a], zs[a], false, hits);
+      int count = 0;
+      for(int h=0; h<nhit; h++)
+        count += ns->slotAtom[hits[h]]!=a;
+      counts[i] = count;
+    }
+    free(hits);
+  }
+  free(order);
+}
+
+/**
+ * Select the query atoms within the cutoff of any grid atom
+ *
+ * Each query stops at the first cell where a neighbor is found. A query atom
+ * that is itself in the grid is selected.
+ *
+ * @param[in] ns The neighbor search, updated with the current frame.
+ * @param[in] n The number of query atoms.
+ * @param[in] idx The indices of the query atoms, or NULL for atoms 0 to
+ *                n-1.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[in,out] mask An atom mask (see maskWords in sel.h), in which the bit
+ *                     of each selected query atom is set; other bits are
+ *                     left as they are.
+ * @return The number of query atoms selected.
+ */
+int selectNear(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs, uint64_t * mask) {
+  if(!ns->built)
+    return 0;
+  int * order = queryOrder(ns, n, idx, xs, ys, zs);
+  int count = 0;
+  #pragma omp parallel reduction(+:count)
+  {
+    int * hits = malloc(maxHits(ns) * sizeof(int));
+    #pragma omp for schedule(dynamic,256)
+    for(int j=0; j<n; j++) {
+      int a = idx ? idx[order[j]] : order[j];
+      if(querySlots(ns, xs[a], ys[a], zs[a], true, hits)) {
+        #pragma omp atomic
+        mask[a/64] |= (uint64_t) 1 << a%64;
+        count++;
+      }
+    }
+    free(hits);
+  }
+  free(order);
+  return count;
+}
@@ -0,0 +1,26 @@
+#ifndef NSEARCH
+#define NSEARCH
+
+#include <stdint.h>
+
+struct nsearch;
+
+struct pairlist {
+  int npair;
+  int * a; // atom index of the query atom of each pair
+  int * b; // atom index of the grid atom of each pair
+  float * r; // distance between them
+};
+
+struct nsearch *newNeighborSearch(double cutoff, double skin);
+void freeNeighborSearch(struct nsearch * ns);
+int updateNeighborSearch(struct nsearch * ns, const double * uc, int n,
+    const int * idx, const float * xs, const float * ys, const float * zs);
+struct pairlist findPairs(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs);
+void freePairList(struct pairlist p);
+void countNeighbors(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs, int * counts);
+int selectNear(const struct nsearch * ns, int n, const int * idx,
+    const float * xs, const float * ys, const float * zs, uint64_t * mask);
+#endif
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "observ.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+// Sums accumulated for each selection: m, mx, my, mz, mxx, myy, mzz, mxy,
+// mxz, myz, q, qx, qy, qz
+#define NSUM 14
+
+/**
+ * Plan the observables of a set of selections
+ *
+ * Inverts the selection masks into a list of the selections each atom
+ * belongs to, so that computeObservables can find the properties of every
+ * selection in a single pass over the atoms.
+ *
+ * If natom or nsel is negative, natom and nsel are set to -1.
+ *
+ * @param[in] natom The number of atoms.
+ * @param[in] nsel The number of selections.
+ * @param[in] masks The atom mask of each selection, as from evalSelection.
+ * @param[in] mass The mass of every atom, or NULL to weight atoms equally.
+ * @param[in] charge The charge of every atom, or NULL for neutral atoms.
+ * @return The plan.
+ */
+struct obsplan newObservablePlan(int natom, int nsel,
+    const uint64_t * const * masks, const double * mass,
+    const double * charge) {
+  struct obsplan p = { .natom = -1, .nsel = -1, .offsets = NULL,
+                       .sel = NULL, .mass = NULL, .charge = NULL };
+  if(natom < 0 || nsel < 0)
+    return p;
+  p.natom = natom;
+  p.nsel = nsel;
+  p.offsets = calloc(natom+1, sizeof(int));
+  for(int s=0; s<nsel; s++)
+    for(int i=0; i<natom; i++)
+      if(masks[s][i/64] >> (i%64) & 1)
+        p.offsets[i+1]++;
+  for(int i=0; i<natom; i++)
+    p.offsets[i+1] += p.offsets[i];
+  p.sel = malloc((p.offsets[natom] ? p.offsets[natom] : 1) * sizeof(int));
+  int * fill = malloc((natom ? natom : 1) * sizeof(int));
+  for(int i=0; i<natom; i++)
+    fill[i] = p.offsets[i];
+  for(int s=0; s<nsel; s++)
+    for(int i=0; i<natom; i++)
+      if(masks[s][i/64] >> (i%64) & 1)
+        p.sel[fill[i]++] = s;
+  free(fill);
+
+  p.mass = malloc((natom ? natom : 1) * sizeof(double));
+  p.charge = malloc((natom ? natom : 1) * sizeof(double));
+  for(int i=0; i<natom; i++) {
+    p.mass[i] = mass ? mass[i] : 1;
+    p.charge[i] = charge ? charge[i] : 0;
+  }
+  return p;
+}
+
+/**
+ * Frees the memory allocated for an observables plan
+ *
+ * @param[in] p The plan to be freed.
+ */
+void freeObservablePlan(struct obsplan p) {
+  free(p.offsets);
+  free(p.sel);
+  free(p.mass);
+  free(p.charge);
+}
+
+/**
+ * Compute the observables of every selection in a frame
+ *
+ * Each atom's mass and charge moments are formed once and added to the sums
+ * of every selection it belongs to, two at a time with SSE2 where available.
+ * All observables derive from the same fourteen sums, so asking for any one
+ * of them costs as much as asking for all. Molecules should be whole, as
+ * after makeWhole, for the results to be meaningful.
+ *
+ * If the total mass of a selection is zero, its center of mass, dipole,
+ * radius of gyration and inertia tensor are NaN.
+ *
+ * @param[in] p The plan, as from newObservablePlan.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[out] out The observables of each selection.
+ */
+void computeObservables(const struct obsplan * p, const float * xs,
+    const float * ys, const float * zs, struct observables * out) {
+  double * acc = calloc(p->nsel ? NSUM*p->nsel : 1, sizeof(double));
+  for(int i=0; i<p->natom; i++) {
+    if(p->offsets[i] == p->offsets[i+1])
+      continue;
+    double x = xs[i], y = ys[i], z = zs[i];
+    double m = p->mass[i], q = p->charge[i];
+    double mx = m*x, my = m*y, mz = m*z;
+#ifdef __SSE2__
+    __m128d t0 = _mm_set_pd(mx, m);
+    __m128d t1 = _mm_set_pd(mz, my);
+    __m128d t2 = _mm_set_pd(my*y, mx*x);
+    __m128d t3 = _mm_set_pd(mx*y, mz*z);
+    __m128d t4 = _mm_set_pd(my*z, mx*z);
+    __m128d t5 = _mm_set_pd(q*x, q);
+    __m128d t6 = _mm_set_pd(q*z, q*y);
+    for(int k=p->offsets[i]; k<p->offsets[i+1]; k++) {
+      double * a = &acc[NSUM*p->sel[k]];
+      _mm_storeu_pd(&a[0], _mm_add_pd(_mm_loadu_pd(&a[0]), t0));
+      _mm_storeu_pd(&a[2], _mm_add_pd(_mm_loadu_pd(&a[2]), t1));
+      _mm_storeu_pd(&a[4], _mm_add_pd(_mm_loadu_pd(&a[4]), t2));
+      _mm_storeu_pd(&a[6], _mm_add_pd(_mm_loadu_pd(&a[6]), t3));
+      _mm_storeu_pd(&a[8], _mm_add_pd(_mm_loadu_pd(&a[8]), t4));
+      _mm_storeu_pd(&a[10], _mm_add_pd(_mm_loadu_pd(&a[10]), t5));
+      _mm_storeu_pd(&a[12], _mm_add_pd(_mm_loadu_pd(&a[12]), t6));
+    }
+#else
+    double t[NSUM] = { m, mx, my, mz, mx*x, my*y, mz*z, mx*y, mx*z, my*z,
+                       q, q*x, q*y, q*z };
+    for(int k=p->offsets[i]; k<p->offsets[i+1]; k++) {
+      double * a = &acc[NSUM*p->sel[k]];
+      for(int j=0; j<NSUM; j++)
+        a[j] += t[j];
+    }
+#endif
+  }
+
+  for(int s=0; s<p->nsel; s++) {
+    const double * a = &acc[NSUM*s];
+    struct observables * o = &out[s];
+    double mt = a[0];
+    o->mass = mt;
+    o->charge = a[10];
+    double c[3];
+    for(int j=0; j<3; j++) {
+      c[j] = mt != 0 ? a[1+j]/mt : NAN;
+      o->com[j] = c[j];
+      o->dipole[j] = a[11+j] - a[10]*c[j];
+    }
+    // Second moments about the center of mass
+    double sxx = a[4] - mt*c[0]*c[0];
+    double syy = a[5] - mt*c[1]*c[1];
+    double szz = a[6] - mt*c[2]*c[2];
+    double r2 = (sxx+syy+szz)/mt;
+    o->rg = r2 > 0 ? sqrt(r2) : (mt != 0 ? 0 : NAN);
+    o->inertia[0] = syy + szz;
+    o->inertia[1] = sxx + szz;
+    o->inertia[2] = sxx + syy;
+    o->inertia[3] = -(a[7] - mt*c[0]*c[1]);
+    o->inertia[4] = -(a[8] - mt*c[0]*c[2]);
+    o->inertia[5] = -(a[9] - mt*c[1]*c[2]);
+  }
+  free(acc);
+}
+
+/**
+ * Write a time series of observables as a text table
+ *
+ * @param[in] outpath The path of the table.
+ * @param[in] nframes The number of frames.
+ * @param[in] nsel The number of selections.
+ * @param[in] o The observables of each selection in each frame.
+ * @return 0 on success, -1 if the table cannot be written.
+ */
+static int writeObservables(char * outpath, uint32_t nframes, int nsel,
+    const struct observables * o) {
+  FILE * out = fopen(outpath, "w");
+  if(!out)
+    return -1;
+  fprintf(out, "# frame, then for each selection: comx comy comz dipx dipy "
+      "dipz rg ixx iyy izz ixy ixz iyz\n");
+  for(uint32_t f=0; f<nframes; f++) {
+    fprintf(out, "%u", f);
+    for(int s=0; s<nsel; s++) {
+      const struct observables * v = &o[(size_t) f*nsel + s];
+      fprintf(out, " %.6g %.6g %.6g %.6g %.6g %.6g %.6g", v->com[0],
+          v->com[1], v->com[2], v->dipole[0], v->dipole[1], v->dipole[2],
+          v->rg);
+      for(int j=0; j<6; j++)
+        fprintf(out, " %.6g", v->inertia[j]);
+    }
+    fprintf(out, "\n");
+  }
+  return fclose(out) ? -1 : 0;
+}
+
+struct observerun {
+  const struct obsplan * p;
+  const struct wholeplan * w; // molecules to make whole, or NULL
+  struct observables * o; // observables of every selection in every frame
+};
+
+/**
+ * Compute the observables of every selection in a frame
+ *
+ * The frame callback of the pipeline stage of observeTrajectory.
+ *
+ * @param[in,out] data The observerun struct, receiving frame f.
+ * @param[in] state Unused.
+ * @param[in] f The frame.
+ * @param[in] uc The unit cell of the frame.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+static void observeFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct observerun * r = data;
+  if(r->w)
+    makeWhole(r->w, uc, xs, ys, zs);
+  computeObservables(r->p, xs, ys, zs, &r->o[(size_t) f*r->p->nsel]);
+}
+
+/**
+ * Compute the observables of every selection in every frame of a DCD
+ *
+ * Frames are read in parallel by runPipeline. If a plan is given, each
+ * frame's molecules are made whole first.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] p The plan, as from newObservablePlan.
+ * @param[in] w The plan to make molecules whole, as from buildWholePlan, or
+ *              NULL to use the coordinates as they are.
+ * @param[in] outpath The path of a text table to write the time series to,
+ *                    one line per frame, or NULL.
+ * @return The observables of selection s in frame f at index f*nsel+s, or
+ *         NULL if the DCD cannot be read or the table cannot be written.
+ */
+struct observables *observeTrajectory(char * path, const struct obsplan * p,
+    const struct wholeplan * w, char * outpath) {
+  struct dcd * d = openDCD(path);
+  if(!d || p->natom == -1)
+    return NULL;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+  if(natoms < (uint32_t) p->natom || (w && w->natom != (int) natoms))
+    return NULL;
+
+  size_t nobs = (size_t) nframes*p->nsel;
+  struct observables * o = malloc((nobs ? nobs : 1) *
+      sizeof(struct observables));
+  struct observerun r = { .p = p, .w = w, .o = o };
+  struct stage s = { .data = &r, .mask = NULL, .init = NULL,
+                     .frame = observeFrame, .combine = NULL, .merge = NULL };
+  if(runPipeline(path, 1, &s, NULL) == -1 ||
+      (outpath && writeObservables(outpath, nframes, p->nsel, o))) {
+    free(o);
+    return NULL;
+  }
+  return o;
+}
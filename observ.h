@@ -0,0 +1,35 @@
+#ifndef OBSERV
+#define OBSERV
+
+#include <stdint.h>
+
+#include "pbc.h"
+
+struct obsplan {
+  int natom;
+  int nsel;
+  int * offsets; // selections of atom i are sel[offsets[i]..offsets[i+1]]
+  int * sel;
+  double * mass; // weight of every atom
+  double * charge; // charge of every atom
+};
+
+struct observables {
+  double mass; // total mass of the selection
+  double charge; // total charge of the selection
+  double com[3]; // center of mass
+  double dipole[3]; // dipole moment about the center of mass
+  double rg; // mass-weighted radius of gyration
+  double inertia[6]; // inertia tensor about the center of mass: xx, yy, zz,
+                     // xy, xz, yz
+};
+
+struct obsplan newObservablePlan(int natom, int nsel,
+    const uint64_t * const * masks, const double * mass,
+    const double * charge);
+void freeObservablePlan(struct obsplan p);
+void computeObservables(const struct obsplan * p, const float * xs,
+    const float * ys, const float * zs, struct observables * out);
+struct observables *observeTrajectory(char * path, const struct obsplan * p,
+    const struct wholeplan * w, char * outpath);
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pairrmsd.h"
+#include "align.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+struct loadrun {
+  int n; // atoms to fit
+  const int * idx; // indices of the atoms to fit, or NULL for 0 to n-1
+  const double * w; // weight of each fitted atom
+  struct frameset * s; // frames being loaded
+};
+
+/**
+ * Store the centered, weighted fitted atoms of a frame
+ *
+ * The frame callback of the pipeline stage of loadFrames.
+ *
+ * @param[in,out] data The loadrun struct, receiving frame f.
+ * @param[in] state Unused.
+ * @param[in] f The frame.
+ * @param[in] uc Unused.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void loadFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct loadrun * l = data;
+  int n = l->n;
+  const int * idx = l->idx;
+  const double * w = l->w;
+  double c[3] = { 0, 0, 0 };
+  for(int k=0; k<n; k++) {
+    int i = idx ? idx[k] : k;
+    c[0] += w[k]*xs[i];
+    c[1] += w[k]*ys[i];
+    c[2] += w[k]*zs[i];
+  }
+  for(int q=0; q<3; q++)
+    c[q] /= l->s->wsum;
+  float * x = &l->s->coords[(size_t) 3*n*f];
+  double g = 0;
+  for(int k=0; k<n; k++) {
+    int i = idx ? idx[k] : k;
+    double sw = sqrt(w[k]);
+    x[k] = sw*(xs[i]-c[0]);
+    x[n+k] = sw*(ys[i]-c[1]);
+    x[2*n+k] = sw*(zs[i]-c[2]);
+    g += (double) x[k]*x[k] + (double) x[n+k]*x[n+k] +
+         (double) x[2*n+k]*x[2*n+k];
+  }
+  l->s->g[f] = g;
+}
+
+/**
+ * Load the fitted atoms of every frame of a DCD
+ *
+ * Each frame is centered on the weighted center of its atoms and scaled by
+ * the square root of each atom's weight, so that weighted RMSDs between
+ * frames can be computed as if the atoms were unweighted. Frames are read in
+ * parallel by runPipeline.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] n The number of atoms to fit.
+ * @param[in] idx The indices of the atoms to fit, or NULL for atoms 0 to n-1.
+ * @param[in] mass The weight of every atom, or NULL to weight atoms equally.
+ * @return The frames, with nframe set to -1 if the DCD cannot be read, any
+ *         atom to fit is not in the DCD, or the total weight is not positive.
+ */
+struct frameset loadFrames(char * path, int n, const int * idx,
+    const double * mass) {
+  struct frameset s = { .nframe = -1, .n = n, .wsum = 0, .coords = NULL,
+                        .g = NULL };
+  struct dcd * d = openDCD(path);
+  if(!d || n <= 0)
+    return s;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+  for(int k=0; k<n; k++) {
+    int i = idx ? idx[k] : k;
+    if(i < 0 || (uint32_t) i >= natoms)
+      return s;
+  }
+
+  double * w = malloc(n * sizeof(double));
+  for(int k=0; k<n; k++) {
+    w[k] = mass ? mass[idx ? idx[k] : k] : 1;
+    s.wsum += w[k];
+  }
+  if(!(s.wsum > 0)) {
+    free(w);
+    return s;
+  }
+  s.coords = malloc(((size_t) 3*n*nframes + 1) * sizeof(float));
+  s.g = malloc((nframes ? nframes : 1) * sizeof(double));
+
+  struct loadrun l = { .n = n, .idx = idx, .w = w, .s = &s };
+  struct stage st = { .data = &l, .mask = NULL, .init = NULL,
+                      .frame = loadFrame, .combine = NULL, .merge = NULL };
+  int ok = runPipeline(path, 1, &st, NULL) != -1;
+  free(w);
+  if(!ok) {
+    free(s.coords);
+    free(s.g);
+    s.coords = NULL;
+    s.g = NULL;
+    return s;
+  }
+  s.nframe = nframes;
+  return s;
+}
+
+/**
+ * Frees the memory allocated for a set of frames
+ *
+ * @param[in] s The frames to be freed.
+ */
+void freeFrames(struct frameset s) {
+  free(s.coords);
+  free(s.g);
+}
+
+/**
+ * Compute the inner product matrix of two centered frames
+ *
+ * Products are taken in double precision, four atoms at a time with SSE2
+ * where available, since the RMSD of similar frames is the small difference
+ * of large sums.
+ *
+ * @param[in] a The x, y and z arrays of the first frame.
+ * @param[in] b The x, y and z arrays of the second frame.
+ * @param[in] n The number of atoms.
+ * @param[out] m The 3x3 matrix, in row-major order.
+ */
+static void frameProduct(const float * a, const float * b, int n,
+    double * m) {
+  for(int q=0; q<9; q++)
+    m[q] = 0;
+  int k = 0;
+#ifdef __SSE2__
+  __m128d acc[9];
+  for(int q=0; q<9; q++)
+    acc[q] = _mm_setzero_pd();
+  for(; k+4<=n; k+=4) {
+    // Atoms k and k+1 in the low halves, k+2 and k+3 in the high halves
+    __m128 v;
+    v = _mm_loadu_ps(&a[k]);
+    __m128d axl = _mm_cvtps_pd(v), axh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+    v = _mm_loadu_ps(&a[n+k]);
+    __m128d ayl = _mm_cvtps_pd(v), ayh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+    v = _mm_loadu_ps(&a[2*n+k]);
+    __m128d azl = _mm_cvtps_pd(v), azh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+    v = _mm_loadu_ps(&b[k]);
+    __m128d bxl = _mm_cvtps_pd(v), bxh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+    v = _mm_loadu_ps(&b[n+k]);
+    __m128d byl = _mm_cvtps_pd(v), byh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+    v = _mm_loadu_ps(&b[2*n+k]);
+    __m128d bzl = _mm_cvtps_pd(v), bzh = _mm_cvtps_pd(_mm_movehl_ps(v,v));
+#define ACC(q,al,ah,bl,bh) acc[q] = _mm_add_pd(acc[q], \
+    _mm_add_pd(_mm_mul_pd(al,bl), _mm_mul_pd(ah,bh)))
+    ACC(0, axl, axh, bxl, bxh);
+    ACC(1, axl, axh, byl, byh);
+    ACC(2, axl, axh, bzl, bzh);
+    ACC(3, ayl, ayh, bxl, bxh);
+    ACC(4, ayl, ayh, byl, byh);
+    ACC(5, ayl, ayh, bzl, bzh);
+    ACC(6, azl, azh, bxl, bxh);
+    ACC(7, azl, azh, byl, byh);
+    ACC(8, azl, azh, bzl, bzh);
+#undef ACC
+  }
+  for(int q=0; q<9; q++) {
+    double pair[2];
+    _mm_storeu_pd(pair, acc[q]);
+    m[q] = pair[0] + pair[1];
+  }
+#endif
+  for(; k<n; k++)
+    for(int i=0; i<3; i++)
+      for(int j=0; j<3; j++)
+        m[3*i+j] += (double) a[i*n+k] * b[j*n+k];
+}
+
+/**
+ * Compute the RMSD between two frames after superposition
+ *
+ * @param[in] s The frames.
+ * @param[in] i The first frame.
+ * @param[in] j The second frame.
+ * @return The weighted RMSD of the fitted atoms.
+ */
+double frameRMSD(const struct frameset * s, int i, int j) {
+  double m[9];
+  size_t len = (size_t) 3*s->n;
+  frameProduct(&s->coords[len*i], &s->coords[len*j], s->n, m);
+  return qcpRotation(m, (s->g[i]+s->g[j])/2, s->wsum, NULL);
+}
+
+/**
+ * Get the position of a pair of frames in a packed RMSD matrix
+ *
+ * Entries are the upper triangle of the matrix, without the diagonal, row by
+ * row: (0,1), (0,2), ..., (0,n-1), (1,2), and so on.
+ *
+ * @param[in] nframe The number of frames.
+ * @param[in] i The first frame.
+ * @param[in] j The second frame, greater than i.
+ * @return The position of the pair.
+ */
+size_t pairIndex(int nframe, int i, int j) {
+  return (size_t) i*nframe - (size_t) i*(i+1)/2 + (j-i-1);
+}
+
+/**
+ * Convert a float to IEEE half precision
+ *
+ * Rounds to nearest, ties to even. Values too large become infinity.
+ *
+ * @param[in] f The value.
+ * @return The bits of the half-precision value.
+ */
+static uint16_t toHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  int exp = (int) ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if(((x >> 23) & 0xff) == 0xff) // Infinity or NaN
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if(exp >= 31)
+    return sign | 0x7c00;
+  if(exp <= 0) { // Subnormal, or too small for half precision
+    if(exp < -10)
+      return sign;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift-1);
+    if(rem > halfway || (rem == halfway && (h & 1)))
+      h++;
+    return sign | h;
+  }
+  uint32_t h = (uint32_t) exp << 10 | mant >> 13;
+  uint32_t rem = mant & 0x1fff;
+  if(rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+    h++; // A carry into the exponent is still correct
+  return sign | h;
+}
+
+/**
+ * Convert an IEEE half-precision value to a float
+ *
+ * @param[in] h The bits of the half-precision value.
+ * @return The value.
+ */
+static float fromHalf(uint16_t h) {
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  int exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+  if(exp == 0x1f)
+    x = sign | 0x7f800000 | mant << 13;
+  else if(exp)
+    x = sign | (uint32_t) (exp - 15 + 127) << 23 | mant << 13;
+  else if(!mant)
+    x = sign;
+  else { // Subnormal: normalize
+    exp = 1;
+    while(!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    x = sign | (uint32_t) (exp - 15 + 127) << 23 | (mant & 0x3ff) << 13;
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+/**
+ * Compute the RMSD between every pair of frames
+ *
+ * Frames are grouped into tiles small enough that two tiles of coordinates
+ * fit in a core's cache. The matrix is computed one row of tiles at a time:
+ * the OpenMP threads share the tile of that row and each takes tiles of
+ * columns in turn. The entries of a row of tiles are a contiguous range of
+ * the packed upper triangle (see pairIndex), so each finished row is either
+ * copied into the matrix or appended to a file, and the whole matrix need
+ * never be held in memory.
+ *
+ * @param[in] s The frames.
+ * @param[in] half Whether to store entries as half-precision floats (about
+ *                 three significant digits) instead of floats.
+ * @param[in] outpath The path of a file to write the packed entries to, in
+ *                    native byte order, or NULL to keep them in memory.
+ * @return The matrix, whose data is NULL if it was written to a file, or with
+ *         nframe set to -1 if the file cannot be written.
+ */
+struct rmsdmatrix pairwiseRMSD(const struct frameset * s, int half,
+    const char * outpath) {
+  struct rmsdmatrix m = { .nframe = -1, .half = half ? 1 : 0, .data = NULL };
+  if(s->nframe < 0)
+    return m;
+  int nf = s->nframe;
+  size_t npair = nf ? pairIndex(nf, nf-1, nf) : 0;
+  size_t esize = half ? sizeof(uint16_t) : sizeof(float);
+  FILE * out = NULL;
+  if(outpath) {
+    out = fopen(outpath, "wb");
+    if(!out)
+      return m;
+  } else
+    m.data = malloc((npair ? npair : 1) * esize);
+
+  // Two tiles of frames should fit in a 256 KiB cache
+  int tile = (256*1024) / (2*3*sizeof(float)*(s->n ? s->n : 1));
+  tile = tile < 8 ? 8 : tile > 256 ? 256 : tile;
+  int ntile = (nf+tile-1)/tile;
+  size_t len = (size_t) 3*s->n;
+  float * buf = malloc(((size_t) tile*nf + 1) * sizeof(float));
+  uint16_t * hbuf = half ? malloc(((size_t) tile*nf + 1) * sizeof(uint16_t))
+                         : NULL;
+  bool failed = false;
+
+  for(int ti=0; ti<ntile && !failed; ti++) {
+    int i0 = ti*tile;
+    int i1 = i0+tile < nf ? i0+tile : nf;
+    size_t base = pairIndex(nf, i0, i0+1);
+    size_t count = pairIndex(nf, i1-1, nf) - base; // Entries of this row
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int tj=ti; tj<ntile; tj++) {
+      int j0 = tj*tile;
+      int j1 = j0+tile < nf ? j0+tile : nf;
+      double p[9];
+      for(int i=i0; i<i1; i++) {
+        for(int j=(j0 > i ? j0 : i+1); j<j1; j++) {
+          frameProduct(&s->coords[len*i], &s->coords[len*j], s->n, p);
+          buf[pairIndex(nf, i, j) - base] =
+            qcpRotation(p, (s->g[i]+s->g[j])/2, s->wsum, NULL);
+        }
+      }
+    }
+
+    void * row = buf;
+    if(half) {
+      for(size_t k=0; k<count; k++)
+        hbuf[k] = toHalf(buf[k]);
+      row = hbuf;
+    }
+    if(out)
+      failed = fwrite(row, esize, count, out) != count;
+    else
+      memcpy((char *) m.data + base*esize, row, count*esize);
+  }
+  free(buf);
+  free(hbuf);
+  if(out && fclose(out))
+    failed = true;
+  if(failed)
+    return m;
+  m.nframe = nf;
+  return m;
+}
+
+/**
+ * Get the RMSD between two frames from a matrix held in memory
+ *
+ * @param[in] m The matrix.
+ * @param[in] i The first frame.
+ * @param[in] j The second frame.
+ * @return The RMSD, 0 if i equals j, or -1 if the matrix is not in memory.
+ */
+double getRMSD(const struct rmsdmatrix * m, int i, int j) {
+  if(!m->data)
+    return -1;
+  if(i == j)
+    return 0;
+  if(i > j) {
+    int t = i;
+    i = j;
+    j = t;
+  }
+  size_t k = pairIndex(m->nframe, i, j);
+  return m->half ? fromHalf(((const uint16_t *) m->data)[k])
+                 : ((const float *) m->data)[k];
+}
+
+/**
+ * Frees the memory allocated for an RMSD matrix
+ *
+ * @param[in] m The matrix to be freed.
+ */
+void freeRMSDMatrix(struct rmsdmatrix m) {
+  free(m.data);
+}
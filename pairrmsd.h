@@ -0,0 +1,30 @@
+#ifndef PAIRRMSD
+#define PAIRRMSD
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct frameset {
+  int nframe;
+  int n; // atoms per frame
+  double wsum; // total weight of the atoms of a frame
+  float * coords; // frame f: x, y and z arrays of n atoms from coords[3*n*f]
+  double * g; // sum of squares of each frame
+};
+
+struct rmsdmatrix {
+  int nframe;
+  int half; // 1 if entries are stored as IEEE half-precision floats
+  void * data; // upper triangle by row, without the diagonal, or NULL
+};
+
+struct frameset loadFrames(char * path, int n, const int * idx,
+    const double * mass);
+void freeFrames(struct frameset s);
+double frameRMSD(const struct frameset * s, int i, int j);
+struct rmsdmatrix pairwiseRMSD(const struct frameset * s, int half,
+    const char * outpath);
+size_t pairIndex(int nframe, int i, int j);
+double getRMSD(const struct rmsdmatrix * m, int i, int j);
+void freeRMSDMatrix(struct rmsdmatrix m);
+#endif
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pbc.h"
+
+/**
+ * Wrap coordinates along one axis into [0,l)
+ *
+ * @param[in] l The box length, or 0 to leave the axis unwrapped.
+ * @param[in] n The number of coordinates.
+ * @param[in,out] x The coordinates.
+ */
+static void wrapAxis(double l, int n, float * x) {
+  if(!(l > 0))
+    return;
+  const float len = l;
+  const float inv = 1/l;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 vlen = _mm_set1_ps(len);
+  const __m128 vinv = _mm_set1_ps(inv);
+  const __m128 one = _mm_set1_ps(1);
+  const __m128 zero = _mm_setzero_ps();
+  int nvec = n & ~3;
+  #pragma omp parallel for schedule(static)
+  for(int j=0; j<nvec; j+=4) {
+    __m128 v = _mm_loadu_ps(&x[j]);
+    __m128 s = _mm_mul_ps(v,vinv);
+    // floor(s): truncate, then step down where truncation rounded up
+    __m128 f = _mm_cvtepi32_ps(_mm_cvttps_epi32(s));
+    f = _mm_sub_ps(f, _mm_and_ps(_mm_cmpgt_ps(f,s),one));
+    v = _mm_sub_ps(v, _mm_mul_ps(f,vlen));
+    // Rounding can leave a value just below 0 or at l
+    v = _mm_add_ps(v, _mm_and_ps(_mm_cmplt_ps(v,zero),vlen));
+    v = _mm_sub_ps(v, _mm_and_ps(_mm_cmpge_ps(v,vlen),vlen));
+    _mm_storeu_ps(&x[j], v);
+  }
+  i = nvec;
+#endif
+  for(; i<n; i++) {
+    float v = x[i] - len*floorf(x[i]*inv);
+    if(v < 0)
+      v += len;
+    if(v >= len)
+      v -= len;
+    x[i] = v;
+  }
+}
+
+/**
+ * Move coordinates along one axis to the image nearest a reference
+ *
+ * Shifts each x[i] by a whole number of box lengths so that it lies within
+ * half a box length of ref[i].
+ *
+ * @param[in] l The box length, or 0 to leave the axis unchanged.
+ * @param[in] n The number of coordinates.
+ * @param[in] ref The reference coordinates.
+ * @param[in,out] x The coordinates.
+ */
+static void imageAxis(double l, int n, const float * ref, float * x) {
+  if(!(l > 0))
+    return;
+  const float len = l;
+  const float inv = 1/l;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 vlen = _mm_set1_ps(len);
+  const __m128 vinv = _mm_set1_ps(inv);
+  int nvec = n & ~3;
+  #pragma omp parallel for schedule(static)
+  for(int j=0; j<nvec; j+=4) {
+    __m128 r = _mm_loadu_ps(&ref[j]);
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(&x[j]),r);
+    // Conversion rounds to nearest, giving the number of boxes to remove
+    __m128 k = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(d,vinv)));
+    _mm_storeu_ps(&x[j], _mm_add_ps(r, _mm_sub_ps(d, _mm_mul_ps(k,vlen))));
+  }
+  i = nvec;
+#endif
+  for(; i<n; i++) {
+    float d = x[i]-ref[i];
+    x[i] = ref[i] + (d - len*rintf(d*inv));
+  }
+}
+
+/**
+ * Wrap every atom into the primary unit cell
+ *
+ * Shifts each coordinate by whole box lengths into [0,a), [0,b) and [0,c),
+ * atom by atom, so molecules that straddle a face are split across it. The
+ * cell is taken to be orthorhombic, as read by getUnitCell.
+ *
+ * @param[in] uc The box lengths a, b and c, as from getUnitCell. An axis
+ *               whose length is not positive is left unwrapped.
+ * @param[in] natom The number of atoms.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+void wrapCoords(const double * uc, int natom, float * xs, float * ys,
+    float * zs) {
+  wrapAxis(uc[0], natom, xs);
+  wrapAxis(uc[1], natom, ys);
+  wrapAxis(uc[2], natom, zs);
+}
+
+/**
+ * Plan how to make the molecules of a system whole
+ *
+ * Searches each fragment of the bond graph breadth-first from its lowest
+ * atom, recording the order in which atoms are reached and the bonded atom
+ * each was reached from. Fragments are numbered as by findFragments. The plan
+ * depends only on the topology, so it is built once and applied to every
+ * frame with makeWhole.
+ *
+ * If the graph has no atoms, natom and nfrag are set to -1.
+ *
+ * @param[in] g The bond graph, as from buildGraph.
+ * @return The plan.
+ */
+struct wholeplan buildWholePlan(struct graph g) {
+  struct wholeplan w = { .natom = -1, .nfrag = -1, .offsets = NULL,
+                         .order = NULL, .parent = NULL };
+  if(g.natom == -1)
+    return w;
+  w.natom = g.natom;
+  w.nfrag = 0;
+  w.order = malloc((w.natom ? w.natom : 1) * sizeof(int));
+  w.parent = malloc((w.natom ? w.natom : 1) * sizeof(int));
+  int cap = 1024; // Capacity of offsets, grown by doubling
+  w.offsets = malloc(cap * sizeof(int));
+  char * seen = calloc(w.natom ? w.natom : 1, 1);
+
+  // order doubles as the queue of the search
+  int tail = 0;
+  for(int i=0; i<w.natom; i++) {
+    if(seen[i])
+      continue;
+    if(w.nfrag+1 == cap) {
+      cap *= 2;
+      w.offsets = realloc(w.offsets, cap * sizeof(int));
+    }
+    w.offsets[w.nfrag++] = tail;
+    int head = tail;
+    seen[i] = 1;
+    w.order[tail] = i;
+    w.parent[tail++] = -1;
+    while(head<tail) {
+      int u = w.order[head++];
+      for(int k=g.offsets[u]; k<g.offsets[u+1]; k++) {
+        int v = g.neighbors[k];
+        if(seen[v])
+          continue;
+        seen[v] = 1;
+        w.order[tail] = v;
+        w.parent[tail++] = u;
+      }
+    }
+  }
+  w.offsets[w.nfrag] = tail;
+  free(seen);
+  return w;
+}
+
+/**
+ * Frees the memory allocated for a make-whole plan
+ *
+ * @param[in] w The plan to be freed.
+ */
+void freeWholePlan(struct wholeplan w) {
+  free(w.offsets);
+  free(w.order);
+  free(w.parent);
+}
+
+/**
+ * Make every molecule whole
+ *
+ * Moves each atom to the image of itself nearest the bonded atom it was
+ * reached from in the plan, so that no bond spans the box. The first atom of
+ * each fragment stays where it is. Each atom depends on an atom before it in
+ * the plan, so the fragments are processed in parallel but the atoms of one
+ * fragment in order.
+ *
+ * @param[in] w The plan, as from buildWholePlan.
+ * @param[in] uc The box lengths a, b and c, as from getUnitCell. An axis
+ *               whose length is not positive is left unchanged.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+void makeWhole(const struct wholeplan * w, const double * uc, float * xs,
+    float * ys, float * zs) {
+  float len[3], inv[3];
+  for(int d=0; d<3; d++) {
+    len[d] = uc[d] > 0 ? uc[d] : 0;
+    inv[d] = uc[d] > 0 ? 1/uc[d] : 0;
+  }
+  #pragma omp parallel for schedule(dynamic,256)
+  for(int f=0; f<w->nfrag; f++) {
+    for(int k=w->offsets[f]+1; k<w->offsets[f+1]; k++) {
+      int a = w->order[k];
+      int p = w->parent[k];
+      float dx = xs[a]-xs[p];
+      float dy = ys[a]-ys[p];
+      float dz = zs[a]-zs[p];
+      xs[a] = xs[p] + (dx - len[0]*rintf(dx*inv[0]));
+      ys[a] = ys[p] + (dy - len[1]*rintf(dy*inv[1]));
+      zs[a] = zs[p] + (dz - len[2]*rintf(dz*inv[2]));
+    }
+  }
+}
+
+/**
+ * Create the state for unwrapping a trajectory
+ *
+ * @param[in] natom The number of atoms.
+ * @return The state, with no frames seen.
+ */
+struct unwrapper newUnwrapper(int natom) {
+  struct unwrapper u = { .natom = natom, .nframe = 0 };
+  u.xs = malloc((natom ? natom : 1) * sizeof(float));
+  u.ys = malloc((natom ? natom : 1) * sizeof(float));
+  u.zs = malloc((natom ? natom : 1) * sizeof(float));
+  return u;
+}
+
+/**
+ * Unwrap one frame of a trajectory
+ *
+ * Replaces each atom's wrapped coordinates with the image nearest its
+ * unwrapped position in the previous frame, so that atoms move continuously
+ * instead of jumping across the box. The first frame is kept as it is (make it
+ * whole first if molecules should stay intact). Frames must be passed in
+ * order, and no atom may move more than half a box length between them.
+ *
+ * @param[in,out] u The state, which holds the previous frame.
+ * @param[in] uc The box lengths a, b and c of this frame, as from
+ *               getUnitCell.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+void unwrapCoords(struct unwrapper * u, const double * uc, float * xs,
+    float * ys, float * zs) {
+  if(u->nframe) {
+    imageAxis(uc[0], u->natom, u->xs, xs);
+    imageAxis(uc[1], u->natom, u->ys, ys);
+    imageAxis(uc[2], u->natom, u->zs, zs);
+  }
+  memcpy(u->xs, xs, u->natom * sizeof(float));
+  memcpy(u->ys, ys, u->natom * sizeof(float));
+  memcpy(u->zs, zs, u->natom * sizeof(float));
+  u->nframe++;
+}
+
+/**
+ * Frees the memory allocated for the state of an unwrapped trajectory
+ *
+ * @param[in] u The state to be freed.
+ */
+void freeUnwrapper(struct unwrapper u) {
+  free(u.xs);
+  free(u.ys);
+  free(u.zs);
+}
@@ -0,0 +1,32 @@
+#ifndef PBC
+#define PBC
+
+#include "topo.h"
+
+struct wholeplan {
+  int natom;
+  int nfrag;
+  int * offsets; // atoms of fragment f are order[offsets[f]..offsets[f+1]]
+  int * order; // atoms of each fragment in breadth-first order
+  int * parent; // atom that each entry of order is imaged against, or -1
+};
+
+struct unwrapper {
+  int natom;
+  int nframe; // frames unwrapped so far
+  float * xs; // unwrapped coordinates of the previous frame
+  float * ys;
+  float * zs;
+};
+
+void wrapCoords(const double * uc, int natom, float * xs, float * ys,
+    float * zs);
+struct wholeplan buildWholePlan(struct graph g);
+void freeWholePlan(struct wholeplan w);
+void makeWhole(const struct wholeplan * w, const double * uc, float * xs,
+    float * ys, float * zs);
+struct unwrapper newUnwrapper(int natom);
+void unwrapCoords(struct unwrapper * u, const double * uc, float * xs,
+    float * ys, float * zs);
+void freeUnwrapper(struct unwrapper u);
+#endif
@@ -1,293 +1,529 @@
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "pdb.h"
+#include "mapfile.h"
+#include "hybrid36.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct pdbgrow {
+  struct pdb * p;
+  int cap; // allocated length of p->atoms
+};
 
 /**
- * Read crystallographic information from a PDB
+ * Parse a CRYST1 record
  *
- * Reads unit cell details from a PDB file and stores the contents in the
- * provided pdb struct.
+ * Reads unit cell details from one CRYST1 line of a PDB file and stores the
+ * contents in the provided cryst struct.
  *
- * @param[in] pdb The PDB from which the unit cell data will be read.
- * @param[in,out] p The struct into which the unit cell data will be stored.
- * @return 0 if cell data is read successfully, or -1 if an error occurs.
+ * @param[in] buffer The line to be parsed, null-padded to at least 80 chars.
+ * @param[out] cell The struct into which the unit cell data will be stored.
  */
-static int readCryst(FILE * pdb, struct pdb * p) {
-  rewind(pdb); // Start at the beginning of the file.
-  char buffer[128]; // For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
-
-  while (1) {
-    ptr = fgets(buffer,128,pdb);
-    if(ferror(pdb) || feof(pdb) || ptr==NULL) {
-      break; // Error reading file for cryst record.
-    }
-    if(buffer[0]=='\n') {
-      continue; // Skip empty lines.
-    }
-    if(strncmp(buffer,"CRYST1",6)) {
-      continue; // Skip non-CRYST1 lines.
-    }
+static void parseCryst(const char * buffer, struct cryst * cell) {
+  int offset=0; // Keeps track of field alignment
+  char substr[15];
+
+
+  int width=6; // Width of first field ("CRYST1")
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the CRYST1 prefix
+  if(strncmp(buffer,"CRYST1",6))
+    return; // Prefix doesn't match (this shouldn't ever happen)
+  offset+=width; // advance offset to next field
+
+  width=9; // Width of second field (a)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the 'a' substring
+  cell->a=atof(substr); // write 'a' value to cryst struct
+  offset+=width; // advance offset to next field
+
+  width=9; // Width of third field (b)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the 'b' substring
+  cell->b=atof(substr); // write 'b' value to cryst struct
+  offset+=width; // advance offset to next field
+
+  width=9; // Width of fourth field (c)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the 'c' substring
+  cell->c=atof(substr); // write 'c' value to cryst struct
+  offset+=width; // advance offset to next field
+
+  width=7; // Width of fifth field (alpha)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the alpha substring
+  cell->alpha=atof(substr); // write alpha value to cryst struct
+  offset+=width; // advance offset to next field
+
+  width=7; // Width of sixth field (beta)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the beta substring
+  cell->beta=atof(substr); // write beta value to cryst struct
+  offset+=width; // advance offset to next field
+
+  width=7; // Width of seventh field (gamma)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the gamma substring
+  cell->gamma=atof(substr); // write gamma value to cryst struct
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=11; // Width of eighth field (space group)
+  // copy string directly into cryst struct
+  memcpy(cell->sGroup,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  width=4; // Width of ninth field (Z value)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the Z value substring
+  cell->z=atoi(substr); // write resSeq value to cryst struct
+  offset+=width; // advance offset to next field
+
+  cell->valid=true; // Mark cryst struct as valid
+}
 
-    int offset=0; // Keeps track of field alignment
-    char substr[15];
-
-
-    int width=6; // Width of first field ("CRYST1")
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the CRYST1 prefix
-    if(strncmp(buffer,"CRYST1",6))
-      continue; // Prefix doesn't match (this shouldn't ever happen)
-    offset+=width; // advance offset to next field
-
-    width=9; // Width of second field (a)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the 'a' substring
-    p->cell.a=atof(substr); // write 'a' value to cryst struct
-    offset+=width; // advance offset to next field
-
-    width=9; // Width of third field (b)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the 'b' substring
-    p->cell.b=atof(substr); // write 'b' value to cryst struct
-    offset+=width; // advance offset to next field
-
-    width=9; // Width of fourth field (c)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the 'c' substring
-    p->cell.c=atof(substr); // write 'c' value to cryst struct
-    offset+=width; // advance offset to next field
-
-    width=7; // Width of fifth field (alpha)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the alpha substring
-    p->cell.alpha=atof(substr); // write alpha value to cryst struct
-    offset+=width; // advance offset to next field
-
-    width=7; // Width of sixth field (beta)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the beta substring
-    p->cell.beta=atof(substr); // write beta value to cryst struct
-    offset+=width; // advance offset to next field
-
-    width=7; // Width of seventh field (gamma)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the gamma substring
-    p->cell.gamma=atof(substr); // write gamma value to cryst struct
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=11; // Width of eighth field (space group)
-    // copy string directly into cryst struct
-    memcpy(p->cell.sGroup,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    width=4; // Width of ninth field (Z value)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the Z value substring
-    p->cell.z=atoi(substr); // write resSeq value to cryst struct
-    offset+=width; // advance offset to next field
-
-    p->cell.valid=true; // Mark cryst struct as valid
-    break; // Only process the first CRYST1 line, ignore any others
-  } // This loop ends upon interruption by a break statement.
-  if(p->cell.valid)
-    return 0;
-  return -1;
+/**
+ * Parse a CRYST1 line
+ *
+ * Parses a single CRYST1 record of arbitrary length, such as one found by a
+ * caller scanning a PDB file on its own.
+ *
+ * @param[in] line The start of the line (need not be null-terminated).
+ * @param[in] len The number of characters in the line.
+ * @return The unit cell information, with the 'valid' field set to 'false'
+ *         if the line is not a CRYST1 record.
+ */
+struct cryst parseCrystLine(const char * line, size_t len) {
+  struct cryst cell = { .valid = false,
+                        .a = 0,
+                        .b = 0,
+                        .c = 0,
+                        .alpha = 0,
+                        .beta = 0,
+                        .gamma = 0,
+                        .sGroup = "\0\0\0\0\0\0\0\0\0\0\0\0",
+                        .z = -1 };
+  char buffer[128] = ""; // Null-padded copy of the line
+  memcpy(buffer, line, len<127 ? len : 127);
+  parseCryst(buffer, &cell);
+  return cell;
 }
 
 /**
- * Read atom information from a PDB
+ * Parse an ATOM record
  *
- * Reads atom details from a PDB file and stores the contents in the provided
- * pdb struct. Also populates the natom field of the pdb struct.
+ * Reads atom details from one ATOM line of a PDB file and stores the contents
+ * in the provided pdbatom struct.
  *
- * @param[in] pdb The PDB from which the atom data will be read.
- * @param[in,out] p The struct into which the atom data will be stored.
- * @return The number of atoms read
+ * @param[in] buffer The line to be parsed, null-padded to at least 80 chars.
+ * @param[out] a The struct into which the atom data will be stored.
  */
-static int readAtoms(FILE * pdb, struct pdb * p) {
-  rewind(pdb); // Start at the beginning of the file.
-  char buffer[128]; // For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
+static void parseAtom(const char * buffer, struct pdbatom * a) {
+  // Clear pdbatom struct
+  a->serial = -1;
+  memset(a->name,'\0',5);
+  a->altLoc = '\0';
+  memset(a->resName,'\0',4);
+  a->chainID = '\0';
+  a->resSeq = 0;
+  a->iCode = '\0';
+  a->x = 0;
+  a->y = 0;
+  a->z = 0;
+  a->occupancy = 0;
+  a->tempFactor = 0;
+  memset(a->element,'\0',3);
+  memset(a->charge,'\0',3);
+  memset(a->mserial,'\0',7);
+  memset(a->mresName,'\0',5);
+  a->mresSeq = 0;
+  memset(a->mseg,'\0',11);
+
+  int offset=0; // Keeps track of field alignment
+  char substr[15];
+
+  int width=6; // Width of first field ("ATOM  ")
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the ATOM prefix
+  if(strncmp(buffer,"ATOM  ",6))
+    return; // Prefix doesn't match (this shouldn't ever happen)
+  offset+=width; // advance offset to next field
+
+  width=5; // Width of second field (serial)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the serial substring
+  // write serial value to pdbatom struct, decoding hybrid-36 if necessary
+  if(hy36decode(substr,width,&a->serial))
+    a->serial=atoi(substr);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=4; // Width of third field (name)
+  // copy string directly into pdbatom struct
+  memcpy(a->name,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  width=1; // Width of fourth field (altLoc)
+  // copy char directly into pdbatom struct
+  a->altLoc = buffer[offset];
+  offset+=width; // advance offset to next field
+
+  width=3; // Width of fifth field (resName)
+  // copy string directly into pdbatom struct
+  memcpy(a->resName,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=1; // Width of sixth field (chainID)
+  // copy char directly into pdbatom struct
+  a->chainID = buffer[offset];
+  offset+=width; // advance offset to next field
+
+  width=4; // Width of seventh field (resSeq)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the resSeq substring
+  // write resSeq value to pdbatom struct, decoding hybrid-36 if necessary
+  if(hy36decode(substr,width,&a->resSeq))
+    a->resSeq=atoi(substr);
+  offset+=width; // advance offset to next field
+
+  width=1; // Width of eighth field (iCode)
+  // copy char directly into pdbatom struct
+  a->iCode = buffer[offset];
+  offset+=width; // advance offset to next field
+
+  offset+=3; // Skip three spaces
+
+  width=8; // Width of ninth field (x position)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the x position substring
+  a->x=atof(substr); // write x value to pdbatom struct
+  offset+=width; // advance offset to next field
+
+  width=8; // Width of tenth field (y position)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the y position substring
+  a->y=atof(substr); // write y value to pdbatom struct
+  offset+=width; // advance offset to next field
+
+  width=8; // Width of eleventh field (z position)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the z position substring
+  a->z=atof(substr); // write z value to pdbatom struct
+  offset+=width; // advance offset to next field
+
+  width=6; // Width of twelfth field (occupancy)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the occupancy substring
+  // write occupancy value to pdbatom struct
+  a->occupancy=atof(substr);
+  offset+=width; // advance offset to next field
+
+  width=6; // Width of thirteenth field (tempFactor)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the tempFactor substring
+  // write tempFactor value to pdbatom struct
+  a->tempFactor=atof(substr);
+  offset+=width; // advance offset to next field
+
+  offset+=10; // Skip ten spaces
+
+  width=2; // Width of fourteenth field (element)
+  // copy string directly into pdbatom struct
+  memcpy(a->element,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  width=2; // Width of fifth field (charge)
+  // copy string directly into pdbatom struct
+  memcpy(a->charge,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  //BONUS: Non-standard PDB modifications
+
+  width=6; // Width of modified second field (serial)
+  // copy string directly into pdbatom struct
+  memcpy(a->mserial,&buffer[6],width);
+
+  width=4; // Width of modified fifth field (resName)
+  // copy string directly into pdbatom struct
+  memcpy(a->mresName,&buffer[17],width);
+
+  width=5; // Width of modified seventh field (resSeq)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[22],width); // isolate the resSeq substring
+  if(buffer[22]>='A') // hybrid-36, already decoded into resSeq
+    a->mresSeq=a->resSeq;
+  else
+    a->mresSeq=atoi(substr); // write resSeq value to pdbatom struct
+
+  width=10; // Width of extra field in blank span (segment name)
+  // copy string directly into pdbatom struct
+  memcpy(a->mseg,&buffer[66],width);
+}
 
-  // Allocate some space for atom array
-  int size = 100;
-  p->atoms = malloc(size * sizeof(struct pdbatom));
+/**
+ * Scan the contents of a PDB file, passing each atom record to a sink
+ *
+ * Scans the file contents once, line by line, parsing the first CRYST1 record
+ * and every ATOM record as they are encountered. Only the first model of a
+ * multi-model file is read: the scan stops at the first ENDMDL record, just as
+ * readCIF keeps the first model of the atom_site loop. Before the first atom,
+ * the begin callback of the sink (if not NULL) is given an estimate of the
+ * atom count of one atom per 81 bytes (the length of a standard PDB line),
+ * which is exact for files of standard lines but may be exceeded by files with
+ * short lines. Each line is copied into a null-padded buffer before parsing,
+ * so that short lines leave the missing trailing fields empty.
+ *
+ * @param[in] data The contents of the PDB file.
+ * @param[in] size The number of bytes in data.
+ * @param[out] cell The struct into which the unit cell is stored, or NULL to
+ *                  skip CRYST1 records.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if the begin callback stopped the
+ *         scan.
+ */
+static int scanPDB(const char * data, size_t size, struct cryst * cell,
+    struct pdbsink sink) {
+  // Estimate the atom count from the file size
+  size_t size_est = size/81 + 1;
+  if(size_est > INT_MAX)
+    size_est = INT_MAX;
+  if(sink.begin && sink.begin(sink.data, size_est))
+    return -1;
 
   int n = 0; // Track the number of atoms read so far
-
-  while (1) {
-    ptr = fgets(buffer,128,pdb);
-    if(ferror(pdb) || feof(pdb) || ptr==NULL) {
-      break; // Error reading file for next atom record.
-    }
-    if(buffer[0]=='\n') {
-      continue; // Skip empty lines.
-    }
-    if(strncmp(buffer,"ATOM  ",6)) {
-      continue; // Skip non-ATOM lines.
+  const char * end = data + size;
+  const char * line = data;
+  while (line < end) {
+    const char * eol = memchr(line, '\n', end-line);
+    if(!eol)
+      eol = end; // Last line has no newline
+    size_t len = eol-line;
+    const char * next = eol<end ? eol+1 : end;
+
+    if(len>=6 && !strncmp(line,"ENDMDL",6))
+      break; // Later models are not read
+
+    // Only ATOM and CRYST1 records are of interest
+    bool isatom = len>=6 && !strncmp(line,"ATOM  ",6);
+    bool iscryst = len>=6 && cell && !cell->valid &&
+      !strncmp(line,"CRYST1",6);
+    if(!isatom && !iscryst) {
+      line = next;
+      continue;
     }
 
-    // Expand array if necessary
-    if(n==size) {
-      size*=2;
-      p->atoms = realloc(p->atoms,size * sizeof(struct pdbatom));
-    }
+    // A proper PDB file should not have lines more than 80 chars wide.
+    char buffer[128] = ""; // For storing one line of the file at a time.
+    memcpy(buffer, line, len<127 ? len : 127);
+    line = next;
 
-    // Clear pdbatom struct
-    p->atoms[n].serial = -1;
-    memset(p->atoms[n].name,'\0',5);
-    p->atoms[n].altLoc = '\0';
-    memset(p->atoms[n].resName,'\0',4);
-    p->atoms[n].chainID = '\0';
-    p->atoms[n].resSeq = 0;
-    p->atoms[n].iCode = '\0';
-    p->atoms[n].x = 0;
-    p->atoms[n].y = 0;
-    p->atoms[n].z = 0;
-    p->atoms[n].occupancy = 0;
-    p->atoms[n].tempFactor = 0;
-    memset(p->atoms[n].element,'\0',3);
-    memset(p->atoms[n].charge,'\0',3);
-    memset(p->atoms[n].mserial,'\0',7);
-    memset(p->atoms[n].mresName,'\0',5);
-    p->atoms[n].mresSeq = 0;
-    memset(p->atoms[n].mseg,'\0',11);
-
-    int offset=0; // Keeps track of field alignment
-    char substr[15];
-
-    int width=6; // Width of first field ("ATOM  ")
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the ATOM prefix
-    if(strncmp(buffer,"ATOM  ",6))
-      continue; // Prefix doesn't match (this shouldn't ever happen)
-    offset+=width; // advance offset to next field
-
-    width=5; // Width of second field (serial)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the serial substring
-    p->atoms[n].serial=atoi(substr); // write serial value to pdbatom struct
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=4; // Width of third field (name)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].name,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    width=1; // Width of fourth field (altLoc)
-    // copy char directly into pdbatom struct
-    p->atoms[n].altLoc = buffer[offset];
-    offset+=width; // advance offset to next field
-
-    width=3; // Width of fifth field (resName)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].resName,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=1; // Width of sixth field (chainID)
-    // copy char directly into pdbatom struct
-    p->atoms[n].chainID = buffer[offset];
-    offset+=width; // advance offset to next field
-
-    width=4; // Width of seventh field (resSeq)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the resSeq substring
-    p->atoms[n].resSeq=atoi(substr); // write resSeq value to pdbatom struct
-    offset+=width; // advance offset to next field
-
-    width=1; // Width of eighth field (iCode)
-    // copy char directly into pdbatom struct
-    p->atoms[n].iCode = buffer[offset];
-    offset+=width; // advance offset to next field
-
-    offset+=3; // Skip three spaces
-
-    width=8; // Width of ninth field (x position)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the x position substring
-    p->atoms[n].x=atof(substr); // write x value to pdbatom struct
-    offset+=width; // advance offset to next field
-
-    width=8; // Width of tenth field (y position)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the y position substring
-    p->atoms[n].y=atof(substr); // write y value to pdbatom struct
-    offset+=width; // advance offset to next field
-
-    width=8; // Width of eleventh field (z position)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the z position substring
-    p->atoms[n].z=atof(substr); // write z value to pdbatom struct
-    offset+=width; // advance offset to next field
-
-    width=6; // Width of twelfth field (occupancy)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the occupancy substring
-    // write occupancy value to pdbatom struct
-    p->atoms[n].occupancy=atof(substr);
-    offset+=width; // advance offset to next field
-
-    width=6; // Width of thirteenth field (tempFactor)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the tempFactor substring
-    // write tempFactor value to pdbatom struct
-    p->atoms[n].tempFactor=atof(substr);
-    offset+=width; // advance offset to next field
-
-    offset+=10; // Skip ten spaces
-
-    width=2; // Width of fourteenth field (element)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].element,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    width=2; // Width of fifth field (charge)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].charge,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    //BONUS: Non-standard PDB modifications
-
-    width=6; // Width of modified second field (serial)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].mserial,&buffer[6],width);
-
-    width=4; // Width of modified fifth field (resName)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].mresName,&buffer[17],width);
-
-    width=5; // Width of modified seventh field (resSeq)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[22],width); // isolate the resSeq substring
-    p->atoms[n].mresSeq=atoi(substr); // write resSeq value to pdbatom struct
-
-    width=10; // Width of extra field in blank span (segment name)
-    // copy string directly into pdbatom struct
-    memcpy(p->atoms[n].mseg,&buffer[66],width);
+    if(iscryst) {
+      parseCryst(buffer, cell);
+      continue;
+    }
 
+    struct pdbatom a;
+    parseAtom(buffer, &a);
+    sink.atom(sink.data, n, &a);
     n++; // Advance atom count
-  } // This loop ends upon interruption by a break statement.
-  p->atoms = realloc(p->atoms,n * sizeof(struct pdbatom)); // Trim array size
+  } // This loop ends at the end of the data or the first ENDMDL record.
+  return n;
+}
+
+/**
+ * Allocate the atom array of a pdb struct
+ *
+ * The begin callback of the sink used by parsePDB.
+ *
+ * @param[in,out] data The growing atom array.
+ * @param[in] natom The estimated number of atoms.
+ * @return 0.
+ */
+static int beginAtoms(void * data, int natom) {
+  struct pdbgrow * g = data;
+  g->cap = natom;
+  g->p->atoms = malloc(g->cap * sizeof(struct pdbatom));
+  return 0;
+}
+
+/**
+ * Store an atom record in the atom array of a pdb struct
+ *
+ * The atom callback of the sink used by parsePDB. The array is expanded if
+ * the estimate was too low.
+ *
+ * @param[in,out] data The growing atom array.
+ * @param[in] i The zero-based atom index.
+ * @param[in] a The atom record.
+ */
+static void storeAtom(void * data, int i, const struct pdbatom * a) {
+  struct pdbgrow * g = data;
+  if(i==g->cap) {
+    g->cap = g->cap<INT_MAX/2 ? 2*g->cap : INT_MAX;
+    g->p->atoms = realloc(g->p->atoms, g->cap * sizeof(struct pdbatom));
+  }
+  g->p->atoms[i] = *a;
+}
+
+/**
+ * Parse the contents of a PDB file
+ *
+ * Scans the file contents into the unit cell and atom array of a pdb struct.
+ * The atom array is allocated up front from the estimate given by scanPDB, so
+ * that it rarely needs to grow, and is trimmed to the number of atoms found
+ * at the end.
+ *
+ * @param[in] data The contents of the PDB file.
+ * @param[in] size The number of bytes in data.
+ * @param[in,out] p The struct into which the parsed data will be stored.
+ * @return The number of atoms read.
+ */
+static int parsePDB(const char * data, size_t size, struct pdb * p) {
+  struct pdbgrow g = { .p = p, .cap = 0 };
+  struct pdbsink sink = { .data = &g, .begin = beginAtoms,
+                          .atom = storeAtom };
+  int n = scanPDB(data, size, &p->cell, sink);
+  p->atoms = realloc(p->atoms,(n ? n : 1) * sizeof(struct pdbatom)); // Trim
   p->natom = n; // Store atom count in struct
   return n;
 }
 
+/**
+ * Convert a PDB charge field to a number
+ *
+ * PDB charges are written as a digit followed by a sign (e.g. "2-"). Fields
+ * that do not follow this format are treated as neutral.
+ *
+ * @param[in] charge The two-character charge field.
+ * @return The numeric charge.
+ */
+double pdbCharge(const char * charge) {
+  int abscharge = charge[0]-'0';
+  if((0 <= abscharge && abscharge <= 9) &&
+      (charge[1]=='-' || charge[1]=='+'))
+    return charge[1]=='-' ? -abscharge : abscharge;
+  return 0;
+}
+
+/**
+ * Get the segment of an atom record
+ *
+ * The nonstandard segment field is used if it is not blank. Otherwise the
+ * chain identifier stands in for the segment, so that the chains of a
+ * standard PDB stay apart, as they do when read from mmCIF.
+ *
+ * @param[in] a The atom record.
+ * @param[out] seg The segment, with room for 11 characters.
+ */
+void pdbSegment(const struct pdbatom * a, char * seg) {
+  int blank = 1;
+  for(int k=0; k<10 && a->mseg[k]; k++)
+    if(!isspace((unsigned char) a->mseg[k]))
+      blank = 0;
+  if(!blank || !a->chainID || isspace((unsigned char) a->chainID))
+    strcpy(seg,a->mseg);
+  else {
+    seg[0] = a->chainID;
+    seg[1] = '\0';
+  }
+}
+
+/**
+ * Get the residue ID of an atom record
+ *
+ * The nonstandard residue number is followed by the insertion code, if any,
+ * so that inserted residues such as 52A are kept apart from residue 52.
+ *
+ * @param[in] a The atom record.
+ * @param[out] resid The residue ID, with room for 9 characters.
+ */
+void pdbResid(const struct pdbatom * a, char * resid) {
+  if(a->iCode && !isspace((unsigned char) a->iCode))
+    snprintf(resid,9,"%d%c",a->mresSeq,a->iCode);
+  else
+    snprintf(resid,9,"%d",a->mresSeq);
+}
+
+/**
+ * Build the atom table for a PDB
+ *
+ * Interns the segment, residue, atom name and element strings of every atom
+ * record into the atom table of the pdb struct. The segment and residue ID
+ * are those of pdbSegment and pdbResid and the nonstandard residue name
+ * field is used, as in readStruct, and the element takes the place of the
+ * atom type. PDB files carry no masses, so all masses are zero. Readers of
+ * other formats that fill a pdb struct use this as well.
+ *
+ * @param[in,out] p The struct whose atom table will be populated.
+ */
+void buildPDBTable(struct pdb * p) {
+  p->table = newAtomTable(p->natom);
+  for(int i=0; i<p->natom; i++) {
+    struct pdbatom * a = &p->atoms[i];
+    char seg[11], resid[9];
+    pdbSegment(a,seg);
+    pdbResid(a,resid);
+    setTableAtom(&p->table,i,seg,resid,a->mresName,a->name,a->element,
+        pdbCharge(a->charge),0);
+  }
+}
+
+/**
+ * Read data from a PDB held in memory
+ *
+ * Parses the contents of a PDB from a buffer, such as one received over a
+ * pipe or decompressed in memory, and creates a pdb struct containing the
+ * successfully parsed information, including crystallographic data, the array
+ * of atom records, and the total atom count. Only the atoms of the first
+ * model of a multi-model PDB are read (see scanPDB).
+ *
+ * In the event of a read error, the relevant information will be ignored, but
+ * other data will continue to be read and stored in the pdb struct if possible.
+ *
+ * @param[in] data The contents of the PDB, or NULL.
+ * @param[in] size The number of bytes in data.
+ * @return A pdb struct containing all of the parsed information, with natom
+ *         set to -1 if data is NULL.
+ */
+struct pdb readPDBFromBuffer(const char * data, size_t size) {
+
+  struct pdb p = { .cell = { .valid = false,
+                             .a = 0,
+                             .b = 0,
+                             .c = 0,
+                             .alpha = 0,
+                             .beta = 0,
+                             .gamma = 0,
+                             .sGroup = "\0\0\0\0\0\0\0\0\0\0\0\0",
+                             .z = -1 },
+                   .natom = -1,
+                   .atoms = NULL,
+                   .table = { .natom = -1 } };
+  if(!data)
+    return p;
+
+  // Read crystal and atom data
+  parsePDB(data, size, &p);
+  buildPDBTable(&p);
+  return p;
+}
+
 /**
  * Read data from PDB
  *
- * Parses a PDB file and creates a pdb struct containing the successfully parsed
- * information, including crystallographic data, the array of atom records, and
- * the total atom count.
+ * Maps a PDB file into memory and parses it with readPDBFromBuffer.
  *
  * In the event of a read error, the relevant information will be ignored, but
  * other data will continue to be read and stored in the pdb struct if possible.
@@ -296,6 +532,121 @@ static int readAtoms(FILE * pdb, struct pdb * p) {
  * @return A pdb struct containing all of the parsed information.
  */
 struct pdb readPDB(const char * path) {
+  struct mappedfile m = mapFile(path); // data is NULL on error
+  struct pdb p = readPDBFromBuffer(m.data, m.size);
+  unmapFile(m);
+  return p;
+}
+
+/**
+ * Read the atom records of a PDB held in memory without building a pdb struct
+ *
+ * Hands each ATOM record to the sink as it is parsed, so that callers which
+ * only need some of the atom information (such as readStruct) need not hold a
+ * second copy of the atoms. The begin callback, if not NULL, is called once
+ * before any atom with an estimate of the atom count (see scanPDB), which the
+ * sink must be prepared to see exceeded; returning nonzero from it stops the
+ * read. CRYST1 records are ignored.
+ *
+ * @param[in] data The contents of the PDB, or NULL.
+ * @param[in] size The number of bytes in data.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if data is NULL or the read was
+ *         stopped.
+ */
+int readPDBAtomsFromBuffer(const char * data, size_t size,
+    struct pdbsink sink) {
+  if(!data)
+    return -1;
+  return scanPDB(data, size, NULL, sink);
+}
+
+/**
+ * Read the atom records of a PDB without building a pdb struct
+ *
+ * Maps a PDB file into memory and reads it with readPDBAtomsFromBuffer.
+ *
+ * @param[in] path The filesystem path to the PDB to be parsed.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if the file cannot be read or the
+ *         read was stopped.
+ */
+int readPDBAtoms(const char * path, struct pdbsink sink) {
+  struct mappedfile m = mapFile(path); // data is NULL on error
+  int n = readPDBAtomsFromBuffer(m.data, m.size, sink);
+  unmapFile(m);
+  return n;
+}
+
+/**
+ * Scan a chunk of a PDB file for ATOM and CRYST1 records
+ *
+ * Counts the ATOM records among the lines starting in [begin,end), parsing
+ * them into consecutive elements of atoms unless atoms is NULL. The scan
+ * stops at the first ENDMDL record of the chunk, if any. The positions of the
+ * first CRYST1 and ENDMDL records in the chunk are also reported.
+ *
+ * @param[in] begin The start of the first line of the chunk.
+ * @param[in] end One past the end of the chunk, at a line boundary.
+ * @param[out] atoms The array into which the atoms are parsed, or NULL.
+ * @param[out] cryst The first CRYST1 line of the chunk, or NULL if it has none.
+ * @param[out] endmdl The first ENDMDL line of the chunk, or NULL if it has
+ *                    none.
+ * @return The number of ATOM records in the chunk before its first ENDMDL.
+ */
+static int scanChunk(const char * begin, const char * end,
+    struct pdbatom * atoms, const char ** cryst, const char ** endmdl) {
+  int n = 0;
+  *cryst = NULL;
+  *endmdl = NULL;
+  const char * line = begin;
+  while (line < end) {
+    const char * eol = memchr(line, '\n', end-line);
+    if(!eol)
+      eol = end; // Last line has no newline
+    size_t len = eol-line;
+    const char * next = eol<end ? eol+1 : end;
+
+    if(len>=6 && !strncmp(line,"ENDMDL",6)) {
+      *endmdl = line;
+      break;
+    } else if(len>=6 && !strncmp(line,"ATOM  ",6)) {
+      if(atoms) {
+        char buffer[128] = ""; // Null-padded copy of the line
+        memcpy(buffer, line, len<127 ? len : 127);
+        parseAtom(buffer, &atoms[n]);
+      }
+      n++;
+    } else if(len>=6 && !*cryst && !strncmp(line,"CRYST1",6)) {
+      *cryst = line;
+    }
+    line = next;
+  }
+  return n;
+}
+
+/**
+ * Read data from PDB using several threads
+ *
+ * Produces the same pdb struct as readPDB, with atoms in the same order, but
+ * parses the file in parallel. Since PDB records are single lines, the mapped
+ * file is split into chunks at line boundaries. Each thread first counts the
+ * ATOM records of its chunks; a prefix sum over the counts then gives every
+ * chunk its own range of the atom array, into which the threads parse their
+ * records in a second pass. The unit cell is taken from the first CRYST1
+ * record of the file, as in readPDB. Like readPDB, only the first model is
+ * read: the chunks after the first one holding an ENDMDL record are dropped
+ * once the counts are known.
+ *
+ * Threads are provided by OpenMP. When compiled without OpenMP support, the
+ * chunks are processed one after another.
+ *
+ * @param[in] path The filesystem path to the PDB to be parsed.
+ * @param[in] nthreads The number of threads to use, or 0 for the OpenMP
+ *            default.
+ * @return A pdb struct containing all of the parsed information.
+ */
+struct pdb readPDBParallel(const char * path, int nthreads) {
 
   struct pdb p = { .cell = { .valid = false,
                              .a = 0,
@@ -307,30 +658,81 @@ struct pdb readPDB(const char * path) {
                              .sGroup = "\0\0\0\0\0\0\0\0\0\0\0\0",
                              .z = -1 },
                    .natom = -1,
-                   .atoms = NULL};
+                   .atoms = NULL,
+                   .table = { .natom = -1 } };
 
-  FILE * pdb = fopen(path,"r");
-  if(!pdb) // Error encountered while opening file.
+  struct mappedfile m = mapFile(path);
+  if(!m.data) // Error encountered while opening or reading file.
     return p;
 
-  // A proper PDB file should not have lines more than 80 chars wide.
-  char buffer[128]; //For storing one line of the file at a time.
+#ifdef _OPENMP
+  if(nthreads<=0)
+    nthreads = omp_get_max_threads();
+#endif
+  if(nthreads<=0)
+    nthreads = 1;
+
+  // Several chunks per thread even out differences in record density
+  int nchunk = 4*nthreads;
+  if((size_t) nchunk > m.size/4096+1)
+    nchunk = m.size/4096+1; // Don't split small files into tiny chunks
+
+  // Place chunk boundaries just after a newline
+  const char ** bound = malloc((nchunk+1) * sizeof(char *));
+  const char * end = m.data + m.size;
+  bound[0] = m.data;
+  bound[nchunk] = end;
+  for(int k=1; k<nchunk; k++) {
+    const char * b = m.data + (m.size/nchunk)*k;
+    if(b < bound[k-1])
+      b = bound[k-1];
+    const char * eol = memchr(b, '\n', end-b);
+    bound[k] = eol ? eol+1 : end;
+  }
+
+  int * first = malloc((nchunk+1) * sizeof(int)); // First atom of each chunk
+  const char ** cryst = malloc(nchunk * sizeof(char *));
+  const char ** endmdl = malloc(nchunk * sizeof(char *));
 
-  char * ptr; // For detecting read failures
+  // First pass: count the atoms of each chunk
+  #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+  for(int k=0; k<nchunk; k++)
+    first[k+1] = scanChunk(bound[k], bound[k+1], NULL, &cryst[k], &endmdl[k]);
 
-  ptr = fgets(buffer,128,pdb); //get first line
-  if(ferror(pdb) || feof(pdb) || ptr==NULL) {
-    fclose(pdb);
-    return p; // Error reading first line of file.
+  // The first model ends in the first chunk with an ENDMDL record
+  for(int k=0; k<nchunk; k++) {
+    if(endmdl[k]) {
+      nchunk = k+1;
+      break;
+    }
   }
 
-  // Read crystal data
-  readCryst(pdb, &p);
+  first[0] = 0;
+  for(int k=0; k<nchunk; k++)
+    first[k+1] += first[k];
+  p.natom = first[nchunk];
+  p.atoms = malloc((p.natom ? p.natom : 1) * sizeof(struct pdbatom));
+
+  // Second pass: parse each chunk into its own range of the atom array
+  #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+  for(int k=0; k<nchunk; k++)
+    scanChunk(bound[k], bound[k+1], &p.atoms[first[k]], &cryst[k], &endmdl[k]);
+
+  for(int k=0; k<nchunk; k++) {
+    if(cryst[k]) { // Only process the first CRYST1 line, ignore any others
+      const char * eol = memchr(cryst[k], '\n', end-cryst[k]);
+      p.cell = parseCrystLine(cryst[k], (eol ? eol : end) - cryst[k]);
+      break;
+    }
+  }
 
-  // Read atom data
-  readAtoms(pdb, &p);
+  free(bound);
+  free(first);
+  free(cryst);
+  free(endmdl);
+  unmapFile(m);
 
-  fclose(pdb);
+  buildPDBTable(&p);
   return p;
 }
 
@@ -338,8 +740,8 @@ struct pdb readPDB(const char * path) {
  * Frees the memory allocated for the pdb struct
  *
  * Checks to make sure memory has not already been freed, and if not, frees the
- * array used to store atom information. Once freed, it sets the pointer to the
- * allocation to NULL to prevent double freeing.
+ * array used to store atom information and the atom table. Once freed, it sets
+ * the pointer to the allocation to NULL to prevent double freeing.
  *
  * @param[in] p the pdb struct to be freed.
  */
@@ -351,4 +753,5 @@ void freePDB(struct pdb p) {
     }
   }
   sfree((void **) &p.atoms);
+  freeAtomTable(p.table);
 }
@@ -1,6 +1,10 @@
 #ifndef PDB
 #define PDB
 
+#include <stddef.h>
+
+#include "symtab.h"
+
 struct pdbatom {
   int serial;
   char name[5];
@@ -39,8 +43,25 @@ struct pdb {
   struct cryst cell;
   int natom;
   struct pdbatom * atoms;
+  struct atomtable table;
+};
+
+struct pdbsink {
+  void * data; // passed to each callback
+  int (*begin)(void * data, int natom); // natom is an estimate; may be NULL
+  void (*atom)(void * data, int i, const struct pdbatom * a);
 };
 
 struct pdb readPDB(const char * path);
+struct pdb readPDBFromBuffer(const char * data, size_t size);
+struct pdb readPDBParallel(const char * path, int nthreads);
 void freePDB(struct pdb p);
+double pdbCharge(const char * charge);
+void pdbSegment(const struct pdbatom * a, char * seg);
+void pdbResid(const struct pdbatom * a, char * resid);
+struct cryst parseCrystLine(const char * line, size_t len);
+void buildPDBTable(struct pdb * p);
+int readPDBAtoms(const char * path, struct pdbsink sink);
+int readPDBAtomsFromBuffer(const char * data, size_t size,
+    struct pdbsink sink);
 #endif
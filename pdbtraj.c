@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "pdbtraj.h"
+#include "mapfile.h"
+
+struct model {
+  size_t start; // offset of the first line of the model
+  size_t end; // offset just past the last line of the model
+  struct cryst cell;
+};
+
+struct pdbtraj {
+  struct mappedfile m;
+  uint32_t nframes;
+  uint32_t natoms;
+  uint32_t frame;
+  struct model *models;
+};
+
+/**
+ * Parse a fixed-width real number field
+ *
+ * Decodes fields such as the coordinates of an ATOM record, which are plain
+ * decimal numbers, without copying them into a null-terminated buffer. Fields
+ * in any other notation are passed to strtod.
+ *
+ * @param[in] s The start of the field.
+ * @param[in] width The width of the field.
+ * @return The value of the field.
+ */
+static float parseReal(const char *s, int width) {
+  int i = 0;
+  while(i<width && s[i]==' ')
+    i++;
+  bool neg = false;
+  if(i<width && (s[i]=='-' || s[i]=='+'))
+    neg = s[i++]=='-';
+  long long mant = 0;
+  long long scale = 1;
+  bool point = false;
+  for(; i<width && s[i]!=' '; i++) {
+    if(s[i]=='.' && !point) {
+      point = true;
+      continue;
+    }
+    if((unsigned) (s[i]-'0') >= 10 || mant > 100000000000000LL) {
+      char buffer[32] = ""; // Unusual notation; use the library parser
+      memcpy(buffer, s, width);
+      return strtod(buffer, NULL);
+    }
+    mant = 10*mant + (s[i]-'0');
+    if(point)
+      scale *= 10;
+  }
+  double v = (double) mant / scale;
+  return neg ? -v : v;
+}
+
+/**
+ * Index the models of a PDB file
+ *
+ * Scans the mapped file once, recording the extent of every MODEL ... ENDMDL
+ * block and the unit cell that applies to it. A CRYST1 record inside a model
+ * applies to that model only; one outside any model applies to every model
+ * that follows it. A file without MODEL records is treated as a single model.
+ * The number of atoms is taken from the ATOM records of the first model, or
+ * of the whole file if it has no MODEL records; ATOM records outside any
+ * model are otherwise ignored.
+ *
+ * @param[in,out] t The trajectory handle, with the file already mapped.
+ */
+static void indexModels(struct pdbtraj *t) {
+  uint32_t cap = 16;
+  t->models = malloc(cap * sizeof(struct model));
+  t->nframes = 0;
+  t->natoms = 0;
+
+  struct cryst cell = parseCrystLine("", 0); // Cell outside any model
+  bool inmodel = false;
+  bool anymodel = false;
+  uint32_t nfile = 0; // ATOM records in the whole file
+  const char *data = t->m.data;
+  const char *end = data + t->m.size;
+  const char *line = data;
+  while(line < end) {
+    const char *eol = memchr(line, '\n', end-line);
+    const char *next = eol ? eol+1 : end;
+    size_t len = (eol ? eol : end) - line;
+
+    if(len>=6 && !strncmp(line,"MODEL ",6)) {
+      if(t->nframes==cap) {
+        cap *= 2;
+        t->models = realloc(t->models, cap * sizeof(struct model));
+      }
+      if(inmodel) // Missing ENDMDL: the previous model ends here
+        t->models[t->nframes-1].end = line-data;
+      t->models[t->nframes].start = next-data;
+      t->models[t->nframes].end = t->m.size;
+      t->models[t->nframes].cell = cell;
+      t->nframes++;
+      inmodel = true;
+      anymodel = true;
+    } else if(len>=6 && !strncmp(line,"ENDMDL",6)) {
+      if(inmodel)
+        t->models[t->nframes-1].end = line-data;
+      inmodel = false;
+    } else if(len>=6 && !strncmp(line,"CRYST1",6)) {
+      struct cryst c = parseCrystLine(line, len);
+      if(inmodel)
+        t->models[t->nframes-1].cell = c;
+      else
+        cell = c;
+    } else if(len>=6 && !strncmp(line,"ATOM  ",6)) {
+      nfile++;
+      if(inmodel && t->nframes==1)
+        t->natoms++; // Count the atoms of the first model only
+    }
+    line = next;
+  }
+
+  if(!anymodel) { // A plain PDB is a single frame
+    t->models[0].start = 0;
+    t->models[0].end = t->m.size;
+    t->models[0].cell = cell;
+    t->nframes = 1;
+    t->natoms = nfile;
+  }
+}
+
+/**
+ * Opens a PDB file as a trajectory and returns a handle.
+ *
+ * Each MODEL of the PDB is one frame. The file is indexed once, when it is
+ * opened; coordinates are only parsed when a frame is read with getPDBCoords.
+ *
+ * @param[in] path The path to the PDB file.
+ * @return A handle to the PDB trajectory, or NULL if it cannot be read.
+ */
+struct pdbtraj *openPDBTraj(const char *path) {
+  struct mappedfile m = mapFile(path);
+  if( ! m.data )
+    return NULL;
+
+  struct pdbtraj *t = malloc(sizeof(struct pdbtraj));
+  t->m = m;
+  t->frame = 0;
+  indexModels(t);
+  return t;
+}
+
+/**
+ * Releases the PDB file and frees the memory associated with the handle.
+ *
+ * @param[in] t The PDB trajectory handle.
+ */
+void closePDBTraj(struct pdbtraj *t) {
+  unmapFile(t->m);
+  free(t->models);
+  free(t);
+}
+
+/**
+ * Gets the number of frames (models) in the PDB.
+ *
+ * @param[in] t The PDB trajectory handle.
+ * @return The number of frames in the PDB.
+ */
+uint32_t getPDBNFrames(struct pdbtraj *t) {
+  return t->nframes;
+}
+
+/**
+ * Gets the number of atoms in each frame of the PDB.
+ *
+ * @param[in] t The PDB trajectory handle.
+ * @return The number of ATOM records in the first model.
+ */
+uint32_t getPDBNAtoms(struct pdbtraj *t) {
+  return t->natoms;
+}
+
+/**
+ * Prepares the PDB handle to read the desired frame.
+ *
+ * The specified frame data can then be read using getPDBUnitCell,
+ * getPDBCryst or getPDBCoords.
+ *
+ * @param[in] t The PDB trajectory handle
+ * @param[in] f The zero-indexed frame number.
+ */
+void goToPDBFrame(struct pdbtraj *t,uint32_t f) {
+  t->frame = f;
+}
+
+/**
+ * Prepares the PDB handle to read the next frame.
+ *
+ * @param[in] t The PDB trajectory handle
+ */
+void nextPDBFrame(struct pdbtraj *t) {
+  t->frame++;
+}
+
+/**
+ * Reads the current position of the PDB handle.
+ *
+ * @param[in] t The PDB trajectory handle
+ * @return The number of the current frame
+ */
+uint32_t getPDBFrame(struct pdbtraj *t) {
+  return t->frame;
+}
+
+/**
+ * Reads the unit cell lengths for the current frame.
+ *
+ * Stores the a, b and c lengths of the unit cell in the first three elements
+ * of the provided array, as getUnitCell does for DCD files. If the frame has
+ * no CRYST1 record, zeros are stored.
+ *
+ * @param[in] t The PDB trajectory handle
+ * @param[out] uc The array into which the unit cell data should be placed.
+ */
+void getPDBUnitCell(struct pdbtraj *t, double *uc) {
+  struct cryst c = getPDBCryst(t);
+  uc[0] = c.a;
+  uc[1] = c.b;
+  uc[2] = c.c;
+}
+
+/**
+ * Reads the full CRYST1 information for the current frame.
+ *
+ * @param[in] t The PDB trajectory handle
+ * @return The unit cell information. The 'valid' field is 'false' if the frame
+ *         has no CRYST1 record or the frame number is out of range.
+ */
+struct cryst getPDBCryst(struct pdbtraj *t) {
+  if(t->frame >= t->nframes)
+    return parseCrystLine("", 0);
+  return t->models[t->frame].cell;
+}
+
+/**
+ * Reads the coordinate information for the current frame.
+ *
+ * Parses the ATOM records of the current model and stores their coordinates in
+ * the provided arrays, which must each hold getPDBNAtoms elements. A model
+ * with more ATOM records than the first model is truncated; one with fewer
+ * leaves the remaining elements unchanged.
+ *
+ * @param[in] t The PDB trajectory handle
+ * @param[out] xs The array into which the x-coordinates should be stored.
+ * @param[out] ys The array into which the y-coordinates should be stored.
+ * @param[out] zs The array into which the z-coordinates should be stored.
+ */
+void getPDBCoords(struct pdbtraj *t, float *xs, float *ys, float *zs) {
+  if(t->frame >= t->nframes)
+    return;
+  const char *line = t->m.data + t->models[t->frame].start;
+  const char *end = t->m.data + t->models[t->frame].end;
+  uint32_t n = 0;
+  while(line < end && n < t->natoms) {
+    const char *eol = memchr(line, '\n', end-line);
+    const char *next = eol ? eol+1 : end;
+    size_t len = (eol ? eol : end) - line;
+    if(len>=54 && !strncmp(line,"ATOM  ",6)) {
+      xs[n] = parseReal(&line[30], 8);
+      ys[n] = parseReal(&line[38], 8);
+      zs[n] = parseReal(&line[46], 8);
+      n++;
+    }
+    line = next;
+  }
+}
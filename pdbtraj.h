@@ -0,0 +1,21 @@
+#ifndef PDBTRAJ_H_
+#define PDBTRAJ_H_
+
+#include <stdint.h>
+
+#include "pdb.h"
+
+struct pdbtraj;
+
+struct pdbtraj *openPDBTraj(const char *);
+void closePDBTraj(struct pdbtraj *);
+uint32_t getPDBNFrames(struct pdbtraj *);
+uint32_t getPDBNAtoms(struct pdbtraj *);
+void goToPDBFrame(struct pdbtraj *,uint32_t);
+void nextPDBFrame(struct pdbtraj *);
+uint32_t getPDBFrame(struct pdbtraj *);
+void getPDBUnitCell(struct pdbtraj *, double *);
+struct cryst getPDBCryst(struct pdbtraj *);
+void getPDBCoords(struct pdbtraj *, float *, float *, float *);
+
+#endif
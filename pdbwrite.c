@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "pdbwrite.h"
+#include "fixfmt.h"
+#include "hybrid36.h"
+
+struct pdbwriter {
+  FILE * hdl;
+  struct outbuf o;
+  int nmodel; // number of models written so far
+};
+
+// Room for any record, even with every numeric field at its widest (see
+// PUTFIXED_MAX): a CRYST1 record can take 6 + 6*21 + 1 + 11 + 20 + 1 bytes
+#define LINEMAX 256
+
+static const char blank[81] = "                                        "
+                              "                                        ";
+
+/**
+ * Copy a string without its surrounding whitespace
+ *
+ * @param[out] dst The destination, with room for max characters plus a null.
+ * @param[in] src The null-terminated source string.
+ * @param[in] max The maximum number of characters to copy.
+ * @return The number of characters copied.
+ */
+static int trimCopy(char * dst, const char * src, int max) {
+  while(isspace((unsigned char) *src))
+    src++;
+  int n = 0;
+  while(n<max && src[n])
+    n++;
+  while(n>0 && isspace((unsigned char) src[n-1]))
+    n--;
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+  return n;
+}
+
+/**
+ * Write a CRYST1 record
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] cell The unit cell to write.
+ */
+static void writeCryst(struct outbuf * o, const struct cryst * cell) {
+  char * line = reserveOut(o, LINEMAX);
+  char * ptr = line;
+  memcpy(ptr, "CRYST1", 6);
+  ptr = putFixed(ptr+6, cell->a, 9, 3);
+  ptr = putFixed(ptr, cell->b, 9, 3);
+  ptr = putFixed(ptr, cell->c, 9, 3);
+  ptr = putFixed(ptr, cell->alpha, 7, 2);
+  ptr = putFixed(ptr, cell->beta, 7, 2);
+  ptr = putFixed(ptr, cell->gamma, 7, 2);
+  *ptr++ = ' ';
+  char sGroup[12];
+  trimCopy(sGroup, cell->sGroup, 11);
+  ptr = putString(ptr, sGroup, 11, 1);
+  ptr = putInt(ptr, cell->z<0 ? 1 : cell->z, 4);
+  *ptr++ = '\n';
+  advanceOut(o, ptr);
+}
+
+/**
+ * Write a record that consists of a keyword alone, such as END or ENDMDL
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] keyword The record name.
+ */
+static void writeKeyword(struct outbuf * o, const char * keyword) {
+  int len = strlen(keyword);
+  char * ptr = reserveOut(o, len+1);
+  memcpy(ptr, keyword, len);
+  ptr[len] = '\n';
+  advanceOut(o, ptr+len+1);
+}
+
+/**
+ * Write the coordinate, occupancy and temperature factor columns
+ *
+ * Fills columns 31-66 of an ATOM record in place. Values too wide for their
+ * columns are written in full, which shifts the rest of the line, rather than
+ * silently losing digits.
+ *
+ * @param[out] line The start of the ATOM record.
+ * @param[in] x The x coordinate.
+ * @param[in] y The y coordinate.
+ * @param[in] z The z coordinate.
+ * @param[in] occupancy The occupancy.
+ * @param[in] tempFactor The temperature factor.
+ * @return One past the last character written.
+ */
+static char * putCoords(char * line, double x, double y, double z,
+    double occupancy, double tempFactor) {
+  char * ptr = putFixed(&line[30], x, 8, 3);
+  ptr = putFixed(ptr, y, 8, 3);
+  ptr = putFixed(ptr, z, 8, 3);
+  ptr = putFixed(ptr, occupancy, 6, 2);
+  return putFixed(ptr, tempFactor, 6, 2);
+}
+
+/**
+ * Write the records of a pdb struct
+ *
+ * Each ATOM record is built by copying a blank 80-column line and filling in
+ * its fields in place. Serial and residue numbers too large for their columns
+ * are written as hybrid-36 numbers. The nonstandard residue name and segment
+ * fields are used when they are set, as readStruct does, so that CHARMM-style
+ * four-character residue names and segment names survive a round trip.
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] p The pdb struct to write.
+ */
+static void writeAtoms(struct outbuf * o, struct pdb p) {
+  for(int i=0; i<p.natom; i++) {
+    struct pdbatom * a = &p.atoms[i];
+    char * line = reserveOut(o, LINEMAX);
+    memcpy(line, blank, 80);
+    memcpy(line, "ATOM  ", 6);
+    hy36encode(a->serial, 5, &line[6]);
+    putString(&line[12], a->name, 4, 1);
+    if(a->altLoc)
+      line[16] = a->altLoc;
+    char res[5];
+    trimCopy(res, a->mresName[0] ? a->mresName : a->resName, 4);
+    putString(&line[17], res, 4, 1);
+    if(a->chainID)
+      line[21] = a->chainID;
+    hy36encode(a->resSeq, 4, &line[22]);
+    if(a->iCode)
+      line[26] = a->iCode;
+    char * ptr = putCoords(line, a->x, a->y, a->z, a->occupancy,
+        a->tempFactor);
+    char seg[11];
+    if(trimCopy(seg, a->mseg, 10) || a->element[0] || a->charge[0]) {
+      ptr = &line[80];
+      putString(&line[72], seg, 4, 1);
+      putString(&line[76], a->element, 2, 0);
+      putString(&line[78], a->charge, 2, 1);
+    }
+    while(ptr>line && ptr[-1]==' ')
+      ptr--; // Drop trailing blanks
+    *ptr++ = '\n';
+    advanceOut(o, ptr);
+  }
+}
+
+/**
+ * Write a pdb struct to a PDB file
+ *
+ * Writes the CRYST1 record, if the unit cell is valid, followed by an ATOM
+ * record for every atom and an END record. Lines are formatted by hand into a
+ * large output buffer rather than with printf.
+ *
+ * @param[in] path The filesystem path of the PDB to be written.
+ * @param[in] p The pdb struct to be written.
+ * @return 0 on success, or -1 if an error occurs.
+ */
+int writePDB(const char * path, struct pdb p) {
+  if(p.natom == -1)
+    return -1;
+  FILE * pdb = fopen(path,"w");
+  if(!pdb) // Error encountered while opening file.
+    return -1;
+  struct outbuf o = openOut(pdb, 1<<20);
+  if(p.cell.valid)
+    writeCryst(&o, &p.cell);
+  writeAtoms(&o, p);
+  writeKeyword(&o, "END");
+  int status = closeOut(&o);
+  if(fclose(pdb))
+    status = -1;
+  return status;
+}
+
+/**
+ * Open a PDB file for writing models
+ *
+ * Each call to writePDBModel appends a MODEL ... ENDMDL block. The file is
+ * completed with an END record by closePDBWriter.
+ *
+ * @param[in] path The filesystem path of the PDB to be written.
+ * @return A handle to the PDB writer, or NULL if the file cannot be opened.
+ */
+struct pdbwriter * openPDBWriter(const char * path) {
+  FILE * pdb = fopen(path,"w");
+  if(!pdb) // Error encountered while opening file.
+    return NULL;
+  struct pdbwriter * w = malloc(sizeof(struct pdbwriter));
+  w->hdl = pdb;
+  w->o = openOut(pdb, 1<<22);
+  w->nmodel = 0;
+  return w;
+}
+
+/**
+ * Write one model of a structure with the given coordinates
+ *
+ * Writes a MODEL record, a CRYST1 record if a cell is given, an ATOM record
+ * for every atom of the structure, and an ENDMDL record. Atom information
+ * comes from the psfpdb struct, and positions from coordinate arrays such as
+ * those filled by getCoords. Atoms are numbered from one, with hybrid-36
+ * numbers beyond 99999; residue IDs are written the same way, with any
+ * trailing non-digit character of the ID as the insertion code. Charges are
+ * written only if they are whole numbers.
+ *
+ * @param[in,out] w The PDB writer.
+ * @param[in] s The structure providing atom names, residues and segments.
+ * @param[in] cell The unit cell, or NULL to omit the CRYST1 record.
+ * @param[in] xs The x-coordinates of the atoms.
+ * @param[in] ys The y-coordinates of the atoms.
+ * @param[in] zs The z-coordinates of the atoms.
+ * @param[in] bfactor Values for the temperature factor column, or NULL to
+ *            write zeros.
+ * @return 0 on success, or -1 if an error has occurred while writing.
+ */
+int writePDBModel(struct pdbwriter * w, struct psfpdb s,
+    const struct cryst * cell, const float * xs, const float * ys,
+    const float * zs, const float * bfactor) {
+  struct outbuf * o = &w->o;
+  char * ptr = reserveOut(o, 32);
+  memcpy(ptr, "MODEL     ", 10);
+  ptr = putInt(ptr+10, ++w->nmodel, 4);
+  *ptr++ = '\n';
+  advanceOut(o, ptr);
+  if(cell)
+    writeCryst(o, cell);
+
+  for(int i=0; i<s.natom; i++) {
+    struct atom * a = &s.atoms[i];
+    char * line = reserveOut(o, LINEMAX);
+    memcpy(line, blank, 80);
+    memcpy(line, "ATOM  ", 6);
+    hy36encode(i+1, 5, &line[6]);
+
+    // Names shorter than four characters start in column 14
+    char name[9];
+    int len = trimCopy(name, a->name, 8);
+    putString(&line[len<4 ? 13 : 12], name, len<4 ? 3 : 4, 1);
+
+    char res[9];
+    trimCopy(res, a->resType, 8);
+    putString(&line[17], res, 4, 1);
+
+    char * end;
+    long resSeq = strtol(a->resID, &end, 10);
+    hy36encode(resSeq, 4, &line[22]);
+    if(*end && !isspace((unsigned char) *end))
+      line[26] = *end; // Insertion code
+
+    putCoords(line, xs[i], ys[i], zs[i], 1, bfactor ? bfactor[i] : 0);
+
+    char seg[11];
+    trimCopy(seg, a->seg, 10);
+    ptr = putString(&line[72], seg, 4, 1);
+    double q = a->charge;
+    if(q != 0 && q == floor(q) && fabs(q) < 10) {
+      line[78] = '0' + (int) fabs(q);
+      line[79] = q<0 ? '-' : '+';
+      ptr = &line[80];
+    }
+    while(ptr>line && ptr[-1]==' ')
+      ptr--; // Drop trailing blanks
+    *ptr++ = '\n';
+    advanceOut(o, ptr);
+  }
+  writeKeyword(o, "ENDMDL");
+  return o->error ? -1 : 0;
+}
+
+/**
+ * Finish and close a PDB file opened with openPDBWriter
+ *
+ * @param[in] w The PDB writer, which is freed.
+ * @return 0 if the whole file was written successfully, or -1 otherwise.
+ */
+int closePDBWriter(struct pdbwriter * w) {
+  writeKeyword(&w->o, "END");
+  int status = closeOut(&w->o);
+  if(fclose(w->hdl))
+    status = -1;
+  free(w);
+  return status;
+}
@@ -0,0 +1,15 @@
+#ifndef PDBWRITE
+#define PDBWRITE
+
+#include "pdb.h"
+#include "psfpdb.h"
+
+struct pdbwriter;
+
+int writePDB(const char * path, struct pdb p);
+struct pdbwriter * openPDBWriter(const char * path);
+int writePDBModel(struct pdbwriter * w, struct psfpdb s,
+    const struct cryst * cell, const float * xs, const float * ys,
+    const float * zs, const float * bfactor);
+int closePDBWriter(struct pdbwriter * w);
+#endif
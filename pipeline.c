@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "pipeline.h"
+#include "dcd.h"
+
+// Gaps between needed atoms shorter than this are read rather than skipped
+#define MINGAP 1024
+
+/**
+ * Read a clock for timing stages
+ *
+ * @return The time in seconds from an arbitrary start.
+ */
+static double wallTime(void) {
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ * Plan the ranges of atoms to read for a set of stages
+ *
+ * The atoms needed by any stage are covered by ranges of consecutive atoms,
+ * joining ranges separated by short gaps, since reading a few extra atoms
+ * costs less than a separate read.
+ *
+ * @param[in] nstage The number of stages.
+ * @param[in] stages The stages.
+ * @param[in] natoms The number of atoms in the trajectory.
+ * @param[out] first The first atom of each range.
+ * @param[out] count The number of atoms in each range.
+ * @return The number of ranges.
+ */
+static int planRanges(int nstage, const struct stage * stages,
+    uint32_t natoms, uint32_t ** first, uint32_t ** count) {
+  int nword = (natoms+63)/64;
+  uint64_t * need = calloc(nword ? nword : 1, sizeof(uint64_t));
+  for(int s=0; s<nstage; s++)
+    for(int k=0; k<nword; k++)
+      need[k] |= stages[s].mask ? stages[s].mask[k] : ~(uint64_t) 0;
+
+  int nrange = 0, cap = 16;
+  *first = malloc(cap * sizeof(uint32_t));
+  *count = malloc(cap * sizeof(uint32_t));
+  for(uint32_t i=0; i<natoms; i++) {
+    if(!(need[i/64] >> (i%64) & 1))
+      continue;
+    if(nrange && i - ((*first)[nrange-1] + (*count)[nrange-1]) < MINGAP) {
+      (*count)[nrange-1] = i+1 - (*first)[nrange-1];
+      continue;
+    }
+    if(nrange == cap) {
+      cap *= 2;
+      *first = realloc(*first, cap * sizeof(uint32_t));
+      *count = realloc(*count, cap * sizeof(uint32_t));
+    }
+    (*first)[nrange] = i;
+    (*count)[nrange++] = 1;
+  }
+  free(need);
+  return nrange;
+}
+
+/**
+ * Run several analyses over a DCD, reading each frame once
+ *
+ * This is the frame loop of every trajectory analysis. Frames are split
+ * among OpenMP threads in contiguous blocks, and each thread reads its
+ * frames through its own DCD handle, passing every frame it reads to every
+ * stage in turn. Only the atoms needed by some stage are read, so
+ * coordinates of other atoms are zero or left over from other frames; masks
+ * must have a bit for every atom of the DCD. A stage may change the
+ * coordinates, for instance by fitting them, and the stages after it see
+ * the change.
+ *
+ * Each thread first calls each stage's init to create its state for the
+ * stage, which is passed to the stage's frame callback for every frame the
+ * thread reads. init may be called concurrently from several threads. Once
+ * all frames are read, the states of the threads that ran are merged into
+ * the stage's data. If the stage has a combine callback, states are
+ * combined pairwise in a tree, neighbors first, then neighbors two apart,
+ * and so on, and merge is called once with the result; otherwise merge is
+ * called with each thread's state in thread order. Either way the merge
+ * does not depend on the scheduling of threads. merge is called even if a
+ * read failed, so that it can release the state.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] nstage The number of stages.
+ * @param[in,out] stages The stages. The time each spends in its frame
+ *                       callback, summed over threads, is stored in seconds.
+ * @param[out] ioseconds The time spent reading frames, summed over threads,
+ *                       or NULL.
+ * @return The number of frames processed, or -1 if the DCD cannot be read.
+ */
+int runPipeline(char * path, int nstage, struct stage * stages,
+    double * ioseconds) {
+  struct dcd * d = openDCD(path);
+  if(!d)
+    return -1;
+  uint32_t nframes = getNFrames(d);
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+
+  uint32_t * first, * count;
+  int nrange = planRanges(nstage, stages, natoms, &first, &count);
+  for(int s=0; s<nstage; s++)
+    stages[s].seconds = 0;
+  if(ioseconds)
+    *ioseconds = 0;
+
+#ifdef _OPENMP
+  int nthreads = omp_get_max_threads();
+#else
+  int nthreads = 1;
+#endif
+  // The state of stage s in thread t is at t*nstage+s
+  void ** state = calloc((size_t) nthreads*nstage + 1, sizeof(void *));
+  bool * ran = calloc(nthreads, sizeof(bool)); // Threads may be fewer
+  bool failed = false;
+  #pragma omp parallel num_threads(nthreads)
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+#else
+    int t = 0;
+#endif
+    struct dcd * in = openDCD(path);
+    float * xs = calloc(natoms ? natoms : 1, sizeof(float));
+    float * ys = calloc(natoms ? natoms : 1, sizeof(float));
+    float * zs = calloc(natoms ? natoms : 1, sizeof(float));
+    void ** mine = &state[(size_t) t*nstage];
+    double * seconds = calloc(nstage ? nstage : 1, sizeof(double));
+    double io = 0;
+    for(int s=0; s<nstage; s++)
+      mine[s] = stages[s].init ? stages[s].init(stages[s].data) : NULL;
+    ran[t] = true;
+    #pragma omp for schedule(static)
+    for(uint32_t f=0; f<nframes; f++) {
+      if(!in)
+        continue;
+      double t0 = wallTime();
+      double uc[3];
+      goToFrame(in, f);
+      getUnitCell(in, uc);
+      for(int r=0; r<nrange; r++)
+        getCoordRange(in, first[r], count[r], xs, ys, zs);
+      io += wallTime()-t0;
+      for(int s=0; s<nstage; s++) {
+        t0 = wallTime();
+        stages[s].frame(stages[s].data, mine[s], f, uc, xs, ys, zs);
+        seconds[s] += wallTime()-t0;
+      }
+    }
+    if(!in) {
+      #pragma omp atomic write
+      failed = true;
+    } else
+      closeDCD(in);
+    #pragma omp critical
+    {
+      for(int s=0; s<nstage; s++)
+        stages[s].seconds += seconds[s];
+      if(ioseconds)
+        *ioseconds += io;
+    }
+    free(xs);
+    free(ys);
+    free(zs);
+    free(seconds);
+  }
+
+  for(int s=0; s<nstage; s++) {
+    struct stage * g = &stages[s];
+    if(g->combine) {
+      // Combine neighbors, then neighbors two apart, and so on; a thread
+      // that did not run hands over the state of its partner
+      for(int step=1; step<nthreads; step*=2) {
+        #pragma omp parallel for schedule(dynamic)
+        for(int t=0; t<nthreads-step; t+=2*step) {
+          void ** into = &state[(size_t) t*nstage+s];
+          void ** from = &state[(size_t) (t+step)*nstage+s];
+          if(ran[t] && ran[t+step])
+            g->combine(g->data, *into, *from);
+          else if(ran[t+step])
+            *into = *from;
+        }
+        for(int t=0; t<nthreads-step; t+=2*step)
+          ran[t] = ran[t] || ran[t+step];
+      }
+      if(g->merge && ran[0])
+        g->merge(g->data, state[s]);
+    } else if(g->merge) {
+      for(int t=0; t<nthreads; t++)
+        if(ran[t])
+          g->merge(g->data, state[(size_t) t*nstage+s]);
+    }
+  }
+  free(state);
+  free(ran);
+  free(first);
+  free(count);
+  return failed ? -1 : (int) nframes;
+}
@@ -0,0 +1,21 @@
+#ifndef PIPELINE
+#define PIPELINE
+
+#include <stdint.h>
+
+struct stage {
+  void * data; // passed to each callback
+  const uint64_t * mask; // atoms the stage reads, or NULL for every atom
+  void *(*init)(void * data); // creates per-thread state, may be NULL
+  void (*frame)(void * data, void * state, uint32_t f, const double * uc,
+      float * xs, float * ys, float * zs);
+  // adds the state of one thread to that of another and releases it, for a
+  // tree merge; may be NULL to merge every thread's state in order instead
+  void (*combine)(void * data, void * into, void * from);
+  void (*merge)(void * data, void * state); // may be NULL
+  double seconds; // time spent in frame, summed over threads
+};
+
+int runPipeline(char * path, int nstage, struct stage * stages,
+    double * ioseconds);
+#endif
@@ -1,9 +1,16 @@
+#define _POSIX_C_SOURCE 200809L // for fmemopen
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "psf.h"
+#include "fixfmt.h"
 
 /**
  * Read a count from a PSF section header.
@@ -11,7 +18,8 @@
  * Retrieves the count from the header of a section of a PSF. This method does
  * not verify that the header field matches the actual number of elements
  * listed. If the file is unreadable, or the header field cannot be read, a
- * value of -1 is returned instead.
+ * value of -1 is returned instead. The rest of the header line is skipped, so
+ * that the next line read is the first line of the section itself.
  *
  * @param[in] psf The PSF from which the count should be read.
  * @param[in] bang The PSF section title, starting with an exclamation point.
@@ -19,17 +27,20 @@
  */
 static int readBang(FILE * psf, char * bang) {
   int nbang = -1; // in case bang count is not read successfully.
-  char bufferA[1024]; // previous word
-  char bufferB[1024]; // current word
+  char bufferA[1024] = ""; // previous word
+  char bufferB[1024] = ""; // current word
   int numread = -1; // for detecting read errors
   while ( (!ferror(psf)) && (!feof(psf)) && numread!=0 ) { // stop looping upon
                                                            // error or eof
     if(!strncmp(bufferB,bang,strlen(bang))) { // watch for bang
       nbang = atoi(bufferA); // read word (number) before bang
+      int c;
+      while((c=fgetc(psf))!=EOF && c!='\n')
+        ; // skip the rest of the header line
       break; // stop looping
     }
     strcpy(bufferA,bufferB); // save current word as previous
-    numread = fscanf(psf," %1024s ",bufferB); // load next word
+    numread = fscanf(psf," %1023s",bufferB); // load next word
   }
   return nbang;
 }
@@ -92,11 +103,11 @@ static int readTitles(FILE * psf, struct psf * p) {
 }
 
 /**
- * Read atom information from a PSF.
+ * Parse one atom record of a PSF.
  *
- * Reads atom details (including scattering lengths) from a PSF file and stores
- * the contents in the provided psf struct. Also populates the natom field of
- * the psf struct. The format should be a standard PSF, optionally with an
+ * Reads atom details (including scattering lengths) from one line of the atom
+ * section of a PSF file and stores the contents in the provided psfatom
+ * struct. The format should be a standard PSF, optionally with an
  * appended scattering length column (SLB), with the appropriate first-line
  * signature:
  *
@@ -143,25 +154,140 @@ static int readTitles(FILE * psf, struct psf * p) {
  * otherwise it is represented as an integer. For simplicity, it is always 
  * stored in the psfatom struct as a string.
  *
+ * @param[in] buffer The line to be parsed.
+ * @param[in] sig The format of the PSF.
+ * @param[in] n The zero-based index the atom is expected to have.
+ * @param[out] a The struct into which the atom data will be stored.
+ * @return 0 on success, or -1 if the atom index does not match n.
+ */
+static int parseAtomLine(const char * buffer, struct psfsig sig, int n,
+    struct psfatom * a) {
+  // Clear atom struct
+  memset(a->seg,'\0',9);
+  memset(a->resid,'\0',9);
+  memset(a->res,'\0',9);
+  memset(a->name,'\0',9);
+  memset(a->type,'\0',7);
+  a->charge=0;
+  a->mass=0;
+  a->imove=0;
+  a->ech=0;
+  a->eha=0;
+  a->b=0;
+
+  int offset=0; // Keeps track of field alignment
+  char substr[15];
+
+  int width=sig.ext?10:8; // Width of first field (index)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the atom index substring.
+  if(atoi(substr)!=n+1)
+    return -1; // Atom index doesn't match the expected number.
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=sig.ext?8:4; // Width of second field (segment name)
+  // copy string directly into psfatom struct
+  memcpy(a->seg,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=sig.ext?8:4; // Width of third field (redisue identifier)
+  // copy string directly into psfatom struct
+  memcpy(a->resid,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=sig.ext?8:4; // Width of fourth field (redisue name)
+  // copy string directly into psfatom struct
+  memcpy(a->res,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=sig.ext?8:4; // Width of fifth field (atom name)
+  // copy string directly into psfatom struct
+  memcpy(a->name,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=(sig.ext && sig.xplor)?6:4; // Width of sixth field (atom type)
+  // copy string directly into psfatom struct
+  memcpy(a->type,&buffer[offset],width);
+  offset+=width; // advance offset to next field
+
+  offset+=1; // Skip a space
+
+  width=14; // Width of seventh field (atom charge)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the atom charge substring
+  a->charge=atof(substr); // write charge value to psfatom struct
+  offset+=width; // advance offset to next field
+
+  width=14; // Width of eighth field (atom mass)
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the atom mass substring
+  a->mass=atof(substr); // write mass value to psfatom struct
+  offset+=width; // advance offset to next field
+
+  width=8; // Width of ninth field ("IMOVE")
+  memset(substr,'\0',15); // Clear substring buffer
+  memcpy(substr,&buffer[offset],width); // isolate the "IMOVE" substring
+  a->imove=atoi(substr); // write "IMOVE" to psfatom struct
+  offset+=width; // advance offset to next field
+
+  if(sig.cmapcheq) {
+    width=14; // Width of first CMAP/CHEQ field (CHEQ electronegativity)
+    memset(substr,'\0',15); // Clear substring buffer
+    memcpy(substr,&buffer[offset],width); // isolate the "ECH" substring
+    a->ech=atof(substr); // write charge value to psfatom struct
+    offset+=width; // advance offset to next field
+
+    width=14; // Width of second CMAP/CHEQ field (CHEQ hardness)
+    memset(substr,'\0',15); // Clear substring buffer
+    memcpy(substr,&buffer[offset],width); // isolate the "EHA" substring
+    a->eha=atof(substr); // write mass value to psfatom struct
+    offset+=width; // advance offset to next field
+  }
+
+  if(sig.slb) {
+    offset+=1; // Skip a space
+
+    width=14; // Width of last field (atom scattering length "b")
+    memset(substr,'\0',15); // Clear substring buffer
+    // isolate the scattering length substring
+    memcpy(substr,&buffer[offset],width);
+    a->b=atof(substr); // write scattering length value to struct
+    offset+=width;
+  }
+  return 0;
+}
+
+/**
+ * Read the atom records of a PSF, passing each to a sink
+ *
+ * Parses atom records line by line, starting just after the !NATOM header,
+ * until natom records have been read or the section ends. Each record is
+ * handed to the sink as soon as it is parsed.
+ *
  * @param[in] psf The PSF from which the atom data will be read.
- * @param[in,out] p The struct into which the atom data will be stored.
- * @return The number of atoms read, or -1 if an error occurs.
+ * @param[in] sig The format of the PSF.
+ * @param[in] natom The number of atoms given in the section header.
+ * @param[in] sink The sink receiving each atom record.
+ * @return The number of atoms read.
  */
-static int readAtoms(FILE * psf, struct psf * p) {
+static int scanAtoms(FILE * psf, struct psfsig sig, int natom,
+    struct psfsink sink) {
   char buffer[1024]; // For storing one line of the file at a time.
   char * ptr; // For detecting read failures
 
-  // Read number of atoms from section header
-  p->natom = readBang(psf, "!NATOM");
-  if(p->natom == -1)
-    return -1; // Error reading number of atoms from section header
-
-  // Allocate space for atom array
-  p->atoms = malloc(p->natom * sizeof(struct psfatom));
-
   int n = 0; // Track the number of atoms read so far
 
-  while (1) {
+  while (n<natom) {
     ptr = fgets(buffer,1024,psf);
     if(ferror(psf) || feof(psf) || ptr==NULL) {
       break; // Error reading file for next atom record.
@@ -173,111 +299,49 @@ static int readAtoms(FILE * psf, struct psf * p) {
       break; // PSF is missing empty line between sections.
     }
 
-    // Clear atom struct
-    memset(p->atoms[n].seg,'\0',9);
-    memset(p->atoms[n].resid,'\0',9);
-    memset(p->atoms[n].res,'\0',9);
-    memset(p->atoms[n].name,'\0',9);
-    memset(p->atoms[n].type,'\0',9);
-    p->atoms[n].charge=0;
-    p->atoms[n].mass=0;
-    p->atoms[n].imove=0;
-    p->atoms[n].ech=0;
-    p->atoms[n].eha=0;
-    p->atoms[n].b=0;
-
-    int offset=0; // Keeps track of field alignment
-    char substr[15];
-
-    int width=p->sig.ext?10:8; // Width of first field (index)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the atom index substring.
-    if(atoi(substr)!=n+1)
-      break; // Atom index doesn't match the expected number.
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=p->sig.ext?8:4; // Width of second field (segment name)
-    // copy string directly into psfatom struct
-    memcpy(p->atoms[n].seg,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=p->sig.ext?8:4; // Width of third field (redisue identifier)
-    // copy string directly into psfatom struct
-    memcpy(p->atoms[n].resid,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=p->sig.ext?8:4; // Width of fourth field (redisue name)
-    // copy string directly into psfatom struct
-    memcpy(p->atoms[n].res,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=p->sig.ext?8:4; // Width of fifth field (atom name)
-    // copy string directly into psfatom struct
-    memcpy(p->atoms[n].name,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=(p->sig.ext && p->sig.xplor)?6:4; // Width of sixth field (atom type)
-    // copy string directly into psfatom struct
-    memcpy(p->atoms[n].type,&buffer[offset],width);
-    offset+=width; // advance offset to next field
-
-    offset+=1; // Skip a space
-
-    width=14; // Width of seventh field (atom charge)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the atom charge substring
-    p->atoms[n].charge=atof(substr); // write charge value to psfatom struct
-    offset+=width; // advance offset to next field
-
-    width=14; // Width of eighth field (atom mass)
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the atom mass substring
-    p->atoms[n].mass=atof(substr); // write mass value to psfatom struct
-    offset+=width; // advance offset to next field
-
-    width=8; // Width of ninth field ("IMOVE")
-    memset(substr,'\0',15); // Clear substring buffer
-    memcpy(substr,&buffer[offset],width); // isolate the "IMOVE" substring
-    p->atoms[n].imove=atoi(substr); // write "IMOVE" to psfatom struct
-    offset+=width; // advance offset to next field
+    struct psfatom a;
+    if(parseAtomLine(buffer, sig, n, &a))
+      break;
+    sink.atom(sink.data, n, &a);
+    n++; // Advance atom count
+  } // This loop ends upon interruption by a break statement.
+  return n;
+}
 
-    if(p->sig.cmapcheq) {
-      width=14; // Width of first CMAP/CHEQ field (CHEQ electronegativity)
-      memset(substr,'\0',15); // Clear substring buffer
-      memcpy(substr,&buffer[offset],width); // isolate the "ECH" substring
-      p->atoms[n].ech=atof(substr); // write charge value to psfatom struct
-      offset+=width; // advance offset to next field
-
-      width=14; // Width of second CMAP/CHEQ field (CHEQ hardness)
-      memset(substr,'\0',15); // Clear substring buffer
-      memcpy(substr,&buffer[offset],width); // isolate the "EHA" substring
-      p->atoms[n].eha=atof(substr); // write mass value to psfatom struct
-      offset+=width; // advance offset to next field
-    }
+/**
+ * Store an atom record in the atom array of a psf struct
+ *
+ * The atom callback of the sink used by readAtoms.
+ *
+ * @param[in,out] data The psf struct.
+ * @param[in] i The zero-based atom index.
+ * @param[in] a The atom record.
+ */
+static void storeAtom(void * data, int i, const struct psfatom * a) {
+  ((struct psf *) data)->atoms[i] = *a;
+}
 
-    if(p->sig.slb) {
-      offset+=1; // Skip a space
+/**
+ * Read atom information from a PSF.
+ *
+ * Reads the atom records into the atom array of the provided psf struct, and
+ * populates its natom field.
+ *
+ * @param[in] psf The PSF from which the atom data will be read.
+ * @param[in,out] p The struct into which the atom data will be stored.
+ * @return The number of atoms read, or -1 if an error occurs.
+ */
+static int readAtoms(FILE * psf, struct psf * p) {
+  // Read number of atoms from section header
+  p->natom = readBang(psf, "!NATOM");
+  if(p->natom == -1)
+    return -1; // Error reading number of atoms from section header
 
-      width=14; // Width of last field (atom scattering length "b")
-      memset(substr,'\0',15); // Clear substring buffer
-      // isolate the scattering length substring
-      memcpy(substr,&buffer[offset],width);
-      p->atoms[n].b=atof(substr); // write scattering length value to struct
-      offset+=width;
-    }
+  // Allocate space for atom array
+  p->atoms = malloc(p->natom * sizeof(struct psfatom));
 
-    n++; // Advance atom count
-  } // This loop ends upon interruption by a break statement.
+  struct psfsink sink = { .data = p, .begin = NULL, .atom = storeAtom };
+  int n = scanAtoms(psf, p->sig, p->natom, sink);
   if(n==p->natom)
     return n; // Correct number of atoms found.
   else {
@@ -289,6 +353,163 @@ static int readAtoms(FILE * psf, struct psf * p) {
   }
 }
 
+/**
+ * Build the atom table for a PSF
+ *
+ * Interns the segment, residue, atom name and type strings of every atom
+ * record into the atom table of the psf struct, alongside dense charge and
+ * mass arrays. Must be called after the atom records have been read.
+ *
+ * @param[in,out] p The struct whose atom table will be populated.
+ */
+static void buildTable(struct psf * p) {
+  p->table = newAtomTable(p->natom);
+  for(int i=0; i<p->natom; i++) {
+    struct psfatom * a = &p->atoms[i];
+    setTableAtom(&p->table,i,a->seg,a->resid,a->res,a->name,a->type,
+        a->charge,a->mass);
+  }
+}
+
+/**
+ * Parse the atom indices on one line of a PSF connectivity section
+ *
+ * Decodes the whitespace-separated integers on a line directly into dst,
+ * converting them from the one-based indices used in the PSF to zero-based
+ * indices as they are stored. Each index is checked against the number of
+ * atoms in the PSF. When SSE2 is available, digits, whitespace and the end of
+ * the line are classified sixteen characters at a time and only the digit runs
+ * are visited; otherwise every character is classified individually.
+ *
+ * The line must be null-terminated, and at least 16 bytes beyond the
+ * terminator must be readable.
+ *
+ * @param[in] line The line to be parsed.
+ * @param[out] dst The array into which the zero-based indices are written.
+ * @param[in] max The maximum number of indices that may be written to dst.
+ * @param[in] natom The number of atoms in the PSF.
+ * @return The number of indices read, or -1 if the line contains anything
+ *         other than indices in the range 1 to natom, or more than max of them.
+ */
+static int parseIndices(const char * line, int * dst, int max, int natom) {
+  int n = 0; // Number of indices decoded so far
+  long long val = 0; // Value of the index currently being decoded
+  int ndigit = 0; // Number of digits of the current index seen so far
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_set1_epi8('0'-1);
+  const __m128i nine = _mm_set1_epi8('9'+1);
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i nul = _mm_setzero_si128();
+  for(int pos=0; ; pos+=16) {
+    __m128i b = _mm_loadu_si128((const __m128i *) &line[pos]);
+    unsigned int digit = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpgt_epi8(b,zero),_mm_cmplt_epi8(b,nine)));
+    unsigned int blank = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(b,space),_mm_cmpeq_epi8(b,tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(b,nl),_mm_cmpeq_epi8(b,cr))));
+    unsigned int end = _mm_movemask_epi8(_mm_cmpeq_epi8(b,nul));
+    unsigned int live = end ? (end & -end)-1 : 0xFFFF; // Bytes before the null
+    if((~(digit | blank)) & live)
+      return -1; // Unexpected character on the line
+    digit &= live;
+
+    // A number that ran to the end of the previous block ends here unless
+    // this block starts with another digit.
+    if(ndigit && !(digit & 1)) {
+      if(val<1 || val>natom || n==max)
+        return -1;
+      dst[n++] = val-1;
+      val = 0;
+      ndigit = 0;
+    }
+
+    while(digit) {
+      int s = __builtin_ctz(digit); // Start of the next run of digits
+      int len = __builtin_ctz(~(digit >> s)); // Length of the run
+      for(int k=pos+s; k<pos+s+len; k++)
+        val = 10*val + (line[k]-'0');
+      ndigit += len;
+      if(ndigit>10)
+        return -1; // Too many digits to be a valid index
+      digit &= ~(((1u << len)-1) << s);
+      if(s+len<16) { // The number ends inside this block
+        if(val<1 || val>natom || n==max)
+          return -1;
+        dst[n++] = val-1;
+        val = 0;
+        ndigit = 0;
+      }
+    }
+    if(end)
+      break;
+  }
+#else
+  for(const char * c=line; ; c++) {
+    if((unsigned) (*c-'0') < 10) {
+      val = 10*val + (*c-'0');
+      if(++ndigit>10)
+        return -1; // Too many digits to be a valid index
+      continue;
+    }
+    if(*c!=' ' && *c!='\t' && *c!='\n' && *c!='\r' && *c!='\0')
+      return -1; // Unexpected character on the line
+    if(ndigit) {
+      if(val<1 || val>natom || n==max)
+        return -1;
+      dst[n++] = val-1;
+      val = 0;
+      ndigit = 0;
+    }
+    if(*c=='\0')
+      break;
+  }
+#endif
+  return n;
+}
+
+/**
+ * Read the atom indices of a PSF connectivity section
+ *
+ * Reads lines of atom indices until the end of the section, storing them as
+ * zero-based indices in dst. Used for the bond, angle, dihedral and improper
+ * sections, whose structs are plain sequences of int fields and can therefore
+ * be filled as flat int arrays.
+ *
+ * @param[in] psf The PSF from which the indices will be read.
+ * @param[out] dst The array into which the indices will be stored.
+ * @param[in] max The number of indices expected in the section.
+ * @param[in] natom The number of atoms in the PSF.
+ * @return The number of indices read, or -1 if an invalid line is found.
+ */
+static int readIndices(FILE * psf, int * dst, int max, int natom) {
+  char buffer[1024+16]; // One line of the file, plus room for vector loads
+  char * ptr; // For detecting read failures
+
+  int n = 0; // track the number of indices read so far.
+
+  while (1) {
+    ptr = fgets(buffer,1024,psf);
+    if(ferror(psf) || feof(psf) || ptr==NULL) {
+      break; // Error reading file for next indices.
+    }
+    if(buffer[0]=='\n') {
+      break; // Reached the end of the section.
+    }
+    if(strstr(buffer,"!")) {
+      break; // PSF is missing empty line between sections.
+    }
+    int numread = parseIndices(buffer,&dst[n],max-n,natom);
+    if(numread == -1)
+      return -1; // Malformed line or index out of range
+    n+=numread;
+  } // This loop ends upon interruption by a break statement.
+  return n;
+}
+
 /**
  * Read bond data from a PSF
  *
@@ -302,9 +523,6 @@ static int readAtoms(FILE * psf, struct psf * p) {
  * @return The number of bonds read, or -1 if an error occurs.
  */
 static int readBonds(FILE * psf, struct psf * p) {
-  char buffer[1024]; //For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
-
   // Read number of bonds from section header
   p->nbond = readBang(psf, "!NBOND");
   if(p->nbond == -1)
@@ -313,31 +531,9 @@ static int readBonds(FILE * psf, struct psf * p) {
   // Allocate space for bond array
   p->bonds = malloc(p->nbond * sizeof(struct bond));
 
-  int n = 0; // track the number of bonds read so far.
-
-  while (1) {
-    ptr = fgets(buffer,1024,psf);
-    if(ferror(psf) || feof(psf) || ptr==NULL) {
-      break; // Error reading file for next bonds.
-    }
-    if(buffer[0]=='\n') {
-      break; // Reached the end of the bonds section.
-    }
-    if(strstr(buffer,"!")) {
-      break; // PSF is missing empty line between sections.
-    }
-    int numread = 0;
-    numread = sscanf(buffer,"%d %d %d %d %d %d %d %d",&p->bonds[n].a,
-      &p->bonds[n].b,&p->bonds[n+1].a,&p->bonds[n+1].b,&p->bonds[n+2].a,
-      &p->bonds[n+2].b,&p->bonds[n+3].a,&p->bonds[n+3].b);
-    for(int k=0; k<numread/2; k++) {
-      p->bonds[n+k].a--;
-      p->bonds[n+k].b--;
-    }
-    n+=numread/2;
-  } // This loop ends upon interruption by a break statement.
-  if(n==p->nbond)
-    return n; // Correct number of bonds found.
+  int n = readIndices(psf, (int *) p->bonds, 2*p->nbond, p->natom);
+  if(n==2*p->nbond)
+    return p->nbond; // Correct number of bonds found.
   else { // Wrong number of bonds
     // Remove any partial bond data from psf structure
     p->nbond = -1;
@@ -360,9 +556,6 @@ static int readBonds(FILE * psf, struct psf * p) {
  * @return The number of angles read, or -1 if an error occurs.
  */
 static int readAngles(FILE * psf, struct psf * p) {
-  char buffer[1024]; //For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
-
   // Read number of angles from section header
   p->ntheta = readBang(psf, "!NTHETA");
   if(p->ntheta == -1)
@@ -371,33 +564,9 @@ static int readAngles(FILE * psf, struct psf * p) {
   // Allocate space for angle array
   p->angles = malloc(p->ntheta * sizeof(struct angle));
 
-  int n = 0; // track the number of angles read so far.
-
-  while (1) {
-    ptr = fgets(buffer,1024,psf);
-    if(ferror(psf) || feof(psf) || ptr==NULL) {
-      break; // Error reading file for next angles.
-    }
-    if(buffer[0]=='\n') {
-      break; // Reached the end of the angles section.
-    }
-    if(strstr(buffer,"!")) {
-      break; // PSF is missing empty line between sections.
-    }
-    int numread = 0;
-    numread = sscanf(buffer,"%d %d %d %d %d %d %d %d %d",
-        &p->angles[n].a,&p->angles[n].b,&p->angles[n].c,
-        &p->angles[n+1].a,&p->angles[n+1].b,&p->angles[n+1].c,
-        &p->angles[n+2].a,&p->angles[n+2].b,&p->angles[n+2].c);
-    for(int k=0; k<numread/3; k++) {
-      p->angles[n+k].a--;
-      p->angles[n+k].b--;
-      p->angles[n+k].c--;
-    }
-    n+=numread/3;
-  } // This loop ends upon interruption by a break statement.
-  if(n==p->ntheta)
-    return n; // Correct number of angles found.
+  int n = readIndices(psf, (int *) p->angles, 3*p->ntheta, p->natom);
+  if(n==3*p->ntheta)
+    return p->ntheta; // Correct number of angles found.
   else { // Wrong number of angles
     // Remove any partial angle data from psf structure
     p->ntheta = -1;
@@ -421,9 +590,6 @@ static int readAngles(FILE * psf, struct psf * p) {
  * @return The number of dihedrals read, or -1 if an error occurs.
  */
 static int readDihedrals(FILE * psf, struct psf * p) {
-  char buffer[1024]; //For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
-
   // Read number of dihedrals from section header
   p->nphi = readBang(psf, "!NPHI");
   if(p->nphi == -1)
@@ -432,35 +598,9 @@ static int readDihedrals(FILE * psf, struct psf * p) {
   // Allocate space for dihedral array
   p->dihedrals = malloc(p->nphi * sizeof(struct dihedral));
 
-  int n = 0; // track the number of dihedrals read so far.
-
-  while (1) {
-    ptr = fgets(buffer,1024,psf);
-    if(ferror(psf) || feof(psf) || ptr==NULL) {
-      break; // Error reading file for next dihedrals.
-    }
-    if(buffer[0]=='\n') {
-      break; // Reached the end of the dihedrals section.
-    }
-    if(strstr(buffer,"!")) {
-      break; // PSF is missing empty line between sections.
-    }
-    int numread = 0;
-    numread = sscanf(buffer,"%d %d %d %d %d %d %d %d",
-        &p->dihedrals[n].a,&p->dihedrals[n].b,
-        &p->dihedrals[n].c,&p->dihedrals[n].d,
-        &p->dihedrals[n+1].a,&p->dihedrals[n+1].b,
-        &p->dihedrals[n+1].c,&p->dihedrals[n+1].d);
-    for(int k=0; k<numread/4; k++) {
-      p->dihedrals[n+k].a--;
-      p->dihedrals[n+k].b--;
-      p->dihedrals[n+k].c--;
-      p->dihedrals[n+k].d--;
-    }
-    n+=numread/4;
-  } // This loop ends upon interruption by a break statement.
-  if(n==p->nphi)
-    return n; // Correct number of dihedrals found.
+  int n = readIndices(psf, (int *) p->dihedrals, 4*p->nphi, p->natom);
+  if(n==4*p->nphi)
+    return p->nphi; // Correct number of dihedrals found.
   else { // Wrong number of dihedrals
     // Remove any partial dihedral data from psf structure
     p->nphi = -1;
@@ -483,9 +623,6 @@ static int readDihedrals(FILE * psf, struct psf * p) {
  * @return The number of impropers read, or -1 if an error occurs.
  */
 static int readImpropers(FILE * psf, struct psf * p) {
-  char buffer[1024]; //For storing one line of the file at a time.
-  char * ptr; // For detecting read failures
-
   // Read number of impropers from section header
   p->nimphi = readBang(psf, "!NIMPHI");
   if(p->nimphi == -1)
@@ -494,35 +631,9 @@ static int readImpropers(FILE * psf, struct psf * p) {
   // Allocate space for improper dihedral array
   p->impropers = malloc(p->nimphi * sizeof(struct dihedral));
 
-  int n = 0; // track the number of impropers read so far.
-
-  while (1) {
-    ptr = fgets(buffer,1024,psf);
-    if(ferror(psf) || feof(psf) || ptr==NULL) {
-      break; // Error reading file for next impropers.
-    }
-    if(buffer[0]=='\n') {
-      break; // Reached the end of the impropers section.
-    }
-    if(strstr(buffer,"!")) {
-      break; // PSF is missing empty line between sections.
-    }
-    int numread = 0;
-    numread = sscanf(buffer,"%d %d %d %d %d %d %d %d",
-        &p->impropers[n].a,&p->impropers[n].b,
-        &p->impropers[n].c,&p->impropers[n].d,
-        &p->impropers[n+1].a,&p->impropers[n+1].b,
-        &p->impropers[n+1].c,&p->impropers[n+1].d);
-    for(int k=0; k<numread/4; k++) {
-      p->impropers[n+k].a--;
-      p->impropers[n+k].b--;
-      p->impropers[n+k].c--;
-      p->impropers[n+k].d--;
-    }
-    n+=numread/4;
-  } // This loop ends upon interruption by a break statement.
-  if(n==p->nimphi)
-    return n; // Correct number of impropers found.
+  int n = readIndices(psf, (int *) p->impropers, 4*p->nimphi, p->natom);
+  if(n==4*p->nimphi)
+    return p->nimphi; // Correct number of impropers found.
   else { // Wrong number of impropers
     // Remove any partial improper dihedral data from psf structure
     p->nimphi = -1;
@@ -533,7 +644,125 @@ static int readImpropers(FILE * psf, struct psf * p) {
 }
 
 /**
- * Read data from PSF
+ * Read the signature line of a PSF
+ *
+ * Checks that the first line of the file identifies it as a PSF, and records
+ * which of the format extensions it declares.
+ *
+ * @param[in] psf The PSF, positioned at its first line.
+ * @param[out] sig The struct into which the format is written.
+ * @return true if the file is a PSF, or false otherwise.
+ */
+static bool readSignature(FILE * psf, struct psfsig * sig) {
+  char buffer[1024]; //For storing one line of the file at a time.
+
+  char * ptr; // For detecting read failures
+
+  ptr = fgets(buffer,1024,psf); //get first line
+  if(ferror(psf) || feof(psf) || ptr==NULL)
+    return false; // Error reading first line of file.
+
+  if(strncmp(buffer,"PSF",3))
+    return false; // File is not a valid PSF.
+  sig->valid=true;
+
+  // Check for each PSF format specifier
+  if(strstr(buffer,"EXT"))
+    sig->ext=true;
+  if(strstr(buffer,"CMAP CHEQ"))
+    sig->cmapcheq=true;
+  if(strstr(buffer,"XPLOR"))
+    sig->xplor=true;
+  if(strstr(buffer,"SLB"))
+    sig->slb=true;
+  return true;
+}
+
+/**
+ * Open an in-memory buffer as a read-only stream
+ *
+ * @param[in] data The buffer.
+ * @param[in] size The number of bytes in the buffer.
+ * @return The stream, or NULL if the buffer is empty or cannot be opened.
+ */
+static FILE * openBuffer(const char * data, size_t size) {
+  if(!data || !size)
+    return NULL;
+  return fmemopen((void *) data, size, "r"); // Not written in mode "r"
+}
+
+/**
+ * Read the atom records of an open PSF, passing each to a sink
+ *
+ * See readPSFAtoms.
+ *
+ * @param[in] psf The PSF, positioned at its first line, or NULL.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if an error occurs.
+ */
+static int scanPSFAtoms(FILE * psf, struct psfsink sink) {
+  struct psfsig sig = { .valid = false,
+                        .ext = false,
+                        .cmapcheq = false,
+                        .xplor = false,
+                        .slb = false };
+  if(!psf) // Error encountered while opening file.
+    return -1;
+
+  int natom = -1;
+  if(readSignature(psf, &sig))
+    natom = readBang(psf, "!NATOM"); // Skips the titles
+  if(natom == -1 || (sink.begin && sink.begin(sink.data, natom)))
+    return -1;
+  int n = scanAtoms(psf, sig, natom, sink);
+  return n==natom ? n : -1;
+}
+
+/**
+ * Read the atom records of a PSF without building a psf struct
+ *
+ * Hands each atom record to the sink as it is parsed, and reads nothing past
+ * the atom section, so that callers which only need atom information (such
+ * as readStruct) neither parse the connectivity sections nor hold a second
+ * copy of the atoms. The begin callback, if not NULL, is called once with the
+ * atom count from the section header before any atom; returning nonzero from
+ * it stops the read.
+ *
+ * @param[in] path The filesystem path to the PSF to be parsed.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if the file is not a valid PSF, the
+ *         read was stopped, or the atom section is incomplete.
+ */
+int readPSFAtoms(const char * path, struct psfsink sink) {
+  FILE * psf = fopen(path,"r");
+  int n = scanPSFAtoms(psf, sink);
+  if(psf)
+    fclose(psf);
+  return n;
+}
+
+/**
+ * Read the atom records of a PSF held in memory without building a psf struct
+ *
+ * As readPSFAtoms, but reads the PSF from a buffer, such as one received over
+ * a pipe or decompressed in memory.
+ *
+ * @param[in] data The contents of the PSF.
+ * @param[in] size The number of bytes in data.
+ * @param[in] sink The sink receiving the atom records.
+ * @return The number of atoms read, or -1 if an error occurs.
+ */
+int readPSFAtomsFromBuffer(const char * data, size_t size,
+    struct psfsink sink) {
+  FILE * psf = openBuffer(data, size);
+  int n = scanPSFAtoms(psf, sink);
+  if(psf)
+    fclose(psf);
+  return n;
+}
+
+/**
+ * Parse an open PSF
  *
  * Parses a PSF file and creates a psf struct containing the successfully
  * parsed information, including flags from the PSF file signature and arrays of
@@ -549,10 +778,10 @@ static int readImpropers(FILE * psf, struct psf * p) {
  * Before using the returned struct, one should verify that the 'valid'
  * subfield is set to 'true'.
  *
- * @param[in] path The filesystem path to the PSF to be parsed.
+ * @param[in] psf The PSF, positioned at its first line, or NULL.
  * @return A psf struct containing all of the parsed information.
  */
-struct psf readPSF(const char * path) {
+static struct psf parsePSF(FILE * psf) {
 
   struct psf p = { .sig = { .valid = false,
                             .ext = false,
@@ -569,47 +798,22 @@ struct psf readPSF(const char * path) {
                    .bonds = NULL,
                    .angles = NULL,
                    .dihedrals = NULL,
-                   .impropers = NULL};
+                   .impropers = NULL,
+                   .table = { .natom = -1 } };
 
-  FILE * psf = fopen(path,"r");
   if(!psf) // Error encountered while opening file.
     return p;
 
-  char buffer[1024]; //For storing one line of the file at a time.
-
-  char * ptr; // For detecting read failures
-
-  ptr = fgets(buffer,1024,psf); //get first line
-  if(ferror(psf) || feof(psf) || ptr==NULL) {
-    fclose(psf);
-    return p; // Error reading first line of file.
-  }
-
-  if(strncmp(buffer,"PSF",3)) {
-    fclose(psf);
+  if(!readSignature(psf, &p.sig))
     return p; // File is not a valid PSF.
-  } else {
-    p.sig.valid=true;
-  }
-
-  // Check for each PSF format specifier
-  if(strstr(buffer,"EXT"))
-    p.sig.ext=true;
-  if(strstr(buffer,"CMAP CHEQ"))
-    p.sig.cmapcheq=true;
-  if(strstr(buffer,"XPLOR"))
-    p.sig.xplor=true;
-  if(strstr(buffer,"SLB"))
-    p.sig.slb=true;
 
   readTitles(psf, &p);
 
   // Read atom data
   readAtoms(psf, &p);
-  if(p.natom == -1) {
-    fclose(psf);
+  if(p.natom == -1)
     return p; // Error reading atom information.
-  }
+  buildTable(&p);
 
   // Read bond data
   readBonds(psf, &p);
@@ -623,7 +827,41 @@ struct psf readPSF(const char * path) {
   // Read improper dihedral data
   readImpropers(psf, &p);
 
-  fclose(psf);
+  return p;
+}
+
+/**
+ * Read data from PSF
+ *
+ * Parses a PSF file into a psf struct; see parsePSF.
+ *
+ * @param[in] path The filesystem path to the PSF to be parsed.
+ * @return A psf struct containing all of the parsed information.
+ */
+struct psf readPSF(const char * path) {
+  FILE * psf = fopen(path,"r");
+  struct psf p = parsePSF(psf);
+  if(psf)
+    fclose(psf);
+  return p;
+}
+
+/**
+ * Read data from a PSF held in memory
+ *
+ * Parses the contents of a PSF from a buffer, such as one received over a
+ * pipe or decompressed in memory, without writing it to a file first; see
+ * parsePSF.
+ *
+ * @param[in] data The contents of the PSF.
+ * @param[in] size The number of bytes in data.
+ * @return A psf struct containing all of the parsed information.
+ */
+struct psf readPSFFromBuffer(const char * data, size_t size) {
+  FILE * psf = openBuffer(data, size);
+  struct psf p = parsePSF(psf);
+  if(psf)
+    fclose(psf);
   return p;
 }
 
@@ -632,8 +870,8 @@ struct psf readPSF(const char * path) {
  *
  * Checks to make sure memory has not already been freed, and if not, frees the
  * arrays used to store title lines, atoms, bonds, angles, dihedrals, and
- * improper dihedrals. Once freed, it sets the pointers for each allocation to
- * NULL to prevent double freeing.
+ * improper dihedrals, as well as the atom table. Once freed, it sets the
+ * pointers for each allocation to NULL to prevent double freeing.
  *
  * @param[in] p the psf struct to be freed.
  */
@@ -652,4 +890,308 @@ void freePSF(struct psf p) {
   sfree((void **) &p.angles);
   sfree((void **) &p.dihedrals);
   sfree((void **) &p.impropers);
+  freeAtomTable(p.table);
+}
+
+/**
+ * Write a PSF section header
+ *
+ * Writes the blank line that separates sections, followed by the count and
+ * title of the section, e.g. "      79 !NBOND: bonds".
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] count The number of elements in the section.
+ * @param[in] width The width of the count field (8, or 10 for EXT).
+ * @param[in] bang The section title, starting with an exclamation point.
+ */
+static void writeBang(struct outbuf * o, int count, int width,
+    const char * bang) {
+  int len = strlen(bang);
+  char * ptr = reserveOut(o, width+len+3);
+  *ptr++ = '\n';
+  ptr = putInt(ptr, count, width);
+  *ptr++ = ' ';
+  ptr = putString(ptr, bang, len, true);
+  *ptr++ = '\n';
+  advanceOut(o, ptr);
+}
+
+/**
+ * Write a section of atom indices to a PSF
+ *
+ * Writes the section header, then the indices, converted back to one-based
+ * numbering, with perline tuples of width indices on each line. An empty
+ * section has one empty line of data, as CHARMM writes it.
+ *
+ * @param[in,out] o The output buffer.
+ * @param[in] idx The zero-based indices, as a flat array.
+ * @param[in] count The number of tuples (-1 is written as an empty section).
+ * @param[in] tuple The number of indices per tuple.
+ * @param[in] perline The number of tuples per line.
+ * @param[in] width The width of each index field (8, or 10 for EXT).
+ * @param[in] bang The section title.
+ */
+static void writeIndices(struct outbuf * o, const int * idx, int count,
+    int tuple, int perline, int width, const char * bang) {
+  if(count<0)
+    count = 0;
+  writeBang(o, count, width, bang);
+  int n = count*tuple;
+  int nline = tuple*perline; // indices per line
+  if(!n) {
+    char * ptr = reserveOut(o, 1);
+    *ptr++ = '\n';
+    advanceOut(o, ptr);
+  }
+  for(int i=0; i<n; i+=nline) {
+    char * ptr = reserveOut(o, nline*(width+12)+1);
+    for(int k=i; k<i+nline && k<n; k++)
+      ptr = putInt(ptr, idx[k]+1, width);
+    *ptr++ = '\n';
+    advanceOut(o, ptr);
+  }
+}
+
+/**
+ * Write a psf struct to a PSF file
+ *
+ * Writes a PSF in the variant described by the signature of the struct (EXT,
+ * CMAP CHEQ, XPLOR and SLB, in any combination), using the same field layouts
+ * that readPSF expects. Fields are formatted directly into a large output
+ * buffer rather than through printf. String fields are written as stored,
+ * truncated or padded to the width of the field.
+ *
+ * Sections that were not read (count of -1) are written as empty sections.
+ * Empty donor, acceptor, nonbonded exclusion and group sections follow the
+ * improper dihedrals, laid out as CHARMM and VMD write them: an empty section
+ * has one empty line of data, and the exclusion pointers follow a blank line
+ * after the !NNB header.
+ *
+ * @param[in] path The filesystem path of the PSF to be written.
+ * @param[in] p The psf struct to be written.
+ * @return 0 on success, or -1 if the struct is invalid or an error occurs.
+ */
+int writePSF(const char * path, struct psf p) {
+  if(!p.sig.valid || p.natom == -1)
+    return -1;
+
+  FILE * psf = fopen(path,"w");
+  if(!psf) // Error encountered while opening file.
+    return -1;
+  struct outbuf o = openOut(psf, 1<<20);
+
+  // File signature
+  char * ptr = reserveOut(&o, 64);
+  ptr = putString(ptr, "PSF", 3, true);
+  if(p.sig.ext)
+    ptr = putString(ptr, " EXT", 4, true);
+  if(p.sig.cmapcheq)
+    ptr = putString(ptr, " CMAP CHEQ", 10, true);
+  if(p.sig.xplor)
+    ptr = putString(ptr, " XPLOR", 6, true);
+  if(p.sig.slb)
+    ptr = putString(ptr, " SLB", 4, true);
+  *ptr++ = '\n';
+  advanceOut(&o, ptr);
+
+  int iwidth = p.sig.ext ? 10 : 8; // Width of counts and indices
+  int swidth = p.sig.ext ? 8 : 4; // Width of string fields
+  int twidth = (p.sig.ext && p.sig.xplor) ? 6 : 4; // Width of atom type
+
+  // Titles
+  int ntitle = p.ntitle<0 ? 0 : p.ntitle;
+  writeBang(&o, ntitle, iwidth, "!NTITLE");
+  for(int i=0; i<ntitle; i++) {
+    int len = strlen(p.titles[i]);
+    ptr = reserveOut(&o, len+1);
+    ptr = putString(ptr, p.titles[i], len, true);
+    *ptr++ = '\n';
+    advanceOut(&o, ptr);
+  }
+
+  // Atoms
+  writeBang(&o, p.natom, iwidth, "!NATOM");
+  for(int i=0; i<p.natom; i++) {
+    struct psfatom * a = &p.atoms[i];
+    // Even with every number at its widest (see PUTFIXED_MAX) a line is
+    // under 200 characters
+    ptr = reserveOut(&o, 256);
+    ptr = putInt(ptr, i+1, iwidth);
+    *ptr++ = ' ';
+    ptr = putString(ptr, a->seg, swidth, true);
+    *ptr++ = ' ';
+    ptr = putString(ptr, a->resid, swidth, true);
+    *ptr++ = ' ';
+    ptr = putString(ptr, a->res, swidth, true);
+    *ptr++ = ' ';
+    ptr = putString(ptr, a->name, swidth, true);
+    *ptr++ = ' ';
+    ptr = putString(ptr, a->type, twidth, true);
+    *ptr++ = ' ';
+    ptr = putFixed(ptr, a->charge, 14, 6);
+    ptr = putFixed(ptr, a->mass, 14, 4);
+    ptr = putInt(ptr, a->imove, 8);
+    if(p.sig.cmapcheq) {
+      ptr = putFixed(ptr, a->ech, 14, 6);
+      ptr = putFixed(ptr, a->eha, 14, 6);
+    }
+    if(p.sig.slb) {
+      *ptr++ = ' ';
+      ptr = putFixed(ptr, a->b, 14, 6);
+    }
+    *ptr++ = '\n';
+    advanceOut(&o, ptr);
+  }
+
+  // Connectivity
+  writeIndices(&o, (const int *) p.bonds, p.nbond, 2, 4, iwidth,
+      "!NBOND: bonds");
+  writeIndices(&o, (const int *) p.angles, p.ntheta, 3, 3, iwidth,
+      "!NTHETA: angles");
+  writeIndices(&o, (const int *) p.dihedrals, p.nphi, 4, 2, iwidth,
+      "!NPHI: dihedrals");
+  writeIndices(&o, (const int *) p.impropers, p.nimphi, 4, 2, iwidth,
+      "!NIMPHI: impropers");
+
+  // Empty sections expected by other PSF readers
+  writeIndices(&o, NULL, 0, 2, 4, iwidth, "!NDON: donors");
+  writeIndices(&o, NULL, 0, 2, 4, iwidth, "!NACC: acceptors");
+  writeBang(&o, 0, iwidth, "!NNB");
+  ptr = reserveOut(&o, 1);
+  *ptr++ = '\n';
+  advanceOut(&o, ptr);
+  for(int i=0; i<p.natom; i+=8) { // One (empty) exclusion pointer per atom
+    ptr = reserveOut(&o, 8*iwidth+1);
+    for(int k=i; k<i+8 && k<p.natom; k++)
+      ptr = putInt(ptr, 0, iwidth);
+    *ptr++ = '\n';
+    advanceOut(&o, ptr);
+  }
+  ptr = reserveOut(&o, 4*iwidth+32);
+  *ptr++ = '\n';
+  ptr = putInt(ptr, 1, iwidth);
+  ptr = putInt(ptr, 0, iwidth);
+  ptr = putString(ptr, " !NGRP NST2", 11, true);
+  *ptr++ = '\n';
+  for(int k=0; k<3; k++)
+    ptr = putInt(ptr, 0, iwidth);
+  *ptr++ = '\n';
+  advanceOut(&o, ptr);
+  if(p.sig.cmapcheq)
+    writeIndices(&o, NULL, 0, 8, 1, iwidth, "!NCRTERM: cross-terms");
+
+  int status = closeOut(&o);
+  if(fclose(psf))
+    status = -1;
+  return status;
+}
+
+/**
+ * Copy the connectivity terms whose atoms are all selected
+ *
+ * Renumbers each tuple through the old-to-new atom map and keeps it only if
+ * every one of its atoms maps to the subset.
+ *
+ * @param[in] src The zero-based indices of the original terms, as a flat
+ *                array.
+ * @param[in] count The number of original terms (-1 if the section is absent).
+ * @param[in] tuple The number of indices per term.
+ * @param[in] map The new index of each original atom, or -1 if not selected.
+ * @param[out] dst The renumbered terms, allocated by this function.
+ * @return The number of terms kept, or -1 if the section is absent.
+ */
+static int subsetIndices(const int * src, int count, int tuple,
+    const int * map, int ** dst) {
+  *dst = NULL;
+  if(count == -1)
+    return -1;
+  *dst = malloc((count ? count : 1) * tuple * sizeof(int));
+  int n = 0;
+  for(int i=0; i<count; i++) {
+    bool keep = true;
+    for(int k=0; k<tuple; k++) {
+      int m = map[src[i*tuple+k]];
+      (*dst)[n*tuple+k] = m;
+      keep = keep && m != -1;
+    }
+    n += keep;
+  }
+  return n;
+}
+
+/**
+ * Extract a subset of the atoms of a PSF
+ *
+ * Creates a new psf struct containing only the selected atoms, in the order
+ * given, along with every bond, angle, dihedral and improper whose atoms are
+ * all selected. Connectivity is renumbered through an old-to-new index map, so
+ * the cost is linear in the size of the PSF. Titles and the signature are
+ * copied, and the atom table is rebuilt for the new atoms.
+ *
+ * @param[in] p The psf struct from which atoms are taken.
+ * @param[in] nsel The number of selected atoms.
+ * @param[in] sel The zero-based indices of the selected atoms, each at most
+ *                once.
+ * @return The new psf struct, which must be freed with freePSF. If the input is
+ *         invalid or an index is out of range, the 'valid' subfield of the
+ *         'sig' field is set to 'false'.
+ */
+struct psf subsetPSF(struct psf p, int nsel, const int * sel) {
+  struct psf s = { .sig = p.sig,
+                   .ntitle = -1,
+                   .natom = -1,
+                   .nbond = -1,
+                   .ntheta = -1,
+                   .nphi = -1,
+                   .nimphi = -1,
+                   .titles = NULL,
+                   .atoms = NULL,
+                   .bonds = NULL,
+                   .angles = NULL,
+                   .dihedrals = NULL,
+                   .impropers = NULL,
+                   .table = { .natom = -1 } };
+  if(!p.sig.valid || p.natom == -1) {
+    s.sig.valid = false;
+    return s;
+  }
+
+  int * map = malloc(p.natom * sizeof(int)); // New index of each old atom
+  for(int i=0; i<p.natom; i++)
+    map[i] = -1;
+  for(int i=0; i<nsel; i++) {
+    if(sel[i]<0 || sel[i]>=p.natom || map[sel[i]] != -1) {
+      free(map);
+      s.sig.valid = false;
+      return s; // Out of range or repeated index
+    }
+    map[sel[i]] = i;
+  }
+
+  if(p.ntitle != -1) {
+    s.ntitle = p.ntitle;
+    s.titles = malloc(s.ntitle * sizeof(char *));
+    for(int i=0; i<s.ntitle; i++) {
+      s.titles[i] = malloc(1024 * sizeof(char));
+      memcpy(s.titles[i], p.titles[i], 1024);
+    }
+  }
+
+  s.natom = nsel;
+  s.atoms = malloc((nsel ? nsel : 1) * sizeof(struct psfatom));
+  for(int i=0; i<nsel; i++)
+    s.atoms[i] = p.atoms[sel[i]];
+  buildTable(&s);
+
+  s.nbond = subsetIndices((const int *) p.bonds, p.nbond, 2, map,
+      (int **) &s.bonds);
+  s.ntheta = subsetIndices((const int *) p.angles, p.ntheta, 3, map,
+      (int **) &s.angles);
+  s.nphi = subsetIndices((const int *) p.dihedrals, p.nphi, 4, map,
+      (int **) &s.dihedrals);
+  s.nimphi = subsetIndices((const int *) p.impropers, p.nimphi, 4, map,
+      (int **) &s.impropers);
+
+  free(map);
+  return s;
 }
@@ -1,6 +1,10 @@
 #ifndef PSF
 #define PSF
 
+#include <stddef.h>
+
+#include "symtab.h"
+
 struct psfatom {
   char seg[9];
   char resid[9];
@@ -56,8 +60,22 @@ struct psf {
   struct angle * angles;
   struct dihedral * dihedrals;
   struct dihedral * impropers;
+
+  struct atomtable table;
+};
+
+struct psfsink {
+  void * data; // passed to each callback
+  int (*begin)(void * data, int natom); // may be NULL
+  void (*atom)(void * data, int i, const struct psfatom * a);
 };
 
 struct psf readPSF(const char * path);
+struct psf readPSFFromBuffer(const char * data, size_t size);
 void freePSF(struct psf p);
+int writePSF(const char * path, struct psf p);
+struct psf subsetPSF(struct psf p, int nsel, const int * sel);
+int readPSFAtoms(const char * path, struct psfsink sink);
+int readPSFAtomsFromBuffer(const char * data, size_t size,
+    struct psfsink sink);
 #endif
@@ -1,60 +1,142 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "pdb.h"
+#include "cif.h"
 #include "psf.h"
 #include "psfpdb.h"
+#include "mapfile.h"
+
+enum { FORMAT_UNKNOWN, FORMAT_PSF, FORMAT_PDB, FORMAT_CIF };
+
+struct structsink {
+  struct psfpdb * s;
+  int cap; // allocated length of the atom array and table
+};
 
 /**
- * Extracts psfpdb struct information from a PSF file
+ * Allocate the atom array and table of a psfpdb struct
  *
- * Reads a psf file and extracts the basic atom information, ignoring other
- * kinds of information that might also be present in the PSF. If an error
- * occurs, nothing is written.
+ * The begin callback of the sinks used by readStruct.
  *
- * @param[in] path The filesystem path to the PSF to be parsed.
- * @param[out] result The psfpdb struct into which the atom data is written
+ * @param[in,out] data The structsink being filled.
+ * @param[in] natom The number of atoms, exact for a PSF and estimated for a
+ *                  PDB.
+ * @return 0.
  */
-static void processPSF(const char * path, struct psfpdb * result) {
-  struct psf p = readPSF(path);
-  if(!p.sig.valid)
-    return;
-  if(p.natom == -1)
-    return;
-  result->natom = p.natom;
-  result->atoms = malloc(result->natom * sizeof(struct atom));
-  for(int i=0; i<p.natom; i++) {
-    memset(result->atoms[i].seg,'\0',11);
-    memset(result->atoms[i].resID,'\0',9);
-    memset(result->atoms[i].resType,'\0',9);
-    memset(result->atoms[i].name,'\0',9);
-    result->atoms[i].charge=0;
+static int beginStruct(void * data, int natom) {
+  struct structsink * k = data;
+  k->cap = natom ? natom : 1;
+  k->s->atoms = malloc(k->cap * sizeof(struct atom));
+  k->s->table = newAtomTable(k->cap);
+  return 0;
+}
 
-    strcpy(result->atoms[i].seg,p.atoms[i].seg);
-    strcpy(result->atoms[i].resID,p.atoms[i].resid);
-    strcpy(result->atoms[i].resType,p.atoms[i].res);
-    strcpy(result->atoms[i].name,p.atoms[i].name);
-    result->atoms[i].charge = p.atoms[i].charge;
+/**
+ * Make room for atom i in a psfpdb struct being filled
+ *
+ * @param[in,out] k The structsink being filled.
+ * @param[in] i The zero-based index of the next atom.
+ * @return The cleared atom record for atom i.
+ */
+static struct atom * nextAtom(struct structsink * k, int i) {
+  if(i==k->cap) {
+    k->cap = k->cap<INT_MAX/2 ? 2*k->cap : INT_MAX;
+    k->s->atoms = realloc(k->s->atoms, k->cap * sizeof(struct atom));
+    resizeAtomTable(&k->s->table, k->cap);
   }
-  freePSF(p);
-  return;
+  struct atom * a = &k->s->atoms[i];
+  memset(a, 0, sizeof(struct atom));
+  return a;
+}
+
+/**
+ * Store a PSF atom record in a psfpdb struct
+ *
+ * The atom callback of the PSF sink used by readStruct. Copies the basic atom
+ * information, ignoring the other fields of the record, and adds the atom to
+ * the atom table.
+ *
+ * @param[in,out] data The structsink being filled.
+ * @param[in] i The zero-based atom index.
+ * @param[in] p The PSF atom record.
+ */
+static void psfAtom(void * data, int i, const struct psfatom * p) {
+  struct structsink * k = data;
+  struct atom * a = nextAtom(k, i);
+  strcpy(a->seg,p->seg);
+  strcpy(a->resID,p->resid);
+  strcpy(a->resType,p->res);
+  strcpy(a->name,p->name);
+  a->charge = p->charge;
+  setTableAtom(&k->s->table,i,p->seg,p->resid,p->res,p->name,p->type,
+      p->charge,p->mass);
+}
+
+/**
+ * Store a PDB atom record in a psfpdb struct
+ *
+ * The atom callback of the PDB sink used by readStruct. Copies the basic atom
+ * information, with the segment and residue ID of pdbSegment and pdbResid
+ * and the nonstandard residue name field, and adds the atom to the atom
+ * table as buildPDBTable would.
+ *
+ * @param[in,out] data The structsink being filled.
+ * @param[in] i The zero-based atom index.
+ * @param[in] p The PDB atom record.
+ */
+static void pdbAtom(void * data, int i, const struct pdbatom * p) {
+  struct structsink * k = data;
+  struct atom * a = nextAtom(k, i);
+  pdbSegment(p,a->seg);
+  pdbResid(p,a->resID);
+  strcpy(a->resType,p->mresName);
+  strcpy(a->name,p->name);
+  a->charge = pdbCharge(p->charge);
+  setTableAtom(&k->s->table,i,a->seg,a->resID,a->resType,a->name,p->element,
+      a->charge,0);
 }
 
 /**
- * Extracts psfpdb struct information from a PDB file
+ * Finish a psfpdb struct filled through a sink
  *
- * Reads a pdb file and extracts the basic atom information, ignoring other
- * kinds of information that might also be present in the PDB. If an error
- * occurs, nothing is written.
+ * Trims the atom array and table to the number of atoms read, or releases
+ * them if the read failed.
  *
- * @param[in] path The filesystem path to the PDB to be parsed.
+ * @param[in,out] k The structsink that was filled.
+ * @param[in] n The number of atoms read, or -1 if the read failed.
+ */
+static void finishStruct(struct structsink * k, int n) {
+  struct psfpdb * s = k->s;
+  if(n == -1) {
+    free(s->atoms);
+    freeAtomTable(s->table);
+    *s = (struct psfpdb) { .natom = -1, .atoms = NULL,
+                           .table = { .natom = -1 } };
+    return;
+  }
+  s->natom = n;
+  s->atoms = realloc(s->atoms, (n ? n : 1) * sizeof(struct atom)); // Trim
+  resizeAtomTable(&s->table, n);
+}
+
+/**
+ * Extracts psfpdb struct information from a pdb struct
+ *
+ * Takes the basic atom information from a pdb struct read from an mmCIF
+ * file, ignoring other kinds of information that might also be present, and
+ * frees the pdb struct. If the pdb struct holds no atoms, nothing is written.
+ *
+ * @param[in] p The pdb struct to be converted.
  * @param[out] result The psfpdb struct into which the atom data is written
  */
-static void processPDB(const char * path, struct psfpdb * result) {
-  struct pdb p = readPDB(path);
-  if(p.natom == -1)
+static void processPDB(struct pdb p, struct psfpdb * result) {
+  if(p.natom == -1) {
+    freePDB(p);
     return;
+  }
   result->natom = p.natom;
   result->atoms = malloc(result->natom * sizeof(struct atom));
   for(int i=0; i<p.natom; i++) {
@@ -64,45 +146,116 @@ static void processPDB(const char * path, struct psfpdb * result) {
     memset(result->atoms[i].name,'\0',9);
     result->atoms[i].charge=0;
 
-    strcpy(result->atoms[i].seg,p.atoms[i].mseg);
-    sprintf(result->atoms[i].resID,"%d",p.atoms[i].mresSeq);
+    pdbSegment(&p.atoms[i],result->atoms[i].seg);
+    pdbResid(&p.atoms[i],result->atoms[i].resID);
     strcpy(result->atoms[i].resType,p.atoms[i].mresName);
     strcpy(result->atoms[i].name,p.atoms[i].name);
-    int abscharge = p.atoms[i].charge[0]-'0';
-    if((0 <= abscharge && abscharge <= 9) && 
-        (p.atoms[i].charge[1]=='-' || p.atoms[i].charge[1]=='+')) {
-      result->atoms[i].charge = abscharge;
-      if(p.atoms[i].charge[1]=='-')
-        result->atoms[i].charge*=-1;
-    }
+    result->atoms[i].charge = pdbCharge(p.atoms[i].charge);
   }
+  // Hand the atom table over to the result instead of rebuilding it
+  result->table = p.table;
+  p.table = (struct atomtable) { .natom = -1 };
   freePDB(p);
   return;
 }
 
 /**
- * Reads atomic structure information from a PSF or PDB file.
+ * Identify the format of a structure file from its contents
+ *
+ * A PSF is recognized by the "PSF" signature at the start of its first line.
+ * Otherwise the lines are examined in turn until one identifies the format:
+ * an mmCIF data block header, loop or atom_site item (possibly indented), or
+ * a PDB ATOM, HETATM or CRYST1 record. Other lines, such as PDB HEADER and
+ * REMARK records or CIF comments, are passed over.
+ *
+ * @param[in] data The contents of the file.
+ * @param[in] size The number of bytes in data.
+ * @return The format, or FORMAT_UNKNOWN.
+ */
+static int sniffFormat(const char * data, size_t size) {
+  if(size>=3 && !strncmp(data,"PSF",3))
+    return FORMAT_PSF;
+  const char * end = data + size;
+  const char * line = data;
+  while(line < end) {
+    const char * eol = memchr(line, '\n', end-line);
+    if(!eol)
+      eol = end; // Last line has no newline
+    size_t len = eol-line;
+    if((len>=4 && !strncmp(line,"ATOM",4)) ||
+        (len>=6 && (!strncmp(line,"HETATM",6) || !strncmp(line,"CRYST1",6))))
+      return FORMAT_PDB;
+    const char * c = line;
+    while(c<eol && (*c==' ' || *c=='\t'))
+      c++;
+    size_t rest = eol-c;
+    if((rest>=5 && (!strncmp(c,"data_",5) || !strncmp(c,"loop_",5))) ||
+        (rest>=11 && !strncmp(c,"_atom_site.",11)))
+      return FORMAT_CIF;
+    line = eol<end ? eol+1 : end;
+  }
+  return FORMAT_UNKNOWN;
+}
+
+/**
+ * Reads atomic structure information from a PSF, PDB or mmCIF file in memory.
+ *
+ * Infers the file type from the contents (see sniffFormat), and uses the
+ * appropriate PSF, PDB or mmCIF header to parse the buffer into a simple
+ * psfpdb struct containing basic atom information. This allows structures
+ * received over a pipe or decompressed in memory to be read without a
+ * temporary file.
+ *
+ * Returns an empty psfpdb struct with natom set to -1 if an error occurs or
+ * the format is not recognized.
+ *
+ * @param[in] data The contents of the PSF, PDB or mmCIF file.
+ * @param[in] size The number of bytes in data.
+ * @return A psfpdb struct containing basic atom information.
+ */
+struct psfpdb readStructFromBuffer(const char * data, size_t size) {
+  struct psfpdb result = { .natom = -1, .atoms = NULL,
+                           .table = { .natom = -1 } };
+  if(!data)
+    return result;
+  // PSF and PDB atom records are converted as they are parsed
+  struct structsink k = { .s = &result, .cap = 0 };
+  switch(sniffFormat(data,size)) {
+    case FORMAT_PSF: {
+      struct psfsink sink = { .data = &k, .begin = beginStruct,
+                              .atom = psfAtom };
+      finishStruct(&k, readPSFAtomsFromBuffer(data,size,sink));
+      break;
+    }
+    case FORMAT_PDB: {
+      struct pdbsink sink = { .data = &k, .begin = beginStruct,
+                              .atom = pdbAtom };
+      finishStruct(&k, readPDBAtomsFromBuffer(data,size,sink));
+      break;
+    }
+    case FORMAT_CIF:
+      processPDB(readCIFFromBuffer(data,size,CIF_ALL),&result);
+      break;
+  }
+  return result;
+}
+
+/**
+ * Reads atomic structure information from a PSF, PDB or mmCIF file.
  * 
- * Infers the file type from the path given, and uses the appropriate PSF or
- * PDB header to parse the file into a simple psfpdb struct containing basic
- * atom information.
+ * Maps the file into memory (or reads it, for pipes and other files that
+ * cannot be mapped) and parses it with readStructFromBuffer, so the file type
+ * is inferred from the contents rather than the file name.
  * 
  * Returns an empty psfpdb struct with natom set to -1 if an error occurs.
  *
- * @param[in] path The filesystem path to the PSF or PDB to be parsed.
+ * @param[in] path The filesystem path to the PSF, PDB or mmCIF file.
  * @return A psfpdb struct containing basic atom information.
  */
 struct psfpdb readStruct(const char * path) {
-  char buf[5]="\0\0\0\0\0";
-  // copy file extension from argument into buffer
-  strcpy(buf,&path[strlen(path)-4]);
-  struct psfpdb result = { .natom = -1, .atoms = NULL};
-  if(!strcmp(buf,".psf")) {
-    processPSF(path,&result);
-  }
-  else if(!strcmp(buf,".pdb")) {
-    processPDB(path,&result);
-  }
+  struct mappedfile m = mapFile(path); // data is NULL on error
+  struct psfpdb result = readStructFromBuffer(m.data, m.size);
+  unmapFile(m);
   return result;
 }
 
@@ -110,8 +263,8 @@ struct psfpdb readStruct(const char * path) {
  * Frees the memory allocated for the structure
  *
  * Checks to make sure memory has not already been freed, and if not, frees the
- * array used to store atom information. Once freed, it sets the pointer to the
- * allocation to NULL to prevent double freeing.
+ * array used to store atom information and the atom table. Once freed, it sets
+ * the pointer to the allocation to NULL to prevent double freeing.
  *
  * @param[in] p the psfpdb struct to be freed.
  */
@@ -120,4 +273,5 @@ void freeStruct(struct psfpdb p) {
     free(p.atoms);
     p.atoms = NULL;
   }
+  freeAtomTable(p.table);
 }
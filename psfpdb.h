@@ -1,6 +1,10 @@
 #ifndef PSFPDB
 #define PSFPDB
 
+#include <stddef.h>
+
+#include "symtab.h"
+
 struct atom {
   char seg[11];
   char resID[9];
@@ -12,8 +16,10 @@ struct atom {
 struct psfpdb {
   int natom;
   struct atom * atoms;
+  struct atomtable table;
 };
 
 struct psfpdb readStruct(const char * path);
+struct psfpdb readStructFromBuffer(const char * data, size_t size);
 void freeStruct(struct psfpdb p);
 #endif
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rmsf.h"
+#include "pdbwrite.h"
+#include "dcd.h"
+#include "pipeline.h"
+
+/**
+ * Create an empty accumulator of atomic fluctuations
+ *
+ * @param[in] natom The number of atoms.
+ * @return The accumulator, with natom set to -1 if natom is negative.
+ */
+struct fluct newFluctuations(int natom) {
+  struct fluct a = { .natom = -1, .nframe = 0, .mx = NULL, .my = NULL,
+                     .mz = NULL, .m2 = NULL };
+  if(natom < 0)
+    return a;
+  a.natom = natom;
+  a.mx = calloc(natom ? natom : 1, sizeof(double));
+  a.my = calloc(natom ? natom : 1, sizeof(double));
+  a.mz = calloc(natom ? natom : 1, sizeof(double));
+  a.m2 = calloc(natom ? natom : 1, sizeof(double));
+  return a;
+}
+
+/**
+ * Frees the memory allocated for an accumulator of atomic fluctuations
+ *
+ * @param[in] a The accumulator to be freed.
+ */
+void freeFluctuations(struct fluct a) {
+  free(a.mx);
+  free(a.my);
+  free(a.mz);
+  free(a.m2);
+}
+
+/**
+ * Add a frame to an accumulator of atomic fluctuations
+ *
+ * Updates the mean position and the sum of squared deviations of every atom
+ * with Welford's method, which stays accurate however many frames are added,
+ * two atoms at a time with SSE2 where available.
+ *
+ * @param[in,out] a The accumulator.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+void addFluctuationFrame(struct fluct * a, const float * xs, const float * ys,
+    const float * zs) {
+  a->nframe++;
+  double inv = 1.0/a->nframe;
+  int i = 0;
+#ifdef __SSE2__
+  __m128d vinv = _mm_set1_pd(inv);
+  for(; i+2<=a->natom; i+=2) {
+    __m128d x = _mm_set_pd(xs[i+1], xs[i]);
+    __m128d y = _mm_set_pd(ys[i+1], ys[i]);
+    __m128d z = _mm_set_pd(zs[i+1], zs[i]);
+    __m128d mx = _mm_loadu_pd(&a->mx[i]);
+    __m128d my = _mm_loadu_pd(&a->my[i]);
+    __m128d mz = _mm_loadu_pd(&a->mz[i]);
+    __m128d dx = _mm_sub_pd(x, mx);
+    __m128d dy = _mm_sub_pd(y, my);
+    __m128d dz = _mm_sub_pd(z, mz);
+    mx = _mm_add_pd(mx, _mm_mul_pd(dx, vinv));
+    my = _mm_add_pd(my, _mm_mul_pd(dy, vinv));
+    mz = _mm_add_pd(mz, _mm_mul_pd(dz, vinv));
+    __m128d m2 = _mm_loadu_pd(&a->m2[i]);
+    m2 = _mm_add_pd(m2, _mm_mul_pd(dx, _mm_sub_pd(x, mx)));
+    m2 = _mm_add_pd(m2, _mm_mul_pd(dy, _mm_sub_pd(y, my)));
+    m2 = _mm_add_pd(m2, _mm_mul_pd(dz, _mm_sub_pd(z, mz)));
+    _mm_storeu_pd(&a->mx[i], mx);
+    _mm_storeu_pd(&a->my[i], my);
+    _mm_storeu_pd(&a->mz[i], mz);
+    _mm_storeu_pd(&a->m2[i], m2);
+  }
+#endif
+  for(; i<a->natom; i++) {
+    double dx = xs[i] - a->mx[i];
+    double dy = ys[i] - a->my[i];
+    double dz = zs[i] - a->mz[i];
+    a->mx[i] += dx*inv;
+    a->my[i] += dy*inv;
+    a->mz[i] += dz*inv;
+    a->m2[i] += dx*(xs[i] - a->mx[i]) + dy*(ys[i] - a->my[i]) +
+                dz*(zs[i] - a->mz[i]);
+  }
+}
+
+/**
+ * Merge one accumulator of atomic fluctuations into another
+ *
+ * Combines the means and sums of squared deviations of two disjoint sets of
+ * frames with the pairwise update of Chan et al., giving the same result as
+ * adding all the frames to one accumulator up to rounding.
+ *
+ * @param[in,out] a The accumulator to merge into.
+ * @param[in] b The accumulator to merge, for the same atoms.
+ */
+void mergeFluctuations(struct fluct * a, const struct fluct * b) {
+  if(!b->nframe)
+    return;
+  long n = a->nframe + b->nframe;
+  double fb = (double) b->nframe / n; // Weight of b in the merged mean
+  double fab = (double) a->nframe * b->nframe / n;
+  for(int i=0; i<a->natom; i++) {
+    double dx = b->mx[i] - a->mx[i];
+    double dy = b->my[i] - a->my[i];
+    double dz = b->mz[i] - a->mz[i];
+    a->mx[i] += dx*fb;
+    a->my[i] += dy*fb;
+    a->mz[i] += dz*fb;
+    a->m2[i] += b->m2[i] + (dx*dx + dy*dy + dz*dz)*fab;
+  }
+  a->nframe = n;
+}
+
+/**
+ * Get the mean structure and the fluctuation of every atom
+ *
+ * @param[in] a The accumulator, with at least one frame.
+ * @param[out] xs The mean x coordinate of every atom, or NULL.
+ * @param[out] ys The mean y coordinate of every atom, or NULL.
+ * @param[out] zs The mean z coordinate of every atom, or NULL.
+ * @param[out] rmsf The root mean square distance of every atom from its
+ *                  mean position, or NULL.
+ */
+void getFluctuations(const struct fluct * a, float * xs, float * ys,
+    float * zs, float * rmsf) {
+  for(int i=0; i<a->natom; i++) {
+    if(xs)
+      xs[i] = a->mx[i];
+    if(ys)
+      ys[i] = a->my[i];
+    if(zs)
+      zs[i] = a->mz[i];
+    if(rmsf)
+      rmsf[i] = sqrt(a->m2[i] / a->nframe);
+  }
+}
+
+struct fluctrun {
+  const struct fitref * r; // reference to fit every frame to, or NULL
+  int natom; // atoms in each frame
+  struct fluct a; // accumulators of every thread merged
+};
+
+/**
+ * Create one thread's accumulator
+ *
+ * The init callback of the pipeline stage of trajectoryFluctuations.
+ *
+ * @param[in] data The fluctrun struct.
+ * @return The thread's accumulator.
+ */
+static void *fluctInit(void * data) {
+  struct fluctrun * u = data;
+  struct fluct * a = malloc(sizeof(struct fluct));
+  *a = newFluctuations(u->natom);
+  return a;
+}
+
+/**
+ * Fit a frame if there is a reference and add it to one thread's accumulator
+ *
+ * The frame callback of the pipeline stage of trajectoryFluctuations.
+ *
+ * @param[in] data The fluctrun struct.
+ * @param[in,out] state The thread's accumulator.
+ * @param[in] f Unused.
+ * @param[in] uc Unused.
+ * @param[in,out] xs The x coordinates of every atom.
+ * @param[in,out] ys The y coordinates of every atom.
+ * @param[in,out] zs The z coordinates of every atom.
+ */
+static void fluctFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct fluctrun * u = data;
+  if(u->r)
+    superpose(u->r, u->natom, xs, ys, zs, 1, NULL);
+  addFluctuationFrame(state, xs, ys, zs);
+}
+
+/**
+ * Merge the accumulator of one thread into that of another
+ *
+ * The combine callback of the pipeline stage of trajectoryFluctuations.
+ *
+ * @param[in] data Unused.
+ * @param[in,out] into The accumulator merged into.
+ * @param[in] from The accumulator merged, which is released.
+ */
+static void fluctCombine(void * data, void * into, void * from) {
+  struct fluct * b = from;
+  mergeFluctuations(into, b);
+  freeFluctuations(*b);
+  free(b);
+}
+
+/**
+ * Hand the merged accumulator of every thread over to the run
+ *
+ * The merge callback of the pipeline stage of trajectoryFluctuations.
+ *
+ * @param[in,out] data The fluctrun struct, receiving the accumulator.
+ * @param[in] state The merged accumulator.
+ */
+static void fluctMerge(void * data, void * state) {
+  struct fluctrun * u = data;
+  u->a = *(struct fluct *) state;
+  free(state);
+}
+
+/**
+ * Accumulate the atomic fluctuations over every frame of a DCD
+ *
+ * Frames are read in parallel by runPipeline in one pass, each thread
+ * adding its frames to its own accumulator. The accumulators are merged
+ * pairwise in a tree, in a fixed order, so the result does not depend on the
+ * scheduling of threads. Since each frame is fitted to a fixed reference,
+ * rather than to the mean structure, no second pass is needed.
+ *
+ * @param[in] path The path of the DCD.
+ * @param[in] r The reference to fit every frame to, as from newFitReference,
+ *              or NULL to use the coordinates as they are.
+ * @return The accumulator, with natom set to -1 if the DCD cannot be read or
+ *         the reference fits atoms the DCD does not have (see fitsFrame).
+ */
+struct fluct trajectoryFluctuations(char * path, const struct fitref * r) {
+  struct fluct none = newFluctuations(-1);
+  struct dcd * d = openDCD(path);
+  if(!d)
+    return none;
+  uint32_t natoms = getNAtoms(d);
+  closeDCD(d);
+  if(r && !fitsFrame(r, (int) natoms))
+    return none;
+
+  struct fluctrun u = { .r = r, .natom = natoms, .a = none };
+  struct stage s = { .data = &u, .mask = NULL, .init = fluctInit,
+                     .frame = fluctFrame, .combine = fluctCombine,
+                     .merge = fluctMerge };
+  if(runPipeline(path, 1, &s, NULL) == -1) {
+    freeFluctuations(u.a);
+    return none;
+  }
+  return u.a;
+}
+
+/**
+ * Write the mean structure to a PDB, with fluctuations as B-factors
+ *
+ * @param[in] path The path of the PDB.
+ * @param[in] s The structure providing atom names, residues and segments.
+ * @param[in] a The accumulator, with at least one frame, for the atoms of
+ *              the structure.
+ * @return 0 on success, or -1 if the PDB cannot be written.
+ */
+int writeFluctuationPDB(const char * path, struct psfpdb s,
+    const struct fluct * a) {
+  if(s.natom != a->natom || !a->nframe)
+    return -1;
+  int n = a->natom ? a->natom : 1;
+  float * xs = malloc(n * sizeof(float));
+  float * ys = malloc(n * sizeof(float));
+  float * zs = malloc(n * sizeof(float));
+  float * rmsf = malloc(n * sizeof(float));
+  getFluctuations(a, xs, ys, zs, rmsf);
+  int status = -1;
+  struct pdbwriter * w = openPDBWriter(path);
+  if(w) {
+    status = writePDBModel(w, s, NULL, xs, ys, zs, rmsf);
+    if(closePDBWriter(w))
+      status = -1;
+  }
+  free(xs);
+  free(ys);
+  free(zs);
+  free(rmsf);
+  return status;
+}
@@ -0,0 +1,26 @@
+#ifndef RMSF
+#define RMSF
+
+#include "align.h"
+#include "psfpdb.h"
+
+struct fluct {
+  int natom;
+  long nframe; // frames accumulated
+  double * mx; // mean coordinates of each atom
+  double * my;
+  double * mz;
+  double * m2; // sum over frames of each atom's squared distance from the mean
+};
+
+struct fluct newFluctuations(int natom);
+void freeFluctuations(struct fluct a);
+void addFluctuationFrame(struct fluct * a, const float * xs, const float * ys,
+    const float * zs);
+void mergeFluctuations(struct fluct * a, const struct fluct * b);
+void getFluctuations(const struct fluct * a, float * xs, float * ys,
+    float * zs, float * rmsf);
+struct fluct trajectoryFluctuations(char * path, const struct fitref * r);
+int writeFluctuationPDB(const char * path, struct psfpdb s,
+    const struct fluct * a);
+#endif
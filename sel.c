@@ -0,0 +1,619 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "sel.h"
+#include "nsearch.h"
+
+// Operations of a compiled selection, evaluated in postfix order on a stack
+// of atom masks
+enum { OP_ALL, OP_NONE, OP_SYMBOL, OP_INDEX, OP_AND, OP_OR, OP_NOT,
+       OP_WITHIN };
+
+struct selop {
+  int code;
+  const int * field; // OP_SYMBOL: symbol ID of each atom
+  char * match; // OP_SYMBOL: 1 for each symbol ID that is selected
+  int nrange; // OP_INDEX: number of inclusive [lo,hi] ranges
+  int * ranges;
+  double radius; // OP_WITHIN
+};
+
+struct selection {
+  int natom;
+  int nop;
+  int cap; // allocated length of ops
+  struct selop * ops;
+  int depth; // most masks on the evaluation stack at once
+  int coords; // 1 if any operation needs coordinates
+};
+
+struct parser {
+  const char * pos; // next character of the selection text
+  char tok[256]; // current token
+  bool end; // true once the text is exhausted
+  bool quoted;
+  const struct atomtable * t;
+  struct selection * s;
+  int depth; // current depth of the evaluation stack
+  bool error;
+};
+
+/**
+ * Read the next token of a selection
+ *
+ * Tokens are separated by whitespace, except that parentheses are tokens of
+ * their own. Values containing spaces or parentheses may be quoted with
+ * single or double quotes.
+ *
+ * @param[in,out] p The parser.
+ */
+static void nextWord(struct parser * p) {
+  const char * c = p->pos;
+  while(*c==' ' || *c=='\t' || *c=='\n' || *c=='\r')
+    c++;
+  p->end = !*c;
+  p->quoted = false;
+  int n = 0;
+  if(*c=='(' || *c==')')
+    p->tok[n++] = *c++;
+  else if(*c=='"' || *c=='\'') {
+    char q = *c++;
+    p->quoted = true;
+    while(*c && *c!=q) {
+      if(n<255)
+        p->tok[n++] = *c;
+      c++;
+    }
+    if(*c)
+      c++;
+    else
+      p->error = true; // Unterminated quote
+  }
+  else {
+    while(*c && !strchr(" \t\n\r()",*c)) {
+      if(n<255)
+        p->tok[n++] = *c;
+      c++;
+    }
+  }
+  p->tok[n] = '\0';
+  p->pos = c;
+}
+
+/**
+ * Test whether the current token is a given reserved word
+ *
+ * @param[in] p The parser.
+ * @param[in] word The word.
+ * @return true if the current token is the unquoted word.
+ */
+static bool isWord(const struct parser * p, const char * word) {
+  return !p->end && !p->quoted && !strcmp(p->tok,word);
+}
+
+/**
+ * Test whether the current token ends a list of values
+ *
+ * @param[in] p The parser.
+ * @return true at the end of the text, a parenthesis or an operator.
+ */
+static bool endOfValues(const struct parser * p) {
+  return p->end || isWord(p,"(") || isWord(p,")") || isWord(p,"and") ||
+    isWord(p,"or") || isWord(p,"not") || isWord(p,"within");
+}
+
+/**
+ * Append an operation to the compiled selection
+ *
+ * Also tracks the depth of the evaluation stack, so that evalSelection can
+ * allocate it up front.
+ *
+ * @param[in,out] p The parser.
+ * @param[in] op The operation.
+ */
+static void emit(struct parser * p, struct selop op) {
+  struct selection * s = p->s;
+  if(s->nop==s->cap) {
+    s->cap *= 2;
+    s->ops = realloc(s->ops, s->cap * sizeof(struct selop));
+  }
+  s->ops[s->nop++] = op;
+  if(op.code==OP_AND || op.code==OP_OR)
+    p->depth--;
+  else if(op.code!=OP_NOT && op.code!=OP_WITHIN)
+    p->depth++;
+  if(p->depth > s->depth)
+    s->depth = p->depth;
+  if(op.code==OP_WITHIN)
+    s->coords = 1;
+}
+
+/**
+ * Parse an integer token
+ *
+ * @param[in] s The token.
+ * @param[out] v The value.
+ * @return true if the whole token is an integer.
+ */
+static bool parseInt(const char * s, long * v) {
+  char * end;
+  *v = strtol(s, &end, 10);
+  return *s && !*end;
+}
+
+/**
+ * Match a string against a pattern with * and ? wildcards
+ *
+ * @param[in] pat The pattern.
+ * @param[in] s The string.
+ * @return true if the string matches.
+ */
+static bool globMatch(const char * pat, const char * s) {
+  const char * star = NULL; // Most recent * in the pattern
+  const char * resume = NULL; // Where the string resumes after it
+  while(*s) {
+    if(*pat=='*') {
+      star = pat++;
+      resume = s;
+    }
+    else if(*pat=='?' || *pat==*s) {
+      pat++;
+      s++;
+    }
+    else if(star) {
+      pat = star+1;
+      s = ++resume;
+    }
+    else
+      return false;
+  }
+  while(*pat=='*')
+    pat++;
+  return !*pat;
+}
+
+static void parseOr(struct parser * p);
+static void parseNot(struct parser * p);
+
+/**
+ * Parse the values of a keyword that selects by symbol
+ *
+ * Every value is resolved against the symbol table once, here, so that the
+ * evaluation only looks up a precomputed flag per atom. Values may contain *
+ * and ? wildcards (unless quoted), and for resid, "lo to hi" selects the
+ * residue IDs that are integers in the inclusive range.
+ *
+ * @param[in,out] p The parser, at the first value.
+ * @param[in] field The symbol ID of each atom for the keyword.
+ * @param[in] numeric Whether ranges are allowed.
+ */
+static void parseSymbols(struct parser * p, const int * field, bool numeric) {
+  const struct symtab * syms = &p->t->syms;
+  struct selop op = { .code = OP_SYMBOL, .field = field,
+                      .match = calloc(syms->nsym ? syms->nsym : 1, 1) };
+  int nval = 0;
+  while(!endOfValues(p)) {
+    char value[256];
+    strcpy(value, p->tok);
+    bool quoted = p->quoted;
+    nextWord(p);
+    nval++;
+    if(isWord(p,"to")) {
+      nextWord(p);
+      long lo, hi, v;
+      if(!numeric || p->end || !parseInt(value,&lo) || !parseInt(p->tok,&hi)) {
+        p->error = true;
+        break;
+      }
+      nextWord(p);
+      for(int i=0; i<syms->nsym; i++)
+        if(parseInt(getSymbol(syms,i),&v) && lo<=v && v<=hi)
+          op.match[i] = 1;
+    }
+    else if(!quoted && strpbrk(value,"*?")) {
+      for(int i=0; i<syms->nsym; i++)
+        if(globMatch(value,getSymbol(syms,i)))
+          op.match[i] = 1;
+    }
+    else {
+      int id = findSymbol(syms,value);
+      if(id >= 0)
+        op.match[id] = 1;
+    }
+  }
+  if(!nval)
+    p->error = true;
+  emit(p, op);
+}
+
+/**
+ * Parse the values of the index keyword
+ *
+ * Values are zero-based atom indices or inclusive "lo to hi" ranges.
+ *
+ * @param[in,out] p The parser, at the first value.
+ */
+static void parseIndices(struct parser * p) {
+  int cap = 8;
+  struct selop op = { .code = OP_INDEX, .nrange = 0,
+                      .ranges = malloc(2*cap * sizeof(int)) };
+  while(!endOfValues(p)) {
+    long lo, hi;
+    if(!parseInt(p->tok,&lo)) {
+      p->error = true;
+      break;
+    }
+    hi = lo;
+    nextWord(p);
+    if(isWord(p,"to")) {
+      nextWord(p);
+      if(p->end || !parseInt(p->tok,&hi)) {
+        p->error = true;
+        break;
+      }
+      nextWord(p);
+    }
+    if(op.nrange==cap) {
+      cap *= 2;
+      op.ranges = realloc(op.ranges, 2*cap * sizeof(int));
+    }
+    // Clamp to the atoms that exist, leaving empty ranges where none do
+    op.ranges[2*op.nrange] = lo<0 ? 0 : lo>p->s->natom ? p->s->natom : lo;
+    op.ranges[2*op.nrange+1] = hi<-1 ? -1 : hi>=p->s->natom ?
+      p->s->natom-1 : hi;
+    op.nrange++;
+  }
+  if(!op.nrange)
+    p->error = true;
+  emit(p, op);
+}
+
+/**
+ * Parse a primary expression: a keyword with its values, or a parenthesized
+ * expression
+ *
+ * @param[in,out] p The parser.
+ */
+static void parsePrimary(struct parser * p) {
+  const struct atomtable * t = p->t;
+  if(p->end || p->quoted) {
+    p->error = true;
+    return;
+  }
+  if(isWord(p,"(")) {
+    nextWord(p);
+    parseOr(p);
+    if(!isWord(p,")")) {
+      p->error = true;
+      return;
+    }
+    nextWord(p);
+    return;
+  }
+  const char * kw = p->tok;
+  const int * field = !strcmp(kw,"segname") ? t->seg :
+                      !strcmp(kw,"resname") ? t->res :
+                      !strcmp(kw,"name") ? t->name :
+                      !strcmp(kw,"type") ? t->type :
+                      !strcmp(kw,"resid") ? t->resid : NULL;
+  if(field) {
+    bool numeric = field==t->resid;
+    nextWord(p);
+    parseSymbols(p, field, numeric);
+  }
+  else if(!strcmp(kw,"index")) {
+    nextWord(p);
+    parseIndices(p);
+  }
+  else if(!strcmp(kw,"all") || !strcmp(kw,"none")) {
+    emit(p, (struct selop) { .code = !strcmp(kw,"all") ? OP_ALL : OP_NONE });
+    nextWord(p);
+  }
+  else
+    p->error = true; // Unknown keyword
+}
+
+/**
+ * Parse a unary expression: "not X", "within R of X", or a primary
+ *
+ * Both prefix operators apply to the unary expression that follows them, so
+ * "within 5 of resname LIG and name CA" selects the CA atoms within 5 of
+ * LIG; parenthesize to select atoms near a compound selection.
+ *
+ * @param[in,out] p The parser.
+ */
+static void parseNot(struct parser * p) {
+  if(isWord(p,"not")) {
+    nextWord(p);
+    parseNot(p);
+    emit(p, (struct selop) { .code = OP_NOT });
+  }
+  else if(isWord(p,"within")) {
+    nextWord(p);
+    char * end;
+    double r = strtod(p->tok, &end);
+    if(p->end || !p->tok[0] || *end || r<0) {
+      p->error = true;
+      return;
+    }
+    nextWord(p);
+    if(!isWord(p,"of")) {
+      p->error = true;
+      return;
+    }
+    nextWord(p);
+    parseNot(p);
+    emit(p, (struct selop) { .code = OP_WITHIN, .radius = r });
+  }
+  else
+    parsePrimary(p);
+}
+
+/**
+ * Parse a conjunction: unary expressions joined by "and"
+ *
+ * @param[in,out] p The parser.
+ */
+static void parseAnd(struct parser * p) {
+  parseNot(p);
+  while(!p->error && isWord(p,"and")) {
+    nextWord(p);
+    parseNot(p);
+    emit(p, (struct selop) { .code = OP_AND });
+  }
+}
+
+/**
+ * Parse a disjunction: conjunctions joined by "or"
+ *
+ * @param[in,out] p The parser.
+ */
+static void parseOr(struct parser * p) {
+  parseAnd(p);
+  while(!p->error && isWord(p,"or")) {
+    nextWord(p);
+    parseAnd(p);
+    emit(p, (struct selop) { .code = OP_OR });
+  }
+}
+
+/**
+ * Compile a selection
+ *
+ * Parses a selection in a VMD-like language into a plan that can be evaluated
+ * over the atom table many times. The language has the keywords segname,
+ * resname, name, type and resid, each followed by one or more values (with *
+ * and ? wildcards; resid also accepts "lo to hi" ranges), index followed by
+ * zero-based atom indices or ranges, all and none, combined with not, and, or
+ * (in decreasing order of precedence) and parentheses. "within R of X"
+ * selects every atom within distance R of an atom of X, and requires
+ * coordinates when the selection is evaluated.
+ *
+ * All strings are resolved against the symbol table of the atom table here,
+ * so the atom table must not be changed or freed while the selection is in
+ * use.
+ *
+ * @param[in] text The selection text.
+ * @param[in] t The atom table.
+ * @return The compiled selection, or NULL if the text is not a valid
+ *         selection or the atom table is empty.
+ */
+struct selection *compileSelection(const char * text,
+    const struct atomtable * t) {
+  if(t->natom == -1)
+    return NULL;
+  struct selection * s = malloc(sizeof(struct selection));
+  *s = (struct selection) { .natom = t->natom, .nop = 0, .cap = 16,
+                            .depth = 0, .coords = 0 };
+  s->ops = malloc(s->cap * sizeof(struct selop));
+  struct parser p = { .pos = text, .t = t, .s = s, .depth = 0,
+                      .error = false };
+  nextWord(&p);
+  parseOr(&p);
+  if(p.error || !p.end) {
+    freeSelection(s);
+    return NULL;
+  }
+  return s;
+}
+
+/**
+ * Frees the memory allocated for a compiled selection
+ *
+ * @param[in] s The selection to be freed.
+ */
+void freeSelection(struct selection * s) {
+  if(!s)
+    return;
+  for(int i=0; i<s->nop; i++) {
+    free(s->ops[i].match);
+    free(s->ops[i].ranges);
+  }
+  free(s->ops);
+  free(s);
+}
+
+/**
+ * Report whether a selection depends on coordinates
+ *
+ * Selections that do not can be evaluated once and reused for every frame.
+ *
+ * @param[in] s The selection.
+ * @return 1 if the selection contains a within clause, or 0 otherwise.
+ */
+int selectionUsesCoords(const struct selection * s) {
+  return s->coords;
+}
+
+/**
+ * Get the number of 64-bit words in an atom mask
+ *
+ * Atom i is bit i%64 of word i/64.
+ *
+ * @param[in] natom The number of atoms.
+ * @return The number of words.
+ */
+int maskWords(int natom) {
+  return (natom+63)/64;
+}
+
+/**
+ * List the atoms set in a mask
+ *
+ * @param[in] mask The atom mask.
+ * @param[in] natom The number of atoms.
+ * @param[out] idx The indices of the selected atoms in ascending order; room
+ *                 for every selected atom is needed.
+ * @return The number of selected atoms.
+ */
+int maskToIndices(const uint64_t * mask, int natom, int * idx) {
+  int n = 0;
+  int nw = maskWords(natom);
+  for(int w=0; w<nw; w++) {
+    uint64_t bits = mask[w];
+    while(bits) {
+      idx[n++] = 64*w + __builtin_ctzll(bits);
+      bits &= bits-1; // Clear the lowest set bit
+    }
+  }
+  return n;
+}
+
+/**
+ * Select the atoms within a distance of the atoms of a mask
+ *
+ * Places the atoms of the mask in the grid of a neighbor search and queries
+ * it with every other atom. Distances are plain, with no periodic images.
+ *
+ * @param[in] natom The number of atoms.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @param[in] r The distance.
+ * @param[in] src The atoms to measure from.
+ * @param[out] dst The atoms within r of an atom of src, including src itself.
+ */
+static void selectWithin(int natom, const float * xs, const float * ys,
+    const float * zs, double r, const uint64_t * src, uint64_t * dst) {
+  int * idx = malloc((natom ? natom : 1) * sizeof(int));
+  int m = maskToIndices(src, natom, idx);
+  struct nsearch * ns = newNeighborSearch(r, 0);
+  updateNeighborSearch(ns, NULL, m, idx, xs, ys, zs);
+
+  // The grid keeps its own copy of the indices, so idx can list the queries
+  int nw = maskWords(natom);
+  int q = 0;
+  for(int w=0; w<nw; w++) {
+    uint64_t bits = ~src[w];
+    if(w==nw-1 && natom%64)
+      bits &= ((uint64_t) 1 << natom%64) - 1;
+    while(bits) {
+      idx[q++] = 64*w + __builtin_ctzll(bits);
+      bits &= bits-1;
+    }
+  }
+  memcpy(dst, src, nw * sizeof(uint64_t));
+  selectNear(ns, q, idx, xs, ys, zs, dst);
+  freeNeighborSearch(ns);
+  free(idx);
+}
+
+/**
+ * Evaluate a compiled selection
+ *
+ * Runs the plan over a stack of atom masks. Keyword tests set 64 atoms per
+ * word from the flags precomputed for each symbol, and the logical operators
+ * combine whole words at a time.
+ *
+ * @param[in] s The selection.
+ * @param[in] xs The x coordinates of every atom, or NULL if the selection
+ *               does not use coordinates.
+ * @param[in] ys The y coordinates of every atom, or NULL.
+ * @param[in] zs The z coordinates of every atom, or NULL.
+ * @param[out] mask The selected atoms, in maskWords(natom) words.
+ * @return The number of selected atoms, or -1 if coordinates are needed but
+ *         not given.
+ */
+int evalSelection(const struct selection * s, const float * xs,
+    const float * ys, const float * zs, uint64_t * mask) {
+  if(s->coords && (!xs || !ys || !zs))
+    return -1;
+  int natom = s->natom;
+  int nw = maskWords(natom);
+  uint64_t tail = natom%64 ? ((uint64_t) 1 << natom%64) - 1 : ~(uint64_t) 0;
+  uint64_t * stack = malloc(((size_t) s->depth * nw + 1) * sizeof(uint64_t));
+  uint64_t * scratch = s->coords ? malloc((nw ? nw : 1) * sizeof(uint64_t))
+                                 : NULL;
+  int top = 0; // Number of masks on the stack
+
+  for(int i=0; i<s->nop; i++) {
+    const struct selop * op = &s->ops[i];
+    uint64_t * a = &stack[(size_t) (top-1)*nw]; // Top of the stack
+    uint64_t * b = &stack[(size_t) top*nw]; // Above the top of the stack
+    switch(op->code) {
+      case OP_ALL:
+        for(int w=0; w<nw; w++)
+          b[w] = ~(uint64_t) 0;
+        if(nw)
+          b[nw-1] = tail;
+        top++;
+        break;
+      case OP_NONE:
+        memset(b, 0, nw * sizeof(uint64_t));
+        top++;
+        break;
+      case OP_SYMBOL:
+        #pragma omp parallel for schedule(static)
+        for(int w=0; w<nw; w++) {
+          int n = natom-64*w < 64 ? natom-64*w : 64;
+          const int * f = &op->field[64*w];
+          uint64_t bits = 0;
+          for(int k=0; k<n; k++)
+            bits |= (uint64_t) op->match[f[k]] << k;
+          b[w] = bits;
+        }
+        top++;
+        break;
+      case OP_INDEX:
+        memset(b, 0, nw * sizeof(uint64_t));
+        for(int r=0; r<op->nrange; r++)
+          for(int k=op->ranges[2*r]; k<=op->ranges[2*r+1]; k++)
+            b[k/64] |= (uint64_t) 1 << k%64;
+        top++;
+        break;
+      case OP_AND:
+        a -= nw;
+        for(int w=0; w<nw; w++)
+          a[w] &= a[w+nw];
+        top--;
+        break;
+      case OP_OR:
+        a -= nw;
+        for(int w=0; w<nw; w++)
+          a[w] |= a[w+nw];
+        top--;
+        break;
+      case OP_NOT:
+        for(int w=0; w<nw; w++)
+          a[w] = ~a[w];
+        if(nw)
+          a[nw-1] &= tail;
+        break;
+      case OP_WITHIN:
+        selectWithin(natom, xs, ys, zs, op->radius, a, scratch);
+        memcpy(a, scratch, nw * sizeof(uint64_t));
+        break;
+    }
+  }
+
+  int count = 0;
+  for(int w=0; w<nw; w++) {
+    mask[w] = stack[w];
+    count += __builtin_popcountll(stack[w]);
+  }
+  free(stack);
+  free(scratch);
+  return count;
+}
@@ -0,0 +1,18 @@
+#ifndef SEL
+#define SEL
+
+#include <stdint.h>
+
+#include "symtab.h"
+
+struct selection;
+
+struct selection *compileSelection(const char * text,
+    const struct atomtable * t);
+void freeSelection(struct selection * s);
+int selectionUsesCoords(const struct selection * s);
+int evalSelection(const struct selection * s, const float * xs,
+    const float * ys, const float * zs, uint64_t * mask);
+int maskWords(int natom);
+int maskToIndices(const uint64_t * mask, int natom, int * idx);
+#endif
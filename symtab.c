@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "symtab.h"
+
+/**
+ * Hash a string
+ *
+ * Computes the 32-bit FNV-1a hash of the first len characters of a string.
+ *
+ * @param[in] str The characters to be hashed.
+ * @param[in] len The number of characters to hash.
+ * @return The hash value.
+ */
+static unsigned int hashString(const char * str, int len) {
+  unsigned int h = 2166136261u;
+  for(int i=0; i<len; i++) {
+    h ^= (unsigned char) str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * Trim whitespace from both ends of a string
+ *
+ * Fixed-width PSF and PDB fields are padded with spaces, which should not be
+ * part of the interned symbol. The string is not modified; instead the start
+ * pointer and length are adjusted.
+ *
+ * @param[in,out] str The start of the string.
+ * @param[in,out] len The length of the string.
+ */
+static void trim(const char ** str, int * len) {
+  while(*len>0 && isspace((unsigned char) (*str)[0])) {
+    (*str)++;
+    (*len)--;
+  }
+  while(*len>0 && isspace((unsigned char) (*str)[*len-1]))
+    (*len)--;
+}
+
+/**
+ * Find the hash slot for a string
+ *
+ * Probes the slot array linearly, starting from the string hash, until either
+ * an empty slot or a slot holding a matching symbol is found.
+ *
+ * @param[in] s The symbol table to search.
+ * @param[in] str The (trimmed) string to search for.
+ * @param[in] len The length of the string.
+ * @return The index of the matching or empty slot.
+ */
+static int findSlot(const struct symtab * s, const char * str, int len) {
+  int mask = s->nslot-1;
+  int k = hashString(str,len) & mask;
+  while(s->slots[k]) {
+    const char * sym = s->syms[s->slots[k]-1];
+    if(!strncmp(sym,str,len) && sym[len]=='\0')
+      break; // Found a match
+    k = (k+1) & mask;
+  }
+  return k;
+}
+
+/**
+ * Double the number of hash slots in a symbol table
+ *
+ * Allocates a larger slot array and reinserts every existing symbol. The
+ * table starts with 64 slots if none have been allocated yet.
+ *
+ * @param[in,out] s The symbol table to be grown.
+ */
+static void growSlots(struct symtab * s) {
+  int * old = s->slots;
+  int nold = s->nslot;
+  s->nslot = nold ? 2*nold : 64;
+  s->slots = calloc(s->nslot, sizeof(int));
+  for(int i=0; i<nold; i++) {
+    if(!old[i])
+      continue;
+    const char * sym = s->syms[old[i]-1];
+    s->slots[findSlot(s,sym,strlen(sym))] = old[i];
+  }
+  free(old);
+}
+
+/**
+ * Intern the first len characters of a string
+ *
+ * Looks up the string in the symbol table, adding it if it is not already
+ * present. Leading and trailing whitespace is ignored, so "CA  " and "CA"
+ * receive the same ID. IDs are assigned consecutively from zero in the order
+ * that symbols are first seen, which makes them suitable as indices into
+ * dense lookup arrays of length nsym.
+ *
+ * @param[in,out] s The symbol table.
+ * @param[in] str The string to be interned. It need not be null-terminated.
+ * @param[in] len The number of characters of str to consider.
+ * @return The ID of the interned symbol.
+ */
+int internSymbolN(struct symtab * s, const char * str, int len) {
+  trim(&str,&len);
+  if(2*(s->nsym+1) > s->nslot)
+    growSlots(s); // Keep the load factor at or below one half
+  int k = findSlot(s,str,len);
+  if(s->slots[k])
+    return s->slots[k]-1; // Symbol already present
+
+  if(s->nsym == s->cap) {
+    s->cap = s->cap ? 2*s->cap : 64;
+    s->syms = realloc(s->syms, s->cap * sizeof(char *));
+  }
+  s->syms[s->nsym] = malloc(len+1);
+  memcpy(s->syms[s->nsym],str,len);
+  s->syms[s->nsym][len] = '\0';
+  s->slots[k] = ++s->nsym;
+  return s->nsym-1;
+}
+
+/**
+ * Intern a null-terminated string
+ *
+ * @param[in,out] s The symbol table.
+ * @param[in] str The string to be interned.
+ * @return The ID of the interned symbol.
+ */
+int internSymbol(struct symtab * s, const char * str) {
+  return internSymbolN(s,str,strlen(str));
+}
+
+/**
+ * Look up the ID of a string without interning it
+ *
+ * Leading and trailing whitespace is ignored, as in internSymbol.
+ *
+ * @param[in] s The symbol table.
+ * @param[in] str The null-terminated string to look up.
+ * @return The ID of the symbol, or -1 if the string has never been interned.
+ */
+int findSymbol(const struct symtab * s, const char * str) {
+  if(!s->nslot)
+    return -1;
+  int len = strlen(str);
+  trim(&str,&len);
+  return s->slots[findSlot(s,str,len)]-1;
+}
+
+/**
+ * Get the string for a symbol ID
+ *
+ * @param[in] s The symbol table.
+ * @param[in] id The symbol ID.
+ * @return The (trimmed) string, or NULL if the ID is out of range.
+ */
+const char * getSymbol(const struct symtab * s, int id) {
+  if(id<0 || id>=s->nsym)
+    return NULL;
+  return s->syms[id];
+}
+
+/**
+ * Frees the memory allocated for a symbol table
+ *
+ * @param[in] s The symbol table to be freed.
+ */
+void freeSymtab(struct symtab s) {
+  for(int i=0; i<s.nsym; i++)
+    free(s.syms[i]);
+  free(s.syms);
+  free(s.slots);
+}
+
+/**
+ * Allocate an atom table
+ *
+ * Allocates a structure-of-arrays atom table with room for natom atoms and an
+ * empty symbol table. Every per-atom array is dense, so selections and
+ * groupings over the table become integer comparisons over contiguous memory.
+ *
+ * @param[in] natom The number of atoms in the table.
+ * @return The allocated atom table.
+ */
+struct atomtable newAtomTable(int natom) {
+  struct atomtable t = { .natom = natom,
+                         .syms = { .nsym = 0,
+                                   .cap = 0,
+                                   .syms = NULL,
+                                   .nslot = 0,
+                                   .slots = NULL } };
+  t.seg = malloc(natom * sizeof(int));
+  t.resid = malloc(natom * sizeof(int));
+  t.res = malloc(natom * sizeof(int));
+  t.name = malloc(natom * sizeof(int));
+  t.type = malloc(natom * sizeof(int));
+  t.charge = malloc(natom * sizeof(double));
+  t.mass = malloc(natom * sizeof(double));
+  return t;
+}
+
+/**
+ * Change the number of atoms an atom table has room for
+ *
+ * Used by readers that do not know the atom count in advance. The entries of
+ * atoms below the new count are kept, and the symbol table is unchanged.
+ *
+ * @param[in,out] t The atom table.
+ * @param[in] natom The new number of atoms.
+ */
+void resizeAtomTable(struct atomtable * t, int natom) {
+  size_t n = natom ? natom : 1;
+  t->natom = natom;
+  t->seg = realloc(t->seg, n * sizeof(int));
+  t->resid = realloc(t->resid, n * sizeof(int));
+  t->res = realloc(t->res, n * sizeof(int));
+  t->name = realloc(t->name, n * sizeof(int));
+  t->type = realloc(t->type, n * sizeof(int));
+  t->charge = realloc(t->charge, n * sizeof(double));
+  t->mass = realloc(t->mass, n * sizeof(double));
+}
+
+/**
+ * Store one atom in an atom table
+ *
+ * Interns each of the string fields into the table's symbol table and stores
+ * the resulting IDs, along with the charge and mass, at index i.
+ *
+ * @param[in,out] t The atom table.
+ * @param[in] i The zero-based atom index.
+ * @param[in] seg The segment name.
+ * @param[in] resid The residue identifier.
+ * @param[in] res The residue name.
+ * @param[in] name The atom name.
+ * @param[in] type The atom type.
+ * @param[in] charge The atom charge.
+ * @param[in] mass The atom mass.
+ */
+void setTableAtom(struct atomtable * t, int i, const char * seg,
+    const char * resid, const char * res, const char * name,
+    const char * type, double charge, double mass) {
+  t->seg[i] = internSymbol(&t->syms,seg);
+  t->resid[i] = internSymbol(&t->syms,resid);
+  t->res[i] = internSymbol(&t->syms,res);
+  t->name[i] = internSymbol(&t->syms,name);
+  t->type[i] = internSymbol(&t->syms,type);
+  t->charge[i] = charge;
+  t->mass[i] = mass;
+}
+
+/**
+ * Frees the memory allocated for an atom table
+ *
+ * @param[in] t The atom table to be freed.
+ */
+void freeAtomTable(struct atomtable t) {
+  freeSymtab(t.syms);
+  free(t.seg);
+  free(t.resid);
+  free(t.res);
+  free(t.name);
+  free(t.type);
+  free(t.charge);
+  free(t.mass);
+}
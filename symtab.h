@@ -0,0 +1,36 @@
+#ifndef SYMTAB
+#define SYMTAB
+
+struct symtab {
+  int nsym;
+  int cap; // allocated length of syms
+  char ** syms;
+  int nslot; // length of the hash slot array, always a power of two
+  int * slots; // symbol ID + 1 for each occupied slot, 0 if empty
+};
+
+struct atomtable {
+  int natom;
+  struct symtab syms;
+  int * seg;
+  int * resid;
+  int * res;
+  int * name;
+  int * type;
+  double * charge;
+  double * mass;
+};
+
+int internSymbol(struct symtab * s, const char * str);
+int internSymbolN(struct symtab * s, const char * str, int len);
+int findSymbol(const struct symtab * s, const char * str);
+const char * getSymbol(const struct symtab * s, int id);
+void freeSymtab(struct symtab s);
+
+struct atomtable newAtomTable(int natom);
+void resizeAtomTable(struct atomtable * t, int natom);
+void setTableAtom(struct atomtable * t, int i, const char * seg,
+    const char * resid, const char * res, const char * name,
+    const char * type, double charge, double mass);
+void freeAtomTable(struct atomtable t);
+#endif
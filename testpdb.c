@@ -1,11 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include "pdb.h"
+#include "cif.h"
 
 
 int main(int argc, const char* argv[]) {
-  struct pdb p = readPDB(argv[1]);
+  // mmCIF files are recognized by extension, and an optional thread count
+  // selects the parallel PDB reader
+  size_t len = strlen(argv[1]);
+  struct pdb p = len > 4 && !strcmp(&argv[1][len-4], ".cif")
+                   ? readCIF(argv[1], CIF_ALL)
+                   : argc > 2 ? readPDBParallel(argv[1], atoi(argv[2]))
+                              : readPDB(argv[1]);
 
   if(p.cell.valid) {
     printf("Unit cell information ( %lf x %lf x %lf ):\n",
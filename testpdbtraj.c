@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "pdbtraj.h"
+
+int main(int argc, const char* argv[]) {
+  if(argc < 2) {
+    printf("Usage: %s <pdb>\n", argv[0]);
+    return -1;
+  }
+  struct pdbtraj *t = openPDBTraj(argv[1]);
+  if(!t) {
+    printf("Error encountered while opening PDB.\n");
+    return -1;
+  }
+
+  uint32_t nframes = getPDBNFrames(t);
+  uint32_t natoms = getPDBNAtoms(t);
+  printf("%u frames of %u atoms found.\n", nframes, natoms);
+
+  if(natoms > 0) {
+    float *xs = malloc(natoms * sizeof(float));
+    float *ys = malloc(natoms * sizeof(float));
+    float *zs = malloc(natoms * sizeof(float));
+    int atomnum = INT_MAX % natoms;
+    for(uint32_t f=0; f<nframes; f++) {
+      goToPDBFrame(t, f);
+      double uc[3];
+      getPDBUnitCell(t, uc);
+      getPDBCoords(t, xs, ys, zs);
+      printf("Frame %u: cell %s ( %lf x %lf x %lf ), atom %d at "
+          "( %f , %f , %f )\n", f, getPDBCryst(t).valid ? "found" : "missing",
+          uc[0], uc[1], uc[2], atomnum, xs[atomnum], ys[atomnum], zs[atomnum]);
+    }
+    free(xs);
+    free(ys);
+    free(zs);
+  }
+
+  closePDBTraj(t);
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pdbwrite.h"
+#include "dcd.h"
+#include "rmsf.h"
+
+int main(int argc, const char* argv[]) {
+  struct pdb p = readPDB(argv[1]);
+  if(p.natom == -1) {
+    printf("Error encountered while reading PDB.\n");
+    return -1;
+  }
+  if(writePDB(argv[2], p))
+    printf("Error writing PDB to %s\n", argv[2]);
+  else
+    printf("%d atoms written to %s\n", p.natom, argv[2]);
+  freePDB(p);
+
+  // Optionally write every frame of a DCD as a model of a multi-model PDB
+  if(argc > 5) {
+    struct psfpdb s = readStruct(argv[3]);
+    struct dcd *d = openDCD((char *) argv[4]);
+    if(s.natom == -1 || !d) {
+      printf("Error encountered while reading structure or trajectory.\n");
+      return -1;
+    }
+    float *xs = malloc(s.natom * sizeof(float));
+    float *ys = malloc(s.natom * sizeof(float));
+    float *zs = malloc(s.natom * sizeof(float));
+    struct pdbwriter * w = openPDBWriter(argv[5]);
+    uint32_t nframes = getNFrames(d);
+    for(uint32_t f=0; f<nframes; f++) {
+      goToFrame(d, f);
+      double uc[3];
+      getUnitCell(d, uc);
+      getCoords(d, xs, ys, zs);
+      struct cryst cell = { .valid = 1, .a = uc[0], .b = uc[1], .c = uc[2],
+                            .alpha = 90, .beta = 90, .gamma = 90,
+                            .sGroup = "P 1", .z = 1 };
+      writePDBModel(w, s, &cell, xs, ys, zs, NULL);
+    }
+    if(closePDBWriter(w))
+      printf("Error writing models to %s\n", argv[5]);
+    else
+      printf("%u models written to %s\n", nframes, argv[5]);
+
+    // Optionally write the mean structure after fitting every frame to the
+    // first, with the fluctuation of each atom as its B-factor
+    if(argc > 6) {
+      goToFrame(d, 0);
+      getCoords(d, xs, ys, zs);
+      struct fitref r = newFitReference(s.natom, NULL, s.table.mass, xs, ys,
+          zs);
+      struct fluct a = trajectoryFluctuations((char *) argv[4], &r);
+      if(a.natom == -1 || writeFluctuationPDB(argv[6], s, &a))
+        printf("Error writing fluctuations to %s\n", argv[6]);
+      else
+        printf("Mean of %ld frames written to %s\n", a.nframe, argv[6]);
+      freeFluctuations(a);
+      freeFitReference(r);
+    }
+    closeDCD(d);
+    free(xs);
+    free(ys);
+    free(zs);
+    freeStruct(s);
+  }
+  return 0;
+}
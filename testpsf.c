@@ -2,6 +2,7 @@
 #include <limits.h>
 
 #include "psf.h"
+#include "topo.h"
 
 
 int main(int argc, const char* argv[]) {
@@ -120,7 +121,38 @@ int main(int argc, const char* argv[]) {
           printf("  %d -- %d -- %d -- %d\n", p.impropers[i].a,p.impropers[i].b,
                                              p.impropers[i].c,p.impropers[i].d);
       }
+
+      printf("\n");
     }
+
+    struct graph g = buildGraph(p);
+    printf("Bonded neighbors of atom %d:", atomnum);
+    for(int k=g.offsets[atomnum]; k<g.offsets[atomnum+1]; k++)
+      printf(" %d", g.neighbors[k]);
+    printf("\n");
+
+    struct fragments f = findFragments(p);
+    int frag = f.atomFrag[atomnum];
+    printf("Number of fragments: %d\n", f.nfrag);
+    printf("Atom %d belongs to fragment %d (%d atoms)\n", atomnum, frag,
+        f.offsets[frag+1]-f.offsets[frag]);
+
+    struct exclusions e = buildExclusions(g, 4);
+    printf("Number of 1-2, 1-3 and 1-4 exclusion pairs: %d\n", e.npair);
+    printf("Sample exclusions for atom %d:\n", atomnum);
+    for(int k=e.offsets[atomnum]; k<e.offsets[atomnum+1]; k++)
+      printf("  1-%d: %d -- %d\n", e.order[k], atomnum, e.partners[k]);
+
+    freeExclusions(e);
+    freeFragments(f);
+    freeGraph(g);
+  }
+
+  if(argc > 2) {
+    if(writePSF(argv[2], p))
+      printf("Error writing PSF to %s\n", argv[2]);
+    else
+      printf("PSF written to %s\n", argv[2]);
   }
 
   freePSF(p);
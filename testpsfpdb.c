@@ -1,10 +1,29 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include "psfpdb.h"
+#include "hier.h"
+#include "sel.h"
+#include "atomindex.h"
 
 int main(int argc, const char* argv[]) {
-  struct psfpdb p = readStruct(argv[1]);
+  // A path of "-" reads the structure from standard input through a buffer
+  struct psfpdb p;
+  if(!strcmp(argv[1],"-")) {
+    size_t n = 0, cap = 1<<16;
+    char * buf = malloc(cap);
+    size_t got;
+    while((got = fread(buf+n, 1, cap-n, stdin)) > 0) {
+      n += got;
+      if(n==cap)
+        buf = realloc(buf, cap*=2);
+    }
+    p = readStructFromBuffer(buf, n);
+    free(buf);
+  } else
+    p = readStruct(argv[1]);
 
   if(p.natom > 0) {
     printf("%d atoms found.\n",p.natom);
@@ -17,6 +36,55 @@ int main(int argc, const char* argv[]) {
     printf("  Residue name: %s\n", a->resType);
     printf("  Atom name: %s\n",a->name);
     printf("  Charge: %lf\n", a->charge);
+
+    struct atomtable * t = &p.table;
+    printf("%d distinct symbols in atom table.\n", t->syms.nsym);
+    printf("Atom table entry for atom %d:\n", atomnum);
+    printf("  Segment: %s (%d)\n", getSymbol(&t->syms,t->seg[atomnum]),
+        t->seg[atomnum]);
+    printf("  Residue ID: %s (%d)\n", getSymbol(&t->syms,t->resid[atomnum]),
+        t->resid[atomnum]);
+    printf("  Residue name: %s (%d)\n", getSymbol(&t->syms,t->res[atomnum]),
+        t->res[atomnum]);
+    printf("  Atom name: %s (%d)\n", getSymbol(&t->syms,t->name[atomnum]),
+        t->name[atomnum]);
+
+    struct hierarchy h = buildHierarchy(t);
+    int res = h.atomRes[atomnum];
+    printf("%d residues in %d segments (%s).\n", h.nres, h.nseg,
+        h.contiguous ? "contiguous" : "not contiguous");
+    printf("Atom %d belongs to residue %d (%d atoms) of segment %d.\n",
+        atomnum, res, h.resOffsets[res+1]-h.resOffsets[res], h.resSeg[res]);
+    freeHierarchy(h);
+
+    struct atomindex x = newAtomIndex(t, 1);
+    printf("Atom index finds atom %d for (%s, %s, %s).\n",
+        findAtom(&x, a->seg, a->resID, a->name), a->seg, a->resID, a->name);
+    if(x.ndup)
+      printf("  %d atoms repeat an earlier atom's triple.\n", x.ndup);
+    freeAtomIndex(x);
+
+    // An optional second argument is a selection over the atom table
+    if(argc > 2) {
+      struct selection * s = compileSelection(argv[2], t);
+      if(!s)
+        printf("Invalid selection: %s\n", argv[2]);
+      else if(selectionUsesCoords(s))
+        printf("Selection needs coordinates: %s\n", argv[2]);
+      else {
+        uint64_t * mask = malloc(maskWords(p.natom) * sizeof(uint64_t));
+        int * idx = malloc(p.natom * sizeof(int));
+        int n = evalSelection(s, NULL, NULL, NULL, mask);
+        maskToIndices(mask, p.natom, idx);
+        printf("%d atoms selected by \"%s\":", n, argv[2]);
+        for(int i=0; i<n && i<10; i++)
+          printf(" %d", idx[i]);
+        printf(n > 10 ? " ...\n" : "\n");
+        free(mask);
+        free(idx);
+      }
+      freeSelection(s);
+    }
   } else {
     printf("No atoms found.\n");
   }
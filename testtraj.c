@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "psf.h"
+#include "topo.h"
+#include "dcd.h"
+#include "pbc.h"
+#include "nsearch.h"
+#include "align.h"
+#include "pairrmsd.h"
+#include "observ.h"
+#include "geom.h"
+#include "pipeline.h"
+#include "msd.h"
+#include "density.h"
+
+/**
+ * Find the longest bond in a frame
+ *
+ * @param[in] p The psf struct containing the bonds.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ * @return The length of the longest bond.
+ */
+static double longestBond(struct psf p, const float * xs, const float * ys,
+    const float * zs) {
+  double longest = 0;
+  for(int i=0; i<p.nbond; i++) {
+    int a = p.bonds[i].a;
+    int b = p.bonds[i].b;
+    double dx = xs[a]-xs[b], dy = ys[a]-ys[b], dz = zs[a]-zs[b];
+    double d = sqrt(dx*dx + dy*dy + dz*dz);
+    if(d > longest)
+      longest = d;
+  }
+  return longest;
+}
+
+struct rmsdstage {
+  const struct fitref * ref;
+  double * rmsd; // RMSD of every frame
+};
+
+struct obsstage {
+  const struct obsplan * plan;
+  struct observables * obs; // observables of every frame
+};
+
+/**
+ * Pipeline stage finding the RMSD of a frame from a reference
+ *
+ * @param[in] data The rmsdstage struct.
+ * @param[in] state Unused.
+ * @param[in] f The frame.
+ * @param[in] uc Unused.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void rmsdFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct rmsdstage * s = data;
+  double a[9], center[3];
+  double g = innerProduct(s->ref, xs, ys, zs, a, center);
+  s->rmsd[f] = qcpRotation(a, (s->ref->g + g)/2, s->ref->wsum, NULL);
+}
+
+/**
+ * Pipeline stage computing the observables of a frame
+ *
+ * @param[in] data The obsstage struct.
+ * @param[in] state Unused.
+ * @param[in] f The frame.
+ * @param[in] uc Unused.
+ * @param[in] xs The x coordinates of every atom.
+ * @param[in] ys The y coordinates of every atom.
+ * @param[in] zs The z coordinates of every atom.
+ */
+static void obsFrame(void * data, void * state, uint32_t f,
+    const double * uc, float * xs, float * ys, float * zs) {
+  struct obsstage * s = data;
+  computeObservables(s->plan, xs, ys, zs, &s->obs[(size_t) 2*f]);
+}
+
+int main(int argc, const char* argv[]) {
+  struct psf p = readPSF(argv[1]);
+  struct dcd *d = openDCD((char *) argv[2]);
+  if(p.natom == -1 || !d) {
+    printf("Error encountered while reading structure or trajectory.\n");
+    return -1;
+  }
+  float *xs = malloc(p.natom * sizeof(float));
+  float *ys = malloc(p.natom * sizeof(float));
+  float *zs = malloc(p.natom * sizeof(float));
+  uint32_t nframes = getNFrames(d);
+  printf("%d atoms, %u frames.\n", p.natom, nframes);
+
+  // Wrap, make whole and unwrap every frame, reporting the longest bond
+  struct graph g = buildGraph(p);
+  struct wholeplan w = buildWholePlan(g);
+  struct unwrapper u = newUnwrapper(p.natom);
+  struct nsearch * ns = newNeighborSearch(3, 1);
+  int * counts = malloc(p.natom * sizeof(int));
+  printf("%d molecules.\n", w.nfrag);
+  for(uint32_t f=0; f<nframes; f++) {
+    goToFrame(d, f);
+    double uc[3];
+    getUnitCell(d, uc);
+    getCoords(d, xs, ys, zs);
+
+    // Contacts within 3 Angstroms, by the minimum image
+    int rebuilt = updateNeighborSearch(ns, uc, p.natom, NULL, xs, ys, zs);
+    countNeighbors(ns, p.natom, NULL, xs, ys, zs, counts);
+    long contacts = 0;
+    for(int i=0; i<p.natom; i++)
+      contacts += counts[i];
+    printf("Frame %u: %ld atom pairs within 3 (grid %s)\n", f, contacts/2,
+        rebuilt ? "rebuilt" : "reused");
+
+    wrapCoords(uc, p.natom, xs, ys, zs);
+    double wrapped = longestBond(p, xs, ys, zs);
+    makeWhole(&w, uc, xs, ys, zs);
+    double whole = longestBond(p, xs, ys, zs);
+    unwrapCoords(&u, uc, xs, ys, zs);
+    printf("Frame %u: box %g x %g x %g, longest bond %g wrapped, %g whole, "
+        "atom 0 unwrapped at (%g, %g, %g)\n", f, uc[0], uc[1], uc[2], wrapped,
+        whole, xs[0], ys[0], zs[0]);
+  }
+  free(counts);
+  freeNeighborSearch(ns);
+  freeUnwrapper(u);
+
+  // Observables of the whole system and of the first molecule
+  int nwords = (p.natom+63)/64;
+  uint64_t * masks[2];
+  for(int s=0; s<2; s++)
+    masks[s] = calloc(nwords ? nwords : 1, sizeof(uint64_t));
+  for(int i=0; i<p.natom; i++)
+    masks[0][i/64] |= (uint64_t) 1 << (i%64);
+  for(int k=w.offsets[0]; k<(w.nfrag > 1 ? w.offsets[1] : p.natom); k++)
+    masks[1][w.order[k]/64] |= (uint64_t) 1 << (w.order[k]%64);
+  struct obsplan op = newObservablePlan(p.natom, 2,
+      (const uint64_t * const *) masks, p.table.mass, p.table.charge);
+  struct observables * obs = observeTrajectory((char *) argv[2], &op, &w,
+      NULL);
+  if(!obs)
+    printf("Error computing observables.\n");
+  else
+    for(uint32_t f=0; f<nframes; f++)
+      printf("Frame %u: Rg %g of system, molecule 0 at (%g, %g, %g) with "
+          "Rg %g and dipole (%g, %g, %g)\n", f, obs[2*f].rg, obs[2*f+1].com[0],
+          obs[2*f+1].com[1], obs[2*f+1].com[2], obs[2*f+1].rg,
+          obs[2*f+1].dipole[0], obs[2*f+1].dipole[1], obs[2*f+1].dipole[2]);
+  free(obs);
+
+  // The same observables and the RMSD of molecule 0 from frame 0, from one
+  // read of only the atoms of molecule 0
+  int nmol = 0;
+  int * mol = malloc(p.natom * sizeof(int));
+  for(int i=0; i<p.natom; i++)
+    if(masks[1][i/64] >> (i%64) & 1)
+      mol[nmol++] = i;
+  goToFrame(d, 0);
+  getCoords(d, xs, ys, zs);
+  struct fitref molref = newFitReference(nmol, mol, p.table.mass, xs, ys, zs);
+  struct observables * molobs = malloc(nframes * 2 * sizeof(*molobs));
+  double * molrmsd = malloc(nframes * sizeof(double));
+  struct rmsdstage rs = { &molref, molrmsd };
+  struct obsstage os = { &op, molobs };
+  struct stage stages[2] = {
+    { .data = &rs, .mask = masks[1], .init = NULL, .frame = rmsdFrame,
+      .combine = NULL, .merge = NULL },
+    { .data = &os, .mask = masks[1], .init = NULL, .frame = obsFrame,
+      .combine = NULL, .merge = NULL }
+  };
+  double io;
+  if(runPipeline((char *) argv[2], 2, stages, &io) == -1)
+    printf("Error running pipeline.\n");
+  else {
+    for(uint32_t f=0; f<nframes; f++)
+      printf("Frame %u: molecule 0 RMSD %g from frame 0, at (%g, %g, %g)\n", f,
+          molrmsd[f], molobs[2*f+1].com[0], molobs[2*f+1].com[1],
+          molobs[2*f+1].com[2]);
+    printf("Pipeline took %g s reading, %g s RMSD, %g s observables\n", io,
+        stages[0].seconds, stages[1].seconds);
+  }
+  free(molobs);
+  free(molrmsd);
+  freeFitReference(molref);
+  free(mol);
+  freeObservablePlan(op);
+
+  // Density of the whole system on a 2 Angstrom grid
+  struct density rho = densityMap((char *) argv[2], masks[0], p.natom, 2,
+      NULL);
+  if(rho.nframe == -1)
+    printf("Error mapping density.\n");
+  else {
+    size_t nvox = (size_t) rho.n[0]*rho.n[1]*rho.n[2], occupied = 0;
+    double peak = 0;
+    for(size_t k=0; k<nvox; k++) {
+      occupied += rho.rho[k] > 0;
+      peak = rho.rho[k] > peak ? rho.rho[k] : peak;
+    }
+    printf("Density on %d x %d x %d grid: %zu voxels occupied, peak %g\n",
+        rho.n[0], rho.n[1], rho.n[2], occupied, peak);
+  }
+  freeDensity(rho);
+  free(masks[0]);
+  free(masks[1]);
+  freeWholePlan(w);
+  freeGraph(g);
+
+  // Mass-weighted RMSD of every frame to the first, optionally writing the
+  // aligned frames
+  goToFrame(d, 0);
+  getCoords(d, xs, ys, zs);
+  struct fitref ref = newFitReference(p.natom, NULL, p.table.mass, xs, ys, zs);
+  double * rmsd = alignTrajectory((char *) argv[2], &ref,
+      argc > 3 ? (char *) argv[3] : NULL);
+  if(!rmsd)
+    printf("Error aligning trajectory.\n");
+  else {
+    for(uint32_t f=0; f<nframes; f++)
+      printf("Frame %u: RMSD %g from frame 0\n", f, rmsd[f]);
+    if(argc > 3)
+      printf("Aligned frames written to %s\n", argv[3]);
+  }
+  free(rmsd);
+  freeFitReference(ref);
+
+  // Backbone dihedrals of the first residue with both, and the spread of
+  // the first bond length
+  struct geomterms bb = backboneTerms(p);
+  float * phipsi = bb.ndihed ? geometrySeries((char *) argv[2], &bb, 1, NULL)
+                             : NULL;
+  if(phipsi)
+    for(uint32_t f=0; f<nframes; f++)
+      printf("Frame %u: phi %g psi %g\n", f, phipsi[f], phipsi[nframes+f]);
+  free(phipsi);
+  freeGeomTerms(bb);
+  struct geomterms terms = allTerms(p, 1);
+  struct geomhist h = newGeomHistogram(&terms, 20, 2);
+  if(terms.nbond > 0 &&
+      histogramGeometry((char *) argv[2], &terms, 1, &h) > 0) {
+    printf("Bond 0 length histogram over [0, 2):");
+    for(int b=0; b<h.nbin; b++)
+      printf(" %u", h.counts[b]);
+    printf("\n");
+  }
+  freeGeomHistogram(h);
+  freeGeomTerms(terms);
+
+  // MSD of the residue centers of mass, with a diffusion coefficient per
+  // frame from the first half of the lags
+  struct msdgroups rg = residueGroups(&p.table, NULL);
+  struct msd md = computeMSD((char *) argv[2], &rg, 1, 0);
+  if(md.nlag == -1)
+    printf("Error computing MSD.\n");
+  else {
+    for(int j=0; j<md.nlag; j++)
+      printf("Lag %d: MSD %g over %d residues\n", j, md.mean[j], md.ngroup);
+    printf("Diffusion coefficient %g per frame\n",
+        fitDiffusion(&md, 1, 1, md.nlag/2));
+  }
+  freeMSD(md);
+  freeMSDGroups(rg);
+
+  struct frameset fs = loadFrames((char *) argv[2], p.natom, NULL,
+      p.table.mass);
+  if(fs.nframe < 0)
+    printf("Error loading frames.\n");
+  else {
+    struct rmsdmatrix m = pairwiseRMSD(&fs, 0, NULL);
+    for(int j=1; j<fs.nframe; j++)
+      printf("Frames 0 and %d: RMSD %g\n", j, getRMSD(&m, 0, j));
+    freeRMSDMatrix(m);
+  }
+  freeFrames(fs);
+
+  closeDCD(d);
+  free(xs);
+  free(ys);
+  free(zs);
+  freePSF(p);
+  return 0;
+}
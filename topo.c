@@ -0,0 +1,260 @@
+#include <stdlib.h>
+
+#include "topo.h"
+
+/**
+ * Build the bond graph of a PSF
+ *
+ * Converts the bond list of a psf struct into a compressed sparse row (CSR)
+ * adjacency structure in two passes over the bonds: one to count the degree
+ * of each atom, and one to place each bond in the neighbor lists of both of
+ * its atoms. The neighbors of each atom are sorted in ascending order.
+ *
+ * If the PSF has no bond section, every atom is given an empty neighbor list.
+ * If the PSF has no atoms, natom is set to -1 and no memory is allocated.
+ *
+ * @param[in] p The psf struct containing the bonds.
+ * @return The bond graph.
+ */
+struct graph buildGraph(struct psf p) {
+  struct graph g = { .natom = -1, .offsets = NULL, .neighbors = NULL };
+  if(p.natom == -1)
+    return g;
+  int nbond = p.nbond==-1 ? 0 : p.nbond;
+
+  g.natom = p.natom;
+  g.offsets = calloc(g.natom+1, sizeof(int));
+  g.neighbors = malloc(2*nbond * sizeof(int));
+
+  // Count the degree of each atom, shifted by one for the prefix sum
+  for(int i=0; i<nbond; i++) {
+    g.offsets[p.bonds[i].a+1]++;
+    g.offsets[p.bonds[i].b+1]++;
+  }
+  for(int i=0; i<g.natom; i++)
+    g.offsets[i+1] += g.offsets[i];
+
+  // Scatter each bond into both neighbor lists
+  int * fill = malloc(g.natom * sizeof(int));
+  for(int i=0; i<g.natom; i++)
+    fill[i] = g.offsets[i];
+  for(int i=0; i<nbond; i++) {
+    g.neighbors[fill[p.bonds[i].a]++] = p.bonds[i].b;
+    g.neighbors[fill[p.bonds[i].b]++] = p.bonds[i].a;
+  }
+  free(fill);
+
+  // Neighbor lists are short, so insertion sort is sufficient
+  for(int i=0; i<g.natom; i++) {
+    for(int j=g.offsets[i]+1; j<g.offsets[i+1]; j++) {
+      int v = g.neighbors[j];
+      int k = j;
+      for(; k>g.offsets[i] && g.neighbors[k-1]>v; k--)
+        g.neighbors[k] = g.neighbors[k-1];
+      g.neighbors[k] = v;
+    }
+  }
+  return g;
+}
+
+/**
+ * Frees the memory allocated for a bond graph
+ *
+ * @param[in] g The graph to be freed.
+ */
+void freeGraph(struct graph g) {
+  free(g.offsets);
+  free(g.neighbors);
+}
+
+/**
+ * Find the root of an atom in a union-find forest
+ *
+ * Uses path halving, so that repeated lookups stay close to constant time.
+ *
+ * @param[in,out] parent The parent of each atom in the forest.
+ * @param[in] i The atom whose root is sought.
+ * @return The root atom.
+ */
+static int findRoot(int * parent, int i) {
+  while(parent[i]!=i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+/**
+ * Find the covalently bonded fragments (molecules) of a PSF
+ *
+ * Joins the two atoms of every bond in a union-find forest, then numbers the
+ * resulting sets in order of their lowest atom index. Atoms without bonds form
+ * fragments of their own. The atoms of each fragment are also stored
+ * contiguously, in ascending order, so that per-molecule loops need not scan
+ * the whole system.
+ *
+ * If the PSF has no atoms, natom and nfrag are set to -1.
+ *
+ * @param[in] p The psf struct containing the bonds.
+ * @return The fragment assignment of every atom.
+ */
+struct fragments findFragments(struct psf p) {
+  struct fragments f = { .natom = -1, .nfrag = -1, .atomFrag = NULL,
+                         .offsets = NULL, .atoms = NULL };
+  if(p.natom == -1)
+    return f;
+  int nbond = p.nbond==-1 ? 0 : p.nbond;
+  f.natom = p.natom;
+
+  int * parent = malloc(f.natom * sizeof(int));
+  for(int i=0; i<f.natom; i++)
+    parent[i] = i;
+  for(int i=0; i<nbond; i++) {
+    int ra = findRoot(parent,p.bonds[i].a);
+    int rb = findRoot(parent,p.bonds[i].b);
+    // Always attach to the lower root, so that each root is the lowest atom
+    if(ra<rb)
+      parent[rb] = ra;
+    else if(rb<ra)
+      parent[ra] = rb;
+  }
+
+  // Roots are the lowest atom of their set, so they are visited first
+  f.atomFrag = malloc(f.natom * sizeof(int));
+  f.nfrag = 0;
+  for(int i=0; i<f.natom; i++) {
+    int r = findRoot(parent,i);
+    f.atomFrag[i] = (r==i) ? f.nfrag++ : f.atomFrag[r];
+  }
+  free(parent);
+
+  // Group atoms by fragment with a counting sort
+  f.offsets = calloc(f.nfrag+1, sizeof(int));
+  f.atoms = malloc(f.natom * sizeof(int));
+  for(int i=0; i<f.natom; i++)
+    f.offsets[f.atomFrag[i]+1]++;
+  for(int i=0; i<f.nfrag; i++)
+    f.offsets[i+1] += f.offsets[i];
+  int * fill = malloc(f.nfrag * sizeof(int));
+  for(int i=0; i<f.nfrag; i++)
+    fill[i] = f.offsets[i];
+  for(int i=0; i<f.natom; i++)
+    f.atoms[fill[f.atomFrag[i]]++] = i;
+  free(fill);
+  return f;
+}
+
+/**
+ * Frees the memory allocated for a fragment assignment
+ *
+ * @param[in] f The fragments to be freed.
+ */
+void freeFragments(struct fragments f) {
+  free(f.atomFrag);
+  free(f.offsets);
+  free(f.atoms);
+}
+
+/**
+ * Generate nonbonded exclusion pairs from a bond graph
+ *
+ * Performs a breadth-first search of depth maxorder-1 bonds from every atom,
+ * recording each atom reached along with the number of atoms on the shortest
+ * path between them (2 for 1-2 pairs, 3 for 1-3 pairs and 4 for 1-4 pairs).
+ * Pairs are stored once, under the lower atom index, with partners in
+ * ascending order.
+ *
+ * @param[in] g The bond graph.
+ * @param[in] maxorder The highest pair order to include, from 2 to 4.
+ * @return The exclusion pairs, or a struct with natom set to -1 if the graph
+ *         is empty or maxorder is out of range.
+ */
+struct exclusions buildExclusions(struct graph g, int maxorder) {
+  struct exclusions e = { .natom = -1, .npair = 0, .offsets = NULL,
+                          .partners = NULL, .order = NULL };
+  if(g.natom == -1 || maxorder<2 || maxorder>4)
+    return e;
+  e.natom = g.natom;
+  e.offsets = malloc((e.natom+1) * sizeof(int));
+
+  int cap = 1024; // Capacity of the pair arrays, grown by doubling
+  e.partners = malloc(cap * sizeof(int));
+  e.order = malloc(cap * sizeof(char));
+
+  int * seen = malloc(e.natom * sizeof(int)); // Last root to reach each atom
+  for(int i=0; i<e.natom; i++)
+    seen[i] = -1;
+  int qcap = 64; // Capacity of the search queue
+  int * queue = malloc(qcap * sizeof(int));
+  char * depth = malloc(qcap * sizeof(char));
+
+  for(int i=0; i<e.natom; i++) {
+    e.offsets[i] = e.npair;
+    int head = 0;
+    int tail = 0;
+    queue[tail] = i;
+    depth[tail++] = 1;
+    seen[i] = i;
+    while(head<tail) {
+      int u = queue[head];
+      char d = depth[head++];
+      if(d==maxorder)
+        continue; // Do not search past the highest order
+      for(int k=g.offsets[u]; k<g.offsets[u+1]; k++) {
+        int v = g.neighbors[k];
+        if(seen[v]==i)
+          continue; // Already reached by a path at least as short
+        seen[v] = i;
+        if(tail==qcap) {
+          qcap*=2;
+          queue = realloc(queue, qcap * sizeof(int));
+          depth = realloc(depth, qcap * sizeof(char));
+        }
+        queue[tail] = v;
+        depth[tail++] = d+1;
+        if(v<i)
+          continue; // Pair is stored under the lower atom
+        if(e.npair==cap) {
+          cap*=2;
+          e.partners = realloc(e.partners, cap * sizeof(int));
+          e.order = realloc(e.order, cap * sizeof(char));
+        }
+        e.partners[e.npair] = v;
+        e.order[e.npair++] = d+1;
+      }
+    }
+
+    // Sort this atom's partners, carrying the pair order along
+    for(int j=e.offsets[i]+1; j<e.npair; j++) {
+      int v = e.partners[j];
+      char o = e.order[j];
+      int k = j;
+      for(; k>e.offsets[i] && e.partners[k-1]>v; k--) {
+        e.partners[k] = e.partners[k-1];
+        e.order[k] = e.order[k-1];
+      }
+      e.partners[k] = v;
+      e.order[k] = o;
+    }
+  }
+  e.offsets[e.natom] = e.npair;
+  free(seen);
+  free(queue);
+  free(depth);
+
+  // Trim the pair arrays
+  e.partners = realloc(e.partners, (e.npair ? e.npair : 1) * sizeof(int));
+  e.order = realloc(e.order, (e.npair ? e.npair : 1) * sizeof(char));
+  return e;
+}
+
+/**
+ * Frees the memory allocated for exclusion pairs
+ *
+ * @param[in] e The exclusions to be freed.
+ */
+void freeExclusions(struct exclusions e) {
+  free(e.offsets);
+  free(e.partners);
+  free(e.order);
+}
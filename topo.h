@@ -0,0 +1,34 @@
+#ifndef TOPO
+#define TOPO
+
+#include "psf.h"
+
+struct graph {
+  int natom;
+  int * offsets; // neighbors of atom i are neighbors[offsets[i]..offsets[i+1]]
+  int * neighbors;
+};
+
+struct fragments {
+  int natom;
+  int nfrag;
+  int * atomFrag; // fragment index of each atom
+  int * offsets; // atoms of fragment f are atoms[offsets[f]..offsets[f+1]]
+  int * atoms;
+};
+
+struct exclusions {
+  int natom;
+  int npair;
+  int * offsets; // partners of atom i are partners[offsets[i]..offsets[i+1]]
+  int * partners; // only partners j > i are stored
+  char * order; // 2, 3 or 4 for 1-2, 1-3 and 1-4 pairs
+};
+
+struct graph buildGraph(struct psf p);
+void freeGraph(struct graph g);
+struct fragments findFragments(struct psf p);
+void freeFragments(struct fragments f);
+struct exclusions buildExclusions(struct graph g, int maxorder);
+void freeExclusions(struct exclusions e);
+#endif